@@ -21,6 +21,14 @@
 	The KSC APIs are kept as simple as possible, you may refer to each API for the details.
 */
 
+/**
+	The context handle is the representation of one KSC compiler instance. Each context has its own shared code,
+	LLVM context and JIT execution engine, so the threads working with different contexts compile and JIT at 
+	the same time without blocking each other. The handles of the modules, functions and structures belong to
+	the context that they are compiled in.
+*/
+typedef void* KSC_ContextHandle;
+
 /**
 	The module handle is the representation for one compiling session. The compiling infomation are kept within 
 	the domain of module so different modules cannot share any information. 
@@ -37,6 +45,12 @@ typedef void* StructHandle;
 */
 typedef void* FunctionHandle;
 
+/**
+	The callback that receives the JIT-ed function pointer of the asynchronous JIT request, "funcPtr" is NULL if 
+	the JIT fails. It is invoked on the JIT worker thread.
+*/
+typedef void (*KSC_JITCallback)(FunctionHandle hFunc, void* funcPtr, void* userData);
+
 namespace SC {
 	// The following are the single-value types that KSC support.
 	typedef float Float;
@@ -70,8 +84,33 @@ namespace SC {
 		kInvalid
 	};
 
+	// The optimization levels that a module can be compiled with.
+	enum OptLevel {
+		kOptNone,		// No IR optimization, fastest to compile
+		kOptLess,		// Function-level scalar optimizations only
+		kOptDefault,	// Module-level pipeline with inlining, loop unrolling and vectorization
+		kOptAggressive,	// Same as kOptDefault with more aggressive inlining and optimizations
+		kOptSize		// Optimize for smaller code size, no vectorization
+	};
+
+	// The memory layouts of the structure arrays.
+	enum MemLayout {
+		kLayoutPacked,	// Array of structures as declared in the hosting C++ code, the vectors are arrays of scalars
+		kLayoutKSC,		// Array of structures in the KSC layout, see "isKSCLayout" of KSC_TypeInfo
+		kLayoutSoA		// Structure of arrays, each scalar component of the structure is its own aligned stream
+	};
+
 }
 
+// Pass this as the stride of a structure argument(or the return value) of the array driver to have it read and
+// written in the SoA layout, see "KSC_GetArrayDriver".
+#define KSC_SOA_STRIDE (-1)
+
+// The name of the built-in argument that receives the index of the element the invocation runs for, it must be 
+// an "int" passed by value. e.g. "void Scale(float% data[], int SV_DispatchThreadID)". The array driver and the
+// dispatch fill it in, its base pointer is ignored. The direct calls pass it like any other argument.
+#define KSC_DISPATCH_THREAD_ID "SV_DispatchThreadID"
+
 /** 
 	The type information retrieved KSC APIs.
 
@@ -105,6 +144,29 @@ struct KSC_TypeInfo
 	bool isKSCLayout;
 };
 
+/**
+	The options to compile a KSC module with. Passing NULL to the compiling APIs is the same as
+	passing the default-constructed options.
+*/
+struct KSC_CompileOptions
+{
+	SC::OptLevel optLevel;
+	// When it is non-zero, the module is JIT-ed quickly without optimization first. Once any of its functions
+	// is called this many times via the JIT-ed pointer, the module is JIT-ed again with "optLevel" in the 
+	// background and the JIT-ed pointers are redirected to the optimized code.
+	int tierUpThreshold;
+	// When it is true, all the float operations are generated with the fast-math flags, which allows LLVM to
+	// reassociate, contract and approximate them at the cost of the exact IEEE results. The functions and code blocks
+	// with the "[precise]" attribute are excluded, while "[fastmath]" enables it for a single function or code block.
+	bool fastMath;
+	// When it is greater than one, the functions of the module are split into this many parts, which are optimized
+	// and JIT-ed on their own threads and then linked together, so a large module is JIT-ed about that much faster.
+	// The calls across the parts are not inlined. It is ignored by the tiered modules.
+	int codeGenThreads;
+
+	KSC_CompileOptions() : optLevel(SC::kOptDefault), tierUpThreshold(0), fastMath(false), codeGenThreads(0) {}
+};
+
 extern "C" {
 
 	/**
@@ -113,14 +175,29 @@ extern "C" {
 		that will link with KSCL.
 		In KSCL side, you still need to declare the function without body implementation in order to let KSC know
 		it should look up in the external symbol for the implementation of this function.
-		NOTE: this function must be invoked before KSC_Initialize() is invoked.
+		The external functions are shared by all the contexts.
+		NOTE: this function must be invoked before KSC_Initialize() or KSC_CreateContext() is invoked.
 	*/
 	KSC_API bool KSC_AddExternalFunction(const char* funcName, void* funcPtr);
 
 	/**
-		The initialization function of KSC. It should be called before any other APIs get called.
+		By default KSC generates the code for the host CPU, with all the instruction set extensions it supports.
+		Use this function to pin the CPU name(e.g. "haswell") and the comma-separated feature list(e.g. "+avx2,+fma,-avx512f"), 
+		so that the JIT-ed code is the same on the machines with different hardware. Passing NULL or empty string 
+		for "cpuName" keeps the host CPU name while the features are still overridden.
+		NOTE: this function must be invoked before KSC_Initialize() or KSC_CreateContext() is invoked, otherwise it will fail.
+	*/
+	KSC_API bool KSC_SetTargetCPU(const char* cpuName, const char* features = NULL);
+
+	/**
+		The initialization function of KSC. It creates the default context, which the APIs without the context
+		handle(e.g. "KSC_Compile") work in. It should be called before those APIs get called.
 		The argument "sharedCode" is the code that will be shared between multiple modules, e.g. some global
 		functions or structure definitions. If the shared code contains bad syntax this function will fail.
+		The built-in functions sin, cos, pow, sqrt, fabs, dot, cross, length, normalize, lerp, saturate, mad, rsqrt,
+		min, max and clamp are generated inline for the arguments of any vector width, so are any and all for the
+		boolean arguments. A function defined with the name of a built-in one shadows it with a warning, remove the
+		definition to get the built-in function.
 	*/
 	KSC_API bool KSC_Initialize(const char* sharedCode = NULL);
 
@@ -132,26 +209,193 @@ extern "C" {
 	*/
 	KSC_API void KSC_Destory();
 
+	/**
+		This function creates a context independent of the default one, "sharedCode" works the same as the one of 
+		"KSC_Initialize". NULL is returned on failure, call "KSC_GetContextErrorMsg" with NULL for the error message.
+		Different contexts can be used from different threads at the same time, while the calls on the same 
+		context are serialized. "KSC_Initialize" is not needed if only the explicit contexts are used.
+	*/
+	KSC_API KSC_ContextHandle KSC_CreateContext(const char* sharedCode = NULL);
+
+	/**
+		This function destroys the context along with all the modules in it, the handles and the JIT-ed functions 
+		of the context are invalid afterwards. Destroying the default context is the same as "KSC_Destory".
+	*/
+	KSC_API void KSC_DestroyContext(KSC_ContextHandle hContext);
+
+	/**
+		This function returns the context created by "KSC_Initialize", or NULL if KSC is not initialized.
+	*/
+	KSC_API KSC_ContextHandle KSC_GetDefaultContext();
+
+	/**
+		This function returns the error message of the last failed API on the context, passing NULL returns the
+		error of the API that fails without a context on the calling thread, e.g. "KSC_CreateContext".
+	*/
+	KSC_API const char* KSC_GetContextErrorMsg(KSC_ContextHandle hContext);
+
 	/**
 		If any KSC API fails for whatever reason including compiling error, call this function to retrieve
-		the error message.
+		the error message. It is the error message of the default context, see "KSC_GetContextErrorMsg".
 	*/
 	KSC_API const char* KSC_GetLastErrorMsg();
 
 	/**
 		This function compiles the KSCL code, it will return the module handle on succeed otherwise return NULL.
+		The "pOptions" specifies how the module is optimized when it is JIT-ed, e.g. use "kOptNone" for quick 
+		iterations and "kOptAggressive" for the best code quality.
+	*/
+	KSC_API ModuleHandle KSC_Compile(const char* sourceCode, const KSC_CompileOptions* pOptions = NULL);
+	KSC_API ModuleHandle KSC_CompileFile(const char* srcFileName, const KSC_CompileOptions* pOptions = NULL);
+	// The same as above except that the module is compiled in the specified context instead of the default one.
+	KSC_API ModuleHandle KSC_CompileInContext(KSC_ContextHandle hContext, const char* sourceCode, const KSC_CompileOptions* pOptions = NULL);
+	KSC_API ModuleHandle KSC_CompileFileInContext(KSC_ContextHandle hContext, const char* srcFileName, const KSC_CompileOptions* pOptions = NULL);
+
+	/**
+		This function compiles and JITs the "count" modules on "threads" worker threads, zero or negative "threads"
+		uses all the hardware threads. "outHandles[i]" receives the module of "sources[i]", or NULL if it fails, 
+		in which case "outErrors[i]"(if "outErrors" is not NULL) points to the error message of the item. 
+		The messages stay valid until the next batch compile in the same context. It returns the count of the 
+		modules compiled successfully.
+		Every worker thread but the calling one compiles in a helper context with the same shared code, which is
+		created by the first batch that needs it and kept for the following batches. So the returned modules may 
+		belong to different contexts, but they work the same as the ones compiled by "KSC_Compile". The batches 
+		in the same context are serialized.
+	*/
+	KSC_API int KSC_CompileBatch(const char** sources, int count, int threads, ModuleHandle* outHandles, 
+								 const char** outErrors = NULL, const KSC_CompileOptions* pOptions = NULL);
+	KSC_API int KSC_CompileFileBatch(const char** srcFileNames, int count, int threads, ModuleHandle* outHandles, 
+									 const char** outErrors = NULL, const KSC_CompileOptions* pOptions = NULL);
+	KSC_API int KSC_CompileBatchInContext(KSC_ContextHandle hContext, const char** sources, int count, int threads, 
+										  ModuleHandle* outHandles, const char** outErrors = NULL, const KSC_CompileOptions* pOptions = NULL);
+	KSC_API int KSC_CompileFileBatchInContext(KSC_ContextHandle hContext, const char** srcFileNames, int count, int threads, 
+											  ModuleHandle* outHandles, const char** outErrors = NULL, const KSC_CompileOptions* pOptions = NULL);
+
+	/**
+		This function enables the on-disk cache of the JIT-ed object code, passing NULL or empty string disables it.
+		The object code of each module is stored under the hash of its source, the shared code, the names of the 
+		registered external functions, the target CPU as well as the compile options. When the same module is
+		JIT-ed again, even by another process, the optimization and code generation are skipped and the cached
+		object is loaded instead. Call it before KSC_Initialize() to get the shared code cached as well.
+		The cache is shared by all the contexts.
+	*/
+	KSC_API bool KSC_SetObjectCacheDir(const char* dirName);
+
+	/**
+		This function returns how many JIT-ed modules are loaded from the object cache and how many are not found.
+		The module JIT-ed in parts(see "codeGenThreads") counts once, as a hit only if all of its parts are found.
 	*/
-	KSC_API ModuleHandle KSC_Compile(const char* sourceCode);
-	KSC_API ModuleHandle KSC_CompileFile(const char* srcFileName);
+	KSC_API void KSC_GetObjectCacheStats(int& hits, int& misses);
+
+	/**
+		This function releases the module compiled by "KSC_Compile" or "KSC_CompileFile"(or loaded from a module
+		binary). The function and structure descriptions, the IR and the JIT-ed code and data of this module
+		(including its kernels, array drivers and optimized tier) are freed, so the handles and the function 
+		pointers retrieved from this module are invalid after this call.
+	*/
+	KSC_API void KSC_ReleaseModule(ModuleHandle hModule);
 
 	/**
 		This funtion is to JIT the function with the function handle specified.
+		Note the whole module that the function belongs to is JIT-ed at the first call, the following calls 
+		for the functions of the same module only look up the JIT-ed addresses.
+		If the module is compiled with "tierUpThreshold", the returned pointer stays valid after the function
+		is switched to the optimized code, so the caller can keep it.
+		Once the function is JIT-ed, this function returns its pointer without any lock, so it never waits for 
+		the JIT running on other threads.
 	*/
 	KSC_API void* KSC_GetFunctionPtr(FunctionHandle hFunc, bool bDump = false);
 
+	/**
+		This function optimizes and JITs all the functions of the module in a single codegen pass.
+		It is optional since "KSC_GetFunctionPtr" finalizes the module on demand, however it gives the
+		hosting application the control of when the JIT cost is paid.
+	*/
+	KSC_API bool KSC_FinalizeModule(ModuleHandle hModule);
+
+	/**
+		This function queues the function to be JIT-ed on the background JIT worker and returns immediately, 
+		so that the calling thread can keep running(e.g. on a fallback path) without the hitch of JIT. 
+		The "callback" is invoked on the worker thread once the JIT-ed pointer is available, it can be NULL if the
+		caller polls with "KSC_TryGetFunctionPtr" instead. 
+		NOTE: the callback must not call "KSC_Destory", "KSC_ReleaseModule" is allowed but the module must not be used afterwards.
+	*/
+	KSC_API bool KSC_GetFunctionPtrAsync(FunctionHandle hFunc, KSC_JITCallback callback = NULL, void* userData = NULL);
+
+	/**
+		This function returns the JIT-ed function pointer if it is already available, otherwise NULL is returned 
+		immediately. It never blocks the caller, nor does it trigger the JIT. It is wait-free.
+	*/
+	KSC_API void* KSC_TryGetFunctionPtr(FunctionHandle hFunc);
+
+	/**
+		This function finalizes the module and retrieves the JIT-ed pointers of the functions with the names
+		specified. The pointer of a function that is not found will be set to NULL and false will be returned.
+	*/
+	KSC_API bool KSC_GetFunctionPtrs(ModuleHandle hModule, const char** funcNames, int count, void** outPtrs);
+
+	/**
+		This function JITs the SIMD kernel of the function, which runs "width" invocations of the function per call, 
+		one in each SIMD lane. Passing zero or negative "width" uses the value of "KSC_GetSIMDWidth".
+		The JIT-ed kernel takes one pointer for each argument of the function, pointing to an array of "width" 
+		elements(i.e. SoA layout), plus one more pointer to receive the return values if it's not void. 
+		For example "float Shade(float u, float v, float& w)" becomes "void Kernel(float* u, float* v, float* w, float* ret)".
+		The structure argument or return value is in the SoA layout, its pointer is the memory allocated by 
+		"KSC_AllocMemForType" with "kLayoutSoA", which holds at least "width" elements. The structures passed by 
+		reference are written back. The other arguments and the return value must be scalars, the boolean elements 
+		are SC::Boolean.
+		The kernel is built by the loop vectorizer of LLVM, if it cannot widen the function to "width" lanes(e.g. the 
+		function calls an external function, or has the control flow that cannot be converted to the masked code), 
+		NULL is returned rather than a kernel running the lanes one by one. Check "KSC_GetLastErrorMsg" for the reason.
+	*/
+	KSC_API void* KSC_GetKernelPtr(FunctionHandle hFunc, int width = 0);
+
+	/**
+		This function JITs the driver that runs the function over arrays of elements in a single call, the function
+		body is inlined into the loop of the driver so it can be vectorized, and no call overhead is paid per element.
+		The JIT-ed driver is "void Driver(void* const* ppBases, int count)", the "ppBases" holds the base pointer of 
+		each argument followed by the one of the return value(if it's not void). The element "i" of an argument is at 
+		its base pointer plus "i" times its byte stride specified by "argStrides", zero stride means all the elements 
+		share the same argument. The elements are in the packed layout, i.e. the same as in the hosting C++ code.
+		Passing NULL for "argStrides" or zero for "retStride" uses the packed size of the type, which is for the 
+		tightly packed arrays.
+		The structure argument or return value with the stride "KSC_SOA_STRIDE" is in the SoA layout instead, its
+		base pointer is the memory allocated by "KSC_AllocMemForType" with "kLayoutSoA", which holds at least "count" elements.
+	*/
+	KSC_API void* KSC_GetArrayDriver(FunctionHandle hFunc, const int* argStrides = NULL, int retStride = 0);
+
+	/**
+		This function runs the function over "count" elements on the built-in thread pool, which spreads the elements
+		across all the cores and balances the load by work stealing. It returns after all the elements are done.
+		The "ppBases", "argStrides" and "retStride" are the same as the ones of the array driver. The elements are 
+		handed out in the ranges of "grainSize" elements, zero or negative "grainSize" picks one from "count" and the
+		count of the cores. Use the "SV_DispatchThreadID" argument(see "KSC_DISPATCH_THREAD_ID") to get the element index.
+		The pool is shared by the whole process, so the dispatches from different threads or contexts take turns on
+		it rather than running concurrently. A dispatch from inside a dispatched function runs on its calling thread.
+	*/
+	KSC_API bool KSC_Dispatch(FunctionHandle hFunc, int count, int grainSize, void* const* ppBases, 
+							  const int* argStrides = NULL, int retStride = 0);
+
+	/**
+		This function saves the JIT-ed machine code of the module along with its reflection information(function
+		and structure descriptions) into the file, the module is JIT-ed first if it's not yet. The tiered module
+		is saved with its optimized code.
+	*/
+	KSC_API bool KSC_SaveModuleBinary(ModuleHandle hModule, const char* fileName);
+
+	/**
+		This function loads the module saved by "KSC_SaveModuleBinary" without compiling it, so neither the
+		frontend nor the code generator runs. The external functions are resolved against the ones added 
+		by "KSC_AddExternalFunction". It fails if the binary was built for another target CPU or with different 
+		shared code. The returned module handle works the same as the compiled one, except that it cannot be saved again.
+	*/
+	KSC_API ModuleHandle KSC_LoadModuleBinary(const char* fileName);
+	KSC_API ModuleHandle KSC_LoadModuleBinaryInContext(KSC_ContextHandle hContext, const char* fileName);
+
 	/**
 		This function returns the function handle with the specified name. If the function with the name is not
-		found in the KSCL code, NULL will be returned.
+		found in the KSCL code, NULL will be returned. The function table of the module never changes after the 
+		module is compiled, so it is looked up without any lock and can be called from any thread at any time.
 	*/
 	KSC_API FunctionHandle KSC_GetFunctionHandleByName(const char* funcName, ModuleHandle hModule);
 
@@ -180,8 +424,11 @@ extern "C" {
 
 	/**
 		This function allocates the memory regarding the type's alignment requirement.
+		The structure array can be allocated in any of the layouts. The SoA memory starts with the table of the stream
+		pointers, one for each scalar component of the structure in declaration order(e.g. "float3 pos" has three),
+		and each stream of "arraySize" elements is aligned to 64 bytes. Use "KSC_GetSoAStreamPtr" to locate the streams.
 	*/
-	KSC_API void* KSC_AllocMemForType(const KSC_TypeInfo& typeInfo, int arraySize);
+	KSC_API void* KSC_AllocMemForType(const KSC_TypeInfo& typeInfo, int arraySize, SC::MemLayout layout = SC::kLayoutKSC);
 	/**
 		This function frees the member allocated by "KSC_AllocMemForType".
 	*/
@@ -196,9 +443,24 @@ extern "C" {
 	/**
 		This function modifies the member variable with the content pointed by "data".
 		Note the caller must ensure the provided buffer is large enough for the type of the member variable.
+		The elements of the boolean vector members are written as SC::Boolean, any non-zero element is true.
 	*/
 	KSC_API bool KSC_SetStructMemberData(StructHandle hStruct, void* pStructVar, const char* member, void* data, int size);
 
+	/**
+		This function returns the stream of the scalar component of the member in the SoA memory allocated by 
+		"KSC_AllocMemForType", e.g. member "pos" with component 1 is the stream of "pos.y". The components of 
+		array members are counted element by element. NULL is returned if the member or component is not found.
+	*/
+	KSC_API void* KSC_GetSoAStreamPtr(StructHandle hStruct, void* pSoAData, const char* member, int component = 0);
+
+	/**
+		This function JITs the routine that converts the structure array from one layout to another, which is
+		"void Convert(const void* pSrc, void* pDest, int count)". The SoA arrays are the memory allocated by
+		"KSC_AllocMemForType" with "kLayoutSoA". The converter is shared by the structures of the same layout.
+	*/
+	KSC_API void* KSC_GetLayoutConverter(StructHandle hStruct, SC::MemLayout srcLayout, SC::MemLayout destLayout);
+
 	/**
 		This function returns the KSC structure size(not the one of the same declaration in your host C++ code).
 	*/
@@ -211,11 +473,20 @@ extern "C" {
 
 	/**
 		This function returns the allocation size and alignment requirement for the built-in types.
+		It requires the default context, i.e. KSC must be initialized.
 	*/
 	KSC_API bool KSC_GetBuiltInTypeInfo(SC::VarType type, int& alloc_size, int& alignment);
 
 	/**
-		This function returns the optimized SIMD width on the target machine.
+		This function returns the built-in type with the name in KSCL, or kInvalid if there's no such type.
+		It is mostly useful for the native width types "float_n", "int_n" and "bool_n", whose actual types
+		depend on the SIMD width of the target machine(see "KSC_GetSIMDWidth"), e.g. "float_n" is kFloat8 on AVX machines.
+	*/
+	KSC_API SC::VarType KSC_GetBuiltInTypeByName(const char* typeName);
+
+	/**
+		This function returns the optimized SIMD width on the target machine. It respects the features set by
+		"KSC_SetTargetCPU" if there's any.
 	*/
 	KSC_API int KSC_GetSIMDWidth();
 
@@ -0,0 +1,30 @@
+// The micro-benchmark of the "_packed" wrapper, the structure is passed by "&" so each call
+// converts it from the packed layout and back.
+struct BenchData
+{
+	float4 a;
+	float8 b;
+	float3 c;
+	bool4 d;
+};
+
+float bench_packed(BenchData& data)
+{
+	data.a.x = data.a.x + data.b.x;
+	data.c.y = data.c.y * 0.5;
+	return data.a.x;
+}
+
+// The float3 is the last member, the host allocates exactly the packed size of the structure so the
+// conversion to and from the packed layout must not touch anything after "c".
+struct TailData
+{
+	float4 a;
+	float3 c;
+};
+
+float tail_packed(TailData& data)
+{
+	data.c.z = data.c.z + data.a.x;
+	return data.c.z;
+}
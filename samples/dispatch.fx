@@ -0,0 +1,14 @@
+// "samples -check" dispatches the functions below over the counts that are not a multiple of the grain size.
+void DispatchInner(int outer);
+
+// Every element counts its own visits, so each one must end up with 1.
+void count_visits(int% counts[], int SV_DispatchThreadID)
+{
+	counts[SV_DispatchThreadID] = counts[SV_DispatchThreadID] + 1;
+}
+
+// The host function "DispatchInner" dispatches "count_visits" again from inside the dispatched function.
+void dispatch_nested(int SV_DispatchThreadID)
+{
+	DispatchInner(SV_DispatchThreadID);
+}
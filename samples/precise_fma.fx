@@ -0,0 +1,12 @@
+// The "a * b + c" of the precise function must be rounded twice, an FMA instruction would round it only once.
+[precise]
+float mul_add_precise(float a, float b, float c)
+{
+	return a * b + c;
+}
+
+[fastmath]
+float mul_add_fast(float a, float b, float c)
+{
+	return a * b + c;
+}
@@ -2,9 +2,12 @@
 //
 
 #include <stdio.h>
+#include <windows.h>
+#include <intrin.h>
 #include "SC_API.h"
 #include <string.h>
 #include <vector>
+#include <chrono>
 
 void CompareTwoInt(int a, int b)
 {
@@ -12,9 +15,302 @@ void CompareTwoInt(int a, int b)
 	printf("test value is %d (%d, %d)", ret, a, b);
 }
 
+// The same declaration as "BenchData" in bench_packed.fx, in the packed layout.
+struct BenchData
+{
+	float a[4];
+	float b[8];
+	float c[3];
+	SC::Boolean d[4];
+};
+
+int RunPackedBenchmark()
+{
+	ModuleHandle hModule = KSC_CompileFile("bench_packed.fx");
+	if (!hModule) {
+		printf(KSC_GetLastErrorMsg());
+		return -1;
+	}
+
+	typedef float (*PFN_bench_packed)(BenchData*);
+	FunctionHandle hFunc = KSC_GetFunctionHandleByName("bench_packed", hModule);
+	PFN_bench_packed bench_packed = (PFN_bench_packed)KSC_GetFunctionPtr(hFunc, false);
+
+	BenchData data;
+	memset(&data, 0, sizeof(data));
+	data.d[1] = 1;
+	const int callCnt = 10000000;
+	float sum = 0;
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < callCnt; ++i) {
+		data.b[0] = (float)(i & 0xff);
+		sum += bench_packed(&data);
+	}
+	std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+	double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+	printf("Packed wrapper: %.2f ns per call (checksum %f)\n", ns / callCnt, sum);
+
+	KSC_ReleaseModule(hModule);
+	return 0;
+}
+
+// The same declaration as "TailData" in bench_packed.fx, in the packed layout.
+struct TailData
+{
+	float a[4];
+	float c[3];
+};
+
+// The structure is placed at the very end of a page followed by an inaccessible one, so reading or writing
+// past the packed float3 in the wrapper crashes instead of going unnoticed.
+int RunPackedTailCheck()
+{
+	ModuleHandle hModule = KSC_CompileFile("bench_packed.fx");
+	if (!hModule) {
+		printf(KSC_GetLastErrorMsg());
+		return -1;
+	}
+
+	typedef float (*PFN_tail_packed)(TailData*);
+	FunctionHandle hFunc = KSC_GetFunctionHandleByName("tail_packed", hModule);
+	PFN_tail_packed tail_packed = (PFN_tail_packed)KSC_GetFunctionPtr(hFunc, false);
+
+	SYSTEM_INFO sysInfo;
+	GetSystemInfo(&sysInfo);
+	char* pages = (char*)VirtualAlloc(NULL, sysInfo.dwPageSize * 2, MEM_RESERVE, PAGE_NOACCESS);
+	VirtualAlloc(pages, sysInfo.dwPageSize, MEM_COMMIT, PAGE_READWRITE);
+	TailData* data = (TailData*)(pages + sysInfo.dwPageSize - sizeof(TailData));
+	memset(data, 0, sizeof(TailData));
+	data->a[0] = 1.0f;
+	data->c[2] = 2.0f;
+	float ret = tail_packed(data);
+	bool passed = (ret == 3.0f && data->c[2] == 3.0f);
+	printf("Packed float3 at the end of the allocation: %s\n", passed ? "passed" : "failed");
+
+	VirtualFree(pages, 0, MEM_RELEASE);
+	KSC_ReleaseModule(hModule);
+	return passed ? 0 : -1;
+}
+
+// With the product (1 + 2^-23)^2 = 1 + 2^-22 + 2^-46, the separate multiply drops the 2^-46 before the add,
+// so the precise function returns exactly zero. The fused one keeps it, which means "vfmadd" was emitted.
+int RunPreciseCheck()
+{
+	KSC_CompileOptions options;
+	// The module-wide fast-math must not override the "[precise]" attribute either.
+	options.fastMath = true;
+	ModuleHandle hModule = KSC_CompileFile("precise_fma.fx", &options);
+	if (!hModule) {
+		printf(KSC_GetLastErrorMsg());
+		return -1;
+	}
+
+	typedef float (*PFN_mul_add)(float, float, float);
+	PFN_mul_add mul_add_precise = (PFN_mul_add)KSC_GetFunctionPtr(KSC_GetFunctionHandleByName("mul_add_precise", hModule), false);
+	PFN_mul_add mul_add_fast = (PFN_mul_add)KSC_GetFunctionPtr(KSC_GetFunctionHandleByName("mul_add_fast", hModule), false);
+
+	float a = 1.0f + 1.0f / (1 << 23);
+	float c = -(1.0f + 1.0f / (1 << 22));
+	float preciseRes = mul_add_precise(a, a, c);
+	float fastRes = mul_add_fast(a, a, c);
+	printf("Precise mul-add: %g, fast mul-add: %g(non-zero if fused)\n", preciseRes, fastRes);
+
+	KSC_ReleaseModule(hModule);
+	if (preciseRes != 0.0f) {
+		printf("The precise function is contracted into FMA.\n");
+		return -1;
+	}
+	return 0;
+}
+
+// The same declaration as "BoolData" in test_01.fx, in the packed layout.
+struct BoolData
+{
+	SC::Int a[4];
+	SC::Int b[4];
+	SC::Boolean useA[4];
+	SC::Boolean aGreater[4];
+};
+
+static bool CheckBoolLanes(const SC::Boolean* lanes, int l0, int l1, int l2, int l3)
+{
+	return lanes[0] == l0 && lanes[1] == l1 && lanes[2] == l2 && lanes[3] == l3;
+}
+
+// The host writes the boolean vector elements as 1 in the packed layout and through the KSC layout APIs,
+// the selects must see them as true and the comparison results must come back as 0 or 1.
+int RunBoolVectorCheck()
+{
+	ModuleHandle hModule = KSC_CompileFile("test_01.fx");
+	if (!hModule) {
+		printf(KSC_GetLastErrorMsg());
+		return -1;
+	}
+
+	typedef int (*PFN_select)(void*);
+	FunctionHandle hPacked = KSC_GetFunctionHandleByName("select_packed", hModule);
+	FunctionHandle hKSC = KSC_GetFunctionHandleByName("select_ksc", hModule);
+	PFN_select select_packed = (PFN_select)KSC_GetFunctionPtr(hPacked, false);
+	PFN_select select_ksc = (PFN_select)KSC_GetFunctionPtr(hKSC, false);
+	const int expected = 1 + 4 + 3 + 7;
+
+	BoolData data = {{1, 5, 3, 8}, {2, 4, 3, 7}, {1, 0, 1, 0}, {0, 0, 0, 0}};
+	bool passed = select_packed(&data) == expected && CheckBoolLanes(data.aGreater, 0, 1, 0, 1);
+
+	KSC_TypeInfo argType = KSC_GetFunctionArgumentType(hKSC, 0);
+	void* pKSCData = KSC_AllocMemForType(argType, 1);
+	KSC_SetStructMemberData(argType.hStruct, pKSCData, "a", data.a, sizeof(data.a));
+	KSC_SetStructMemberData(argType.hStruct, pKSCData, "b", data.b, sizeof(data.b));
+	KSC_SetStructMemberData(argType.hStruct, pKSCData, "useA", data.useA, sizeof(data.useA));
+	passed = passed && select_ksc(pKSCData) == expected;
+
+	// Round trip through the layout converters, the packed copy gets the elements as 0 or 1 again.
+	typedef void (*PFN_convert)(void*, void*, int);
+	PFN_convert toKSC = (PFN_convert)KSC_GetLayoutConverter(argType.hStruct, SC::kLayoutPacked, SC::kLayoutKSC);
+	PFN_convert toPacked = (PFN_convert)KSC_GetLayoutConverter(argType.hStruct, SC::kLayoutKSC, SC::kLayoutPacked);
+	BoolData converted;
+	memset(&converted, 0, sizeof(converted));
+	toKSC(&data, pKSCData, 1);
+	passed = passed && select_ksc(pKSCData) == expected;
+	toPacked(pKSCData, &converted, 1);
+	passed = passed && CheckBoolLanes(converted.useA, 1, 0, 1, 0) && CheckBoolLanes(converted.aGreater, 0, 1, 0, 1);
+	printf("Boolean vectors at the API boundary: %s\n", passed ? "passed" : "failed");
+
+	KSC_FreeMem(pKSCData);
+	KSC_ReleaseModule(hModule);
+	return passed ? 0 : -1;
+}
+
+// "count_visits" in dispatch.fx shares the counts among all the elements, the thread ID is not read from memory.
+static const int s_countVisitsStrides[2] = {0, 0};
+static FunctionHandle s_hCountVisits = NULL;
+static const int kNestedInnerCnt = 53;
+static std::vector<int> s_nestedCounts;
+static bool s_nestedDispatchFailed = false;
+
+// Called by "dispatch_nested" in dispatch.fx, on the pool threads as well as the dispatching one.
+void DispatchInner(int outer)
+{
+	void* ppBases[2] = {&s_nestedCounts[outer * kNestedInnerCnt], NULL};
+	if (!KSC_Dispatch(s_hCountVisits, kNestedInnerCnt, 8, ppBases, s_countVisitsStrides))
+		s_nestedDispatchFailed = true;
+}
+
+static bool IsVisitedOnce(const std::vector<int>& counts)
+{
+	for (size_t i = 0; i < counts.size(); ++i) {
+		if (counts[i] != 1)
+			return false;
+	}
+	return true;
+}
+
+// Every element must be visited exactly once, including the ones of the last range that is shorter than the grain.
+// The nested dispatch hangs rather than fails if it waits for the pool that runs the outer one.
+int RunDispatchCheck()
+{
+	KSC_AddExternalFunction("DispatchInner", DispatchInner);
+	ModuleHandle hModule = KSC_CompileFile("dispatch.fx");
+	if (!hModule) {
+		printf(KSC_GetLastErrorMsg());
+		return -1;
+	}
+	s_hCountVisits = KSC_GetFunctionHandleByName("count_visits", hModule);
+
+	std::vector<int> counts(1000, 0);
+	void* ppBases[2] = {&counts.front(), NULL};
+	bool passed = KSC_Dispatch(s_hCountVisits, (int)counts.size(), 64, ppBases, s_countVisitsStrides) && IsVisitedOnce(counts);
+	printf("Dispatch of %d elements in the grains of 64: %s\n", (int)counts.size(), passed ? "passed" : "failed");
+
+	const int outerCnt = 37;
+	s_nestedCounts.assign(outerCnt * kNestedInnerCnt, 0);
+	s_nestedDispatchFailed = false;
+	void* pNestedBase = NULL;
+	bool nestedPassed = KSC_Dispatch(KSC_GetFunctionHandleByName("dispatch_nested", hModule), outerCnt, 4, &pNestedBase) &&
+		!s_nestedDispatchFailed && IsVisitedOnce(s_nestedCounts);
+	printf("Nested dispatch of %d x %d elements: %s\n", outerCnt, kNestedInnerCnt, nestedPassed ? "passed" : "failed");
+
+	KSC_ReleaseModule(hModule);
+	return (passed && nestedPassed) ? 0 : -1;
+}
+
+// The reference of the "gather_scatter_*" functions in test_02.fx, the lanes are scattered in order. The arguments
+// are aligned for the vectors of the native width functions.
+template <typename T>
+static bool CheckGatherScatter(FunctionHandle hFunc, const T* src, const int* idx, int laneCnt)
+{
+	typedef void (*PFN_gather_scatter)(const T*, const int*, T*, T*);
+	PFN_gather_scatter gather_scatter = (PFN_gather_scatter)KSC_GetFunctionPtr(hFunc, false);
+
+	__declspec(align(32)) T gathered[8];
+	T table[8], expGathered[8], expTable[8];
+	for (int i = 0; i < 8; ++i) {
+		gathered[i] = expGathered[i] = 0;
+		table[i] = expTable[i] = (T)(i * 3 + 1);
+	}
+	for (int i = 0; i < laneCnt; ++i)
+		expGathered[i] = expTable[idx[i]];
+	for (int i = 0; i < laneCnt; ++i)
+		expTable[idx[i]] = src[i];
+
+	gather_scatter(src, idx, gathered, table);
+	return memcmp(gathered, expGathered, sizeof(gathered)) == 0 && memcmp(table, expTable, sizeof(table)) == 0;
+}
+
+static bool HostHasAVX2()
+{
+	int CPUInfo[4];
+	__cpuid(CPUInfo, 0);
+	if (CPUInfo[0] < 7)
+		return false;
+	__cpuidex(CPUInfo, 7, 0);
+	return (CPUInfo[1] & (1 << 5)) != 0;
+}
+
+// Runs test_02.fx on the target with the features, "-avx2" takes the per-lane loads and "+avx2" takes the gather
+// instructions. The target is only set before any context is created, so the default context is created again.
+int RunGatherCheck(const char* sharedCode, const char* cpuName, const char* features)
+{
+	KSC_Destory();
+	if (!KSC_SetTargetCPU(cpuName, features) || !KSC_Initialize(sharedCode)) {
+		printf(KSC_GetLastErrorMsg());
+		return -1;
+	}
+	KSC_AddExternalFunction("CompareTwoInt", CompareTwoInt);
+
+	ModuleHandle hModule = KSC_CompileFile("test_02.fx");
+	if (!hModule) {
+		printf(KSC_GetLastErrorMsg());
+		return -1;
+	}
+
+	typedef void (*PFN_run_test)();
+	PFN_run_test run_test = (PFN_run_test)KSC_GetFunctionPtr(KSC_GetFunctionHandleByName("run_test", hModule), false);
+	printf("Test 02(%s):", features);
+	run_test();
+	printf("\n");
+
+	// The repeated indices are both gathered and scattered.
+	__declspec(align(32)) int intSrc[4] = {11, 22, 33, 44};
+	__declspec(align(32)) int idx4[4] = {3, 0, 3, 1};
+	__declspec(align(32)) float floatSrc[8] = {1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f, 8.5f};
+	__declspec(align(32)) int idx8[8] = {5, 2, 7, 2, 0, 3, 2, 6};
+	bool passed = CheckGatherScatter(KSC_GetFunctionHandleByName("gather_scatter_4", hModule), intSrc, idx4, 4) &&
+		CheckGatherScatter(KSC_GetFunctionHandleByName("gather_scatter_8", hModule), floatSrc, idx8, 8) &&
+		CheckGatherScatter(KSC_GetFunctionHandleByName("gather_scatter_n", hModule), floatSrc, idx8, KSC_GetSIMDWidth());
+	printf("Gather and scatter(%s): %s\n", features, passed ? "passed" : "failed");
+
+	KSC_ReleaseModule(hModule);
+	return passed ? 0 : -1;
+}
 
 int main(int argc, char* argv[])
 {
+	// Run "samples -precise" on a CPU with FMA to check that the "[precise]" function is not contracted.
+	bool runPreciseCheck = (argc > 1 && strcmp(argv[1], "-precise") == 0);
+	if (runPreciseCheck)
+		KSC_SetTargetCPU("haswell", "+fma");
+
 	std::vector<char> common_code;
 	{
 		// Process the common.fx file
@@ -39,6 +335,34 @@ int main(int argc, char* argv[])
 	KSC_Initialize(&common_code.front());
 	KSC_AddExternalFunction("CompareTwoInt", CompareTwoInt);
 
+	if (runPreciseCheck) {
+		int ret = RunPreciseCheck();
+		KSC_Destory();
+		return ret;
+	}
+
+	// Run "samples -check" for the checks that call the JIT-ed code from the host instead of the tests.
+	if (argc > 1 && strcmp(argv[1], "-check") == 0) {
+		int ret = RunBoolVectorCheck();
+		if (ret == 0)
+			ret = RunDispatchCheck();
+		if (ret == 0)
+			ret = RunGatherCheck(&common_code.front(), NULL, "-avx2");
+		if (ret == 0 && HostHasAVX2())
+			ret = RunGatherCheck(&common_code.front(), "haswell", "+avx2");
+		KSC_Destory();
+		return ret;
+	}
+
+	// Run "samples -bench" to check and time the calls through the packed-argument wrapper instead of the tests.
+	if (argc > 1 && strcmp(argv[1], "-bench") == 0) {
+		int ret = RunPackedTailCheck();
+		if (ret == 0)
+			ret = RunPackedBenchmark();
+		KSC_Destory();
+		return ret;
+	}
+
 	FILE* f = NULL;
 	const char* fileNameBase = "test_";
 	const char* fileNameExt = ".fx";
@@ -0,0 +1,71 @@
+// The boolean vectors are the lane masks in the generated code, while the hosting code reads and writes each
+// element as 0 or 1. "run_test" checks the vector comparisons, select, any and all, "samples -check" calls
+// "select_packed" and "select_ksc" with the elements written as 1 by the host.
+
+int ToInt(bool v)
+{
+	int ret;
+	ret = v ? 1 : 0;
+	return ret;
+}
+
+int CountTrue(bool4 v)
+{
+	return ToInt(v.x) + ToInt(v.y) + ToInt(v.z) + ToInt(v.w);
+}
+
+void run_test()
+{
+	float4 a = float4(1, 5, 3, 8);
+	float4 b = float4(2, 4, 3, 7);
+	bool4 gt = a > b;
+	CompareTwoInt(CountTrue(gt), 2);
+	CompareTwoInt(CountTrue(a == b), 1);
+	CompareTwoInt(CountTrue(!gt), 2);
+
+	int4 i = int4(1, 5, 3, 8);
+	int4 j = int4(2, 4, 3, 7);
+	int4 maxIJ;
+	maxIJ = (i > j) ? i : j;
+	CompareTwoInt(maxIJ.x + maxIJ.y + maxIJ.z + maxIJ.w, 2 + 5 + 3 + 8);
+	bool4 le = i <= j;
+	le.y = true;
+	int4 sel;
+	sel = le ? i : j;
+	CompareTwoInt(sel.x + sel.y + sel.z + sel.w, 1 + 5 + 3 + 7);
+
+	int8 k = int8(1, 2, 3, 4, 5, 6, 7, 8);
+	int8 m = int8(8, 7, 6, 5, 4, 3, 2, 1);
+	CompareTwoInt(ToInt(any(k < m)), 1);
+	CompareTwoInt(ToInt(all(k < m)), 0);
+	CompareTwoInt(ToInt(all(k == k)), 1);
+	CompareTwoInt(ToInt(any(k != k)), 0);
+	CompareTwoInt(ToInt(any(gt && !gt)), 0);
+	CompareTwoInt(ToInt(all(gt || !gt)), 1);
+}
+
+struct BoolData
+{
+	int4 a;
+	int4 b;
+	bool4 useA;
+	bool4 aGreater;
+};
+
+// "&" converts the structure from and to the packed layout, where each boolean element is 0 or 1.
+int select_packed(BoolData& data)
+{
+	int4 sel;
+	sel = data.useA ? data.a : data.b;
+	data.aGreater = data.a > data.b;
+	return sel.x + sel.y + sel.z + sel.w;
+}
+
+// "%" takes the KSC layout, which the host fills through "KSC_SetStructMemberData" or the layout converter.
+int select_ksc(BoolData% data)
+{
+	int4 sel;
+	sel = data.useA ? data.a : data.b;
+	data.aGreater = data.a > data.b;
+	return sel.x + sel.y + sel.z + sel.w;
+}
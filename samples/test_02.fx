@@ -0,0 +1,94 @@
+// The scalar arrays indexed by the integer vectors, the read gathers the elements into a vector and the
+// assignment scatters the vector in the lane order, so the last lane wins for the repeated indices.
+// "samples -check" calls the "gather_scatter_*" functions with and without the AVX2 gather instructions.
+
+int ToInt(bool v)
+{
+	int ret;
+	ret = v ? 1 : 0;
+	return ret;
+}
+
+void run_test()
+{
+	float data[8];
+	int ints[8];
+	bool flags[8];
+	int k;
+	for (k = 0; k < 8; k = k + 1) {
+		data[k] = k * 10;
+		ints[k] = k + 100;
+		flags[k] = k > 3;
+	}
+
+	int4 i4 = int4(6, 1, 4, 1);
+	float4 f4 = data[i4];
+	CompareTwoInt(f4.x + f4.y + f4.z + f4.w, 60 + 10 + 40 + 10);
+	int4 n4 = ints[i4];
+	CompareTwoInt(n4.x + n4.y + n4.z + n4.w, 106 + 101 + 104 + 101);
+
+	// The index converted from the float vector
+	float4 fIdx = float4(7, 0, 2, 5);
+	f4 = data[int4(fIdx)];
+	CompareTwoInt(f4.x + f4.y * 2 + f4.z * 3 + f4.w * 4, 70 + 0 + 60 + 200);
+
+	// Gathered by the int8 index and scattered back to a local array in order
+	int8 lanes = int8(0, 1, 2, 3, 4, 5, 6, 7);
+	int8 i8 = int8(7, 0, 5, 2, 2, 6, 1, 3);
+	float gathered[8];
+	gathered[lanes] = data[i8];
+	float sum = 0;
+	for (k = 0; k < 8; k = k + 1) {
+		sum = sum + gathered[k] * (k + 1);
+	}
+	CompareTwoInt(sum, 1070);
+
+	// Index 3 is written by the lanes 0, 2 and 5, index 1 by the lanes 1 and 4, index 0 by the lanes 6 and 7
+	int scattered[8];
+	for (k = 0; k < 8; k = k + 1) {
+		scattered[k] = 0;
+	}
+	scattered[int8(3, 1, 3, 6, 1, 3, 0, 0)] = int8(1, 2, 3, 4, 5, 6, 7, 8);
+	CompareTwoInt(scattered[3], 6);
+	CompareTwoInt(scattered[1], 5);
+	CompareTwoInt(scattered[0], 8);
+	CompareTwoInt(scattered[6], 4);
+	CompareTwoInt(scattered[2], 0);
+
+	data[int4(0, 2, 4, 6)] = float4(1, 2, 3, 4);
+	CompareTwoInt(data[0] + data[2] + data[4] + data[6], 10);
+	CompareTwoInt(data[1], 10);
+
+	// The boolean elements are gathered into the lane masks and scattered back as the scalar booleans
+	bool4 b4 = flags[int4(2, 4, 3, 7)];
+	CompareTwoInt(ToInt(b4.x) + ToInt(b4.y) * 2 + ToInt(b4.z) * 4 + ToInt(b4.w) * 8, 10);
+	flags[int4(0, 1, 6, 1)] = bool4(true, false, false, true);
+	CompareTwoInt(ToInt(flags[0]) + ToInt(flags[1]) * 2 + ToInt(flags[6]) * 4, 3);
+	bool8 b8 = flags[lanes];
+	CompareTwoInt(ToInt(any(b8)), 1);
+	CompareTwoInt(ToInt(all(b8)), 0);
+}
+
+// Each of the functions below gathers "gathered[k] = table[idx[k]]" and then scatters "table[idx[k]] = src[k]".
+void gather_scatter_4(int% src[], int% idx[], int% gathered[], int% table[])
+{
+	int4 lanes = int4(0, 1, 2, 3);
+	int4 i = idx[lanes];
+	gathered[lanes] = table[i];
+	table[i] = src[lanes];
+}
+
+void gather_scatter_8(float% src[], int% idx[], float% gathered[], float% table[])
+{
+	int8 lanes = int8(0, 1, 2, 3, 4, 5, 6, 7);
+	int8 i = idx[lanes];
+	gathered[lanes] = table[i];
+	table[i] = src[lanes];
+}
+
+// The native width, which is float4 or float8 depending on the target.
+void gather_scatter_n(float_n% src[], int_n% idx[], float_n% gathered[], float% table[])
+{
+	gathered[0] = table[idx[0]];
+	table[idx[0]] = src[0];
+}
@@ -1,74 +1,1306 @@
 #include "IR_Gen_Context.h"
 #include <llvm/ADT/Triple.h>
 #include <llvm/Support/Host.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Bitcode/ReaderWriter.h>
+#include <llvm/Analysis/CFG.h>
+#include <llvm/MC/MCSubtargetInfo.h>
+#include <llvm/Support/TargetRegistry.h>
+#include <llvm/Target/TargetSubtargetInfo.h>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <stdio.h>
 
 namespace SC {
 
-llvm::IRBuilder<> CG_Context::sBuilder(getGlobalContext());
-llvm::Module* CG_Context::TheModule = NULL;
-llvm::ExecutionEngine* CG_Context::TheExecutionEngine = NULL;
-llvm::FunctionPassManager* CG_Context::TheFPM = NULL;
-const llvm::DataLayout* CG_Context::TheDataLayout = NULL;
-GobalSymbolMemManager* CG_Context::TheSymbolMemMgr = NULL;
+// The code generation state bound to the calling thread, see "CodeGenScope".
+#ifdef _MSC_VER
+static __declspec(thread) CodeGenState* s_pCurState = NULL;
+#else
+static __thread CodeGenState* s_pCurState = NULL;
+#endif
+// The cache lives across the creation and destroy of the code generation states, so the cache directory
+// can be set at any time.
+static JITObjectCache s_objectCache;
+JITObjectCache* CG_Context::TheObjectCache = &s_objectCache;
+
+// Append "-elf" to make MCJIT to generate ELF data in memory(Windows defaults to COFF)
+static const std::string s_targetTriple = sys::getProcessTriple() + "-elf";
+static std::once_flag s_targetInitFlag;
+// The CPU name and features that the JIT generates code for, empty to use the host ones. They are guarded by
+// the mutex along with the count of the live states, the target cannot be changed while any state exists.
+static std::mutex s_targetMutex;
+static std::string s_targetCPU;
+static std::string s_targetFeatures;
+static int s_liveStateCnt = 0;
+
+llvm::LLVMContext& CG_Context::TheLLVMContext()
+{
+	return s_pCurState->llvmContext;
+}
+
+llvm::Module*& CG_Context::TheModule()
+{
+	return s_pCurState->module;
+}
+
+llvm::ExecutionEngine* CG_Context::TheExecutionEngine()
+{
+	return s_pCurState->executionEngine;
+}
+
+const llvm::DataLayout* CG_Context::TheDataLayout()
+{
+	return s_pCurState->dataLayout;
+}
+
+llvm::IRBuilder<>& CG_Context::Builder()
+{
+	return s_pCurState->builder;
+}
+
+GobalSymbolMemManager* CG_Context::TheSymbolMemMgr()
+{
+	return s_pCurState->symbolMemMgr;
+}
+
+llvm::TargetMachine* CG_Context::TheTargetMachine()
+{
+	return s_pCurState->targetMachine;
+}
+
+CodeGenState::CodeGenState() : builder(llvmContext)
+{
+	module = NULL;
+	executionEngine = NULL;
+	dataLayout = NULL;
+	symbolMemMgr = NULL;
+	targetMachine = NULL;
+	sharedCodeIR = NULL;
+	hasAVX2 = false;
+}
+
+CodeGenScope::CodeGenScope(CodeGenState* pState)
+{
+	mpPrevState = s_pCurState;
+	s_pCurState = pState;
+}
+
+CodeGenScope::~CodeGenScope()
+{
+	s_pCurState = mpPrevState;
+}
 
-bool InitializeCodeGen()
+static void GetCodeGenTarget(std::string& cpuName, SmallVectorImpl<std::string>& attrs)
 {
-	llvm::InitializeNativeTarget();
-	InitializeNativeTargetAsmPrinter();
-	LLVMLinkInMCJIT();
-	LLVMContext &llvmCtx = llvm::getGlobalContext();
-	CG_Context::TheModule = new Module("Kai's HLSL Compiler", llvmCtx);
+	std::string targetCPU, targetFeatures;
+	{
+		std::lock_guard<std::mutex> lock(s_targetMutex);
+		targetCPU = s_targetCPU;
+		targetFeatures = s_targetFeatures;
+	}
+	if (!targetCPU.empty() || !targetFeatures.empty()) {
+		cpuName = targetCPU.empty() ? sys::getHostCPUName().str() : targetCPU;
+		SmallVector<StringRef, 16> features;
+		StringRef(targetFeatures).split(features, ",", -1, false);
+		for (size_t i = 0; i < features.size(); ++i) {
+			StringRef f = features[i].trim();
+			if (f.empty())
+				continue;
+			// A feature without explicit sign means enabling it
+			if (f[0] != '+' && f[0] != '-')
+				attrs.push_back("+" + f.str());
+			else
+				attrs.push_back(f.str());
+		}
+	}
+	else {
+		cpuName = sys::getHostCPUName();
+		// Not every platform supports the feature detection, the CPU name implies the features then.
+		StringMap<bool> hostFeatures;
+		if (sys::getHostCPUFeatures(hostFeatures)) {
+			for (StringMap<bool>::iterator it = hostFeatures.begin(); it != hostFeatures.end(); ++it)
+				attrs.push_back((it->second ? "+" : "-") + it->first().str());
+		}
+	}
+}
+
+std::string GetCodeGenTargetDesc()
+{
+	std::string cpuName;
+	SmallVector<std::string, 16> attrs;
+	GetCodeGenTarget(cpuName, attrs);
+
+	// The host features are not reported in a fixed order
+	std::sort(attrs.begin(), attrs.end());
+	std::string ret = sys::getProcessTriple() + ";" + cpuName;
+	for (size_t i = 0; i < attrs.size(); ++i)
+		ret += ";" + attrs[i];
+	return ret;
+}
+
+bool SetCodeGenTarget(const char* cpuName, const char* features)
+{
+	// The target machine is created along with the execution engine, so it cannot be changed afterwards.
+	std::lock_guard<std::mutex> lock(s_targetMutex);
+	if (s_liveStateCnt > 0)
+		return false;
+	s_targetCPU = cpuName ? cpuName : "";
+	s_targetFeatures = features ? features : "";
+	return true;
+}
+
+int GetCodeGenSIMDWidth()
+{
+	std::string cpuName;
+	SmallVector<std::string, 16> attrs;
+	GetCodeGenTarget(cpuName, attrs);
+
+	bool hasAVX = false, hasSSE = false;
+	for (size_t i = 0; i < attrs.size(); ++i) {
+		const std::string& f = attrs[i];
+		if (f == "+avx" || f == "+avx2" || f == "+avx512f")
+			hasAVX = true;
+		else if (f.compare(0, 4, "+sse") == 0)
+			hasSSE = true;
+	}
+	if (hasAVX)
+		return 8;
+	if (hasSSE)
+		return 4;
+	// The features of an overridden CPU are implied by its name when not listed, assume the SSE baseline.
+	std::lock_guard<std::mutex> lock(s_targetMutex);
+	bool isHostTarget = s_targetCPU.empty() && s_targetFeatures.empty();
+	return isHostTarget ? 0 : 4;
+}
+
+// Select the target machine of the JIT target for the engine builder, the caller owns the returned machine.
+static llvm::TargetMachine* SelectTargetMachine(llvm::EngineBuilder& eb)
+{
+	// Only the standard fusion is allowed globally, which fuses the explicit fmuladd(e.g. "mad" and "lerp") into
+	// FMA instructions. The separate multiplies and adds are contracted only in the functions with the 
+	// "unsafe-fp-math" attribute, so the precise code keeps its rounding.
+	llvm::TargetOptions targetOpts;
+	targetOpts.AllowFPOpFusion = llvm::FPOpFusion::Standard;
+	eb.setTargetOptions(targetOpts);
+
+	std::string cpuName;
+	SmallVector<std::string, 16> attrs;
+	GetCodeGenTarget(cpuName, attrs);
+	llvm::Triple targetTriple;
+	targetTriple.setTriple(s_targetTriple);
+	return eb.selectTarget(targetTriple, "", cpuName, attrs);
+}
+
+// Check the feature against the subtarget of the target machine, which includes the features implied by
+// the CPU name(e.g. "haswell"). The feature bits are private to the target, so they are compared with the
+// bits that enabling the feature alone sets, i.e. the feature along with the ones it implies.
+static bool TargetHasFeature(llvm::TargetMachine* pTM, const char* feature)
+{
+	const llvm::Target& target = pTM->getTarget();
+	std::unique_ptr<llvm::MCSubtargetInfo> baseSTI(target.createMCSubtargetInfo(pTM->getTargetTriple(), "", ""));
+	std::unique_ptr<llvm::MCSubtargetInfo> featureSTI(target.createMCSubtargetInfo(pTM->getTargetTriple(), "", std::string("+") + feature));
+	if (!baseSTI || !featureSTI)
+		return false;
+	uint64_t featureBits = featureSTI->getFeatureBits() & ~baseSTI->getFeatureBits();
+	return featureBits != 0 && (pTM->getSubtargetImpl()->getFeatureBits() & featureBits) == featureBits;
+}
+
+CodeGenState* CreateCodeGenState(const std::hash_map<std::string, void*>& externalSymbols)
+{
+	std::call_once(s_targetInitFlag, []() {
+		llvm::InitializeNativeTarget();
+		InitializeNativeTargetAsmPrinter();
+		LLVMLinkInMCJIT();
+	});
+	{
+		std::lock_guard<std::mutex> lock(s_targetMutex);
+		++s_liveStateCnt;
+	}
+
+	CodeGenState* pState = new CodeGenState;
+	// This module is used for the predefined(shared) code, every compiled module will get its own one.
+	pState->module = new Module("ksc_predefine", pState->llvmContext);
 	std::string ErrStr;
 
-	std::unique_ptr<llvm::EngineBuilder> eb(new llvm::EngineBuilder(std::unique_ptr<llvm::Module>(CG_Context::TheModule)));
+	std::unique_ptr<llvm::EngineBuilder> eb(new llvm::EngineBuilder(std::unique_ptr<llvm::Module>(pState->module)));
 	// Make sure to use the customized Memory Manager to external symbol lookup(LLVM 3.60 require this change).
-	CG_Context::TheSymbolMemMgr = new GobalSymbolMemManager;
-	eb->setMCJITMemoryManager(std::unique_ptr<SC::GobalSymbolMemManager>(CG_Context::TheSymbolMemMgr));
+	pState->symbolMemMgr = new GobalSymbolMemManager;
+	pState->symbolMemMgr->mGlobalFuncSymbols = externalSymbols;
+	eb->setMCJITMemoryManager(std::unique_ptr<SC::GobalSymbolMemManager>(pState->symbolMemMgr));
 	eb->setErrorStr(&ErrStr);
-
-	SmallVector<std::string, 4> attrs;
-	llvm::Triple targetTriple;
-	// Append "-elf" to make MCJIT to generate ELF data in memory(Windows defaults to COFF)
-	targetTriple.setTriple(sys::getProcessTriple() + "-elf");
-	auto eeTarget = eb->selectTarget(targetTriple, "", "", attrs);
+	pState->module->setTargetTriple(s_targetTriple);
+	auto eeTarget = SelectTargetMachine(*eb);
+	// The execution engine takes the ownership of the target machine, keep it for the analysis passes
+	pState->targetMachine = eeTarget;
 
 	// Now create the execute engine.
-	CG_Context::TheExecutionEngine = eb->create(eeTarget);
+	pState->executionEngine = eb->create(eeTarget);
+
+	if (!pState->executionEngine) {
+		// The engine builder still owns the module and the memory manager
+		pState->module = NULL;
+		pState->symbolMemMgr = NULL;
+		DestroyCodeGenState(pState);
+		return NULL;
+	}
+	pState->executionEngine->setObjectCache(CG_Context::TheObjectCache);
+
+	// Start with registering info about how the target lays out data structures.
+	pState->dataLayout = pState->executionEngine->getDataLayout();
+	pState->module->setDataLayout(pState->dataLayout);
+
+	llvm::Triple::ArchType arch = llvm::Triple(s_targetTriple).getArch();
+	if (arch == llvm::Triple::x86 || arch == llvm::Triple::x86_64)
+		pState->hasAVX2 = TargetHasFeature(pState->targetMachine, "avx2");
+
+	return pState;
+}
+
+void DestroyCodeGenState(CodeGenState* pState)
+{
+	if (!pState)
+		return;
+	// The execution engine owns all the modules added to it.
+	delete pState->executionEngine;
+	delete pState->sharedCodeIR;
+	delete pState;
+
+	std::lock_guard<std::mutex> lock(s_targetMutex);
+	--s_liveStateCnt;
+}
+
+llvm::Module* CreateCodeGenModule(const std::string& name)
+{
+	llvm::Module* M = new Module(name, CG_Context::TheLLVMContext());
+	M->setTargetTriple(s_targetTriple);
+	M->setDataLayout(CG_Context::TheDataLayout());
+	return M;
+}
+
+llvm::ExecutionEngine* CreateModuleEngine(llvm::Module* M)
+{
+	std::string ErrStr;
+	llvm::EngineBuilder eb((std::unique_ptr<llvm::Module>(M)));
+	eb.setMCJITMemoryManager(std::unique_ptr<SC::GobalSymbolMemManager>(
+		new GobalSymbolMemManager(s_pCurState->symbolMemMgr, s_pCurState->executionEngine)));
+	eb.setErrorStr(&ErrStr);
+	llvm::TargetMachine* pTM = SelectTargetMachine(eb);
+	llvm::ExecutionEngine* pEngine = pTM ? eb.create(pTM) : NULL;
+	if (!pEngine)
+		return NULL;
+	pEngine->setObjectCache(CG_Context::TheObjectCache);
+	return pEngine;
+}
+
+void DestroyCodeGenModule(KSC_ModuleDesc& moduleDesc)
+{
+	// The engine owns the module and the late modules added to it, while the partitioned module is removed 
+	// from it. Its memory manager frees the JIT-ed code and data of them all.
+	if (moduleDesc.mPartitionCnt > 0)
+		delete moduleDesc.M;
+	delete moduleDesc.mpEngine;
+	moduleDesc.mpEngine = NULL;
+	moduleDesc.M = NULL;
+	moduleDesc.mLateModules.clear();
+	moduleDesc.mTierUpM = NULL;
+	delete moduleDesc.mSourceIR;
+	moduleDesc.mSourceIR = NULL;
+	moduleDesc.mPartitionCnt = 0;
+	moduleDesc.mCodeEmitted = false;
+}
+
+void SetSharedCodeModule(const llvm::Module* sharedM)
+{
+	llvm::Module*& sharedCodeIR = s_pCurState->sharedCodeIR;
+	delete sharedCodeIR;
+	sharedCodeIR = NULL;
+
+	bool hasDefinition = false;
+	for (llvm::Module::const_iterator F = sharedM->begin(); F != sharedM->end(); ++F) {
+		if (!F->isDeclaration()) {
+			hasDefinition = true;
+			break;
+		}
+	}
+	if (!hasDefinition)
+		return;
+
+	sharedCodeIR = llvm::CloneModule(sharedM);
+	for (llvm::Module::iterator F = sharedCodeIR->begin(); F != sharedCodeIR->end(); ++F) {
+		if (!F->isDeclaration())
+			F->setLinkage(GlobalValue::AvailableExternallyLinkage);
+	}
+}
+
+bool ImportSharedCode(llvm::Module* M)
+{
+	if (!s_pCurState->sharedCodeIR)
+		return true;
+
+	// The linker consumes the source module, so link a copy of it.
+	llvm::Module* sharedM = llvm::CloneModule(s_pCurState->sharedCodeIR);
+	bool failed = llvm::Linker::LinkModules(M, sharedM);
+	delete sharedM;
+	return !failed;
+}
+
+// Optimize and emit one part of the module in the LLVM context and target machine of the calling thread. The part
+// is parsed from the bitcode of the whole module, then the bodies owned by the other parts are dropped.
+static bool EmitModulePart(const std::string& bitcode, const std::string& partName, int partIdx, 
+						   const std::hash_map<std::string, int>& funcParts, OptLevel optLevel, std::string& outObj, bool& outIsCached)
+{
+	llvm::LLVMContext llvmContext;
+	// The object cache is looked up by the module name only, so the cached part skips the parsing as well. The 
+	// lookup is counted for the whole module by the caller rather than for each part.
+	{
+		llvm::Module keyM(partName, llvmContext);
+		outIsCached = CG_Context::TheObjectCache->ReadObject(&keyM, outObj);
+		if (outIsCached)
+			return true;
+	}
+
+	llvm::ErrorOr<llvm::Module*> parsedM = llvm::parseBitcodeFile(llvm::MemoryBufferRef(bitcode, partName), llvmContext);
+	if (!parsedM)
+		return false;
+	std::unique_ptr<llvm::Module> partM(parsedM.get());
+	partM->setModuleIdentifier(partName);
+
+	for (llvm::Module::iterator F = partM->begin(); F != partM->end(); ++F) {
+		if (F->isDeclaration() || F->hasAvailableExternallyLinkage())
+			continue;
+		std::hash_map<std::string, int>::const_iterator it = funcParts.find(F->getName());
+		if (it != funcParts.end() && it->second != partIdx)
+			F->deleteBody();
+	}
+	// The global variables are defined by the first part, the other parts reference them.
+	if (partIdx > 0) {
+		for (llvm::Module::global_iterator GV = partM->global_begin(); GV != partM->global_end(); ++GV) {
+			if (GV->isDeclaration() || GV->hasAvailableExternallyLinkage())
+				continue;
+			GV->setInitializer(NULL);
+			GV->setLinkage(GlobalValue::ExternalLinkage);
+		}
+	}
 
-	if (!CG_Context::TheExecutionEngine) {
+	llvm::EngineBuilder eb;
+	std::unique_ptr<llvm::TargetMachine> targetMachine(SelectTargetMachine(eb));
+	if (!targetMachine)
 		return false;
+	CG_Context::OptimizeModule(partM.get(), optLevel, targetMachine.get());
+	if (!CG_Context::EmitObjectCode(partM.get(), outObj, targetMachine.get()))
+		return false;
+	CG_Context::TheObjectCache->notifyObjectCompiled(partM.get(), llvm::MemoryBufferRef(outObj, partName));
+	return true;
+}
+
+bool EmitModulePartitions(llvm::Module* M, int partitionCnt, OptLevel optLevel, std::vector<std::string>& outObjs)
+{
+	std::vector<llvm::Function*> funcs;
+	std::vector<size_t> funcSizes;
+	size_t totalSize = 0;
+	for (llvm::Module::iterator F = M->begin(); F != M->end(); ++F) {
+		if (F->isDeclaration() || F->hasAvailableExternallyLinkage())
+			continue;
+		size_t size = 0;
+		for (llvm::Function::iterator BB = F->begin(); BB != F->end(); ++BB)
+			size += BB->size();
+		funcs.push_back(&*F);
+		funcSizes.push_back(size);
+		totalSize += size;
+	}
+	partitionCnt = std::max(1, std::min(partitionCnt, (int)funcs.size()));
+
+	// Each part owns a contiguous run of the functions with about the same count of instructions. The run is not 
+	// cut before a function that calls the previous one(e.g. the JIT wrapper of a function), so it can still be inlined.
+	std::hash_map<std::string, int> funcParts;
+	size_t accumSize = 0;
+	int prevPart = 0;
+	for (size_t i = 0; i < funcs.size(); ++i) {
+		int part = totalSize > 0 ? (int)((accumSize + funcSizes[i] / 2) * partitionCnt / totalSize) : 0;
+		part = std::min(part, partitionCnt - 1);
+		if (part != prevPart && i > 0) {
+			for (llvm::Value::user_iterator U = funcs[i - 1]->user_begin(); U != funcs[i - 1]->user_end(); ++U) {
+				llvm::Instruction* inst = llvm::dyn_cast<llvm::Instruction>(*U);
+				if (inst && inst->getParent()->getParent() == funcs[i]) {
+					part = prevPart;
+					break;
+				}
+			}
+		}
+		funcParts[funcs[i]->getName()] = part;
+		accumSize += funcSizes[i];
+		prevPart = part;
+	}
+
+	// The parts reference each other by the symbol names, so the local symbols are made external. The module name
+	// keeps them from clashing with the symbols of the other modules.
+	const std::string nameSuffix = "." + M->getModuleIdentifier();
+	for (llvm::Module::iterator F = M->begin(); F != M->end(); ++F) {
+		if (F->hasLocalLinkage()) {
+			F->setName(F->getName() + nameSuffix);
+			F->setLinkage(GlobalValue::ExternalLinkage);
+		}
+	}
+	for (llvm::Module::global_iterator GV = M->global_begin(); GV != M->global_end(); ++GV) {
+		if (GV->hasLocalLinkage()) {
+			GV->setName(GV->getName() + nameSuffix);
+			GV->setLinkage(GlobalValue::ExternalLinkage);
+		}
+	}
+
+	// The LLVM context is not thread-safe, so every part is handed to its thread as bitcode.
+	std::string bitcode;
+	{
+		llvm::raw_string_ostream bitcodeStream(bitcode);
+		llvm::WriteBitcodeToFile(M, bitcodeStream);
+	}
+	std::vector<std::string> partNames(partitionCnt);
+	for (int i = 0; i < partitionCnt; ++i) {
+		char partSuffix[32];
+		sprintf_s(partSuffix, ".part%d", i);
+		partNames[i] = M->getModuleIdentifier() + partSuffix;
+	}
+
+	outObjs.assign(partitionCnt, std::string());
+	std::vector<char> succeeded(partitionCnt, 0);
+	std::vector<char> cached(partitionCnt, 0);
+	auto emitPart = [&](int partIdx) {
+		bool isCached = false;
+		succeeded[partIdx] = EmitModulePart(bitcode, partNames[partIdx], partIdx, funcParts, optLevel, outObjs[partIdx], isCached) ? 1 : 0;
+		cached[partIdx] = isCached ? 1 : 0;
+	};
+	std::vector<std::thread> partThreads;
+	for (int i = 1; i < partitionCnt; ++i)
+		partThreads.push_back(std::thread(emitPart, i));
+	emitPart(0);
+	for (size_t i = 0; i < partThreads.size(); ++i)
+		partThreads[i].join();
+
+	CG_Context::TheObjectCache->CountLookup(std::find(cached.begin(), cached.end(), 0) == cached.end());
+	return std::find(succeeded.begin(), succeeded.end(), 0) == succeeded.end();
+}
+
+void CG_Context::OptimizeModule(llvm::Module* M, OptLevel optLevel, llvm::TargetMachine* pTM)
+{
+	if (optLevel == kOptNone)
+		return;
+	if (!pTM)
+		pTM = TheTargetMachine();
+
+	llvm::PassManagerBuilder PMB;
+	PMB.OptLevel = (optLevel == kOptSize) ? 2 : (unsigned)optLevel;
+	PMB.SizeLevel = (optLevel == kOptSize) ? 1 : 0;
+
+	if (optLevel == kOptLess) {
+		// Keep the cheap level function-local, which is close to what the old fixed pipeline did.
+		PMB.DisableUnrollLoops = true;
+	}
+	else {
+		// Small helper functions must be inlined into the hot loops before the vectorizers get a chance.
+		PMB.Inliner = createFunctionInliningPass(PMB.OptLevel, PMB.SizeLevel);
+		PMB.LoopVectorize = (optLevel != kOptSize);
+		PMB.SLPVectorize = (optLevel != kOptSize);
+		PMB.DisableUnrollLoops = (optLevel == kOptSize);
 	}
 
-	CG_Context::TheFPM = new llvm::FunctionPassManager(CG_Context::TheModule);
+	// The target analysis passes give the vectorizers the cost model of the JIT target.
+	llvm::FunctionPassManager FPM(M);
+	FPM.add(new DataLayoutPass());
+	if (pTM)
+		pTM->addAnalysisPasses(FPM);
+	PMB.populateFunctionPassManager(FPM);
+
+	llvm::PassManager MPM;
+	MPM.add(new DataLayoutPass());
+	if (pTM)
+		pTM->addAnalysisPasses(MPM);
+	PMB.populateModulePassManager(MPM);
+
+	FPM.doInitialization();
+	for (llvm::Module::iterator F = M->begin(); F != M->end(); ++F) {
+		if (!F->isDeclaration())
+			FPM.run(*F);
+	}
+	FPM.doFinalization();
 
-	// Set up the optimizer pipeline.  Start with registering info about how the
-	// target lays out data structures.
-	CG_Context::TheDataLayout = CG_Context::TheExecutionEngine->getDataLayout();
-	//CG_Context::TheFPM->add(CG_Context::TheDataLayout);
-	// Provide basic AliasAnalysis support for GVN.
-	CG_Context::TheFPM->add(createBasicAliasAnalysisPass());
-	// Promote allocas to registers.
-	CG_Context::TheFPM->add(createPromoteMemoryToRegisterPass());
-	// Do simple "peephole" optimizations and bit-twiddling optzns.
-	CG_Context::TheFPM->add(createInstructionCombiningPass());
-	// Reassociate expressions.
-	CG_Context::TheFPM->add(createReassociatePass());
-	// Eliminate Common SubExpressions.
-	CG_Context::TheFPM->add(createGVNPass());
-	// Simplify the control flow graph (deleting unreachable blocks, etc).
-	CG_Context::TheFPM->add(createCFGSimplificationPass());
+	MPM.run(*M);
+}
 
-	CG_Context::TheFPM->doInitialization();
+llvm::Function* CG_Context::CreateTierUpStub(llvm::Function* F, int threshold, std::string& outSlotName)
+{
+	// The stub counts the calls and requests the optimized tier once the count reaches the threshold,
+	// then it forwards the call to the function held by the slot, which is redirected to the optimized 
+	// function after the optimized tier is JIT-ed.
+	llvm::Module* M = F->getParent();
+	llvm::LLVMContext& ctx = M->getContext();
+	std::string entryName = F->getName();
+	outSlotName = entryName + ".slot";
+
+	llvm::GlobalVariable* slot = new llvm::GlobalVariable(*M, F->getType(), false, 
+		GlobalValue::ExternalLinkage, F, outSlotName);
+	llvm::GlobalVariable* counter = new llvm::GlobalVariable(*M, SC_INT_TYPE, false, 
+		GlobalValue::InternalLinkage, ConstantInt::get(SC_INT_TYPE, 0), entryName + ".cnt");
+
+	Type* requestArgTypes[] = { Type::getInt8PtrTy(ctx) };
+	Constant* requestF = M->getOrInsertFunction("__ksc_request_tier_up", 
+		FunctionType::get(Type::getVoidTy(ctx), requestArgTypes, false));
+
+	Function* stubF = Function::Create(F->getFunctionType(), GlobalValue::ExternalLinkage, entryName + ".stub", M);
+	llvm::BasicBlock* entryBB = llvm::BasicBlock::Create(ctx, "entry", stubF);
+	llvm::BasicBlock* countBB = llvm::BasicBlock::Create(ctx, "count_call", stubF);
+	llvm::BasicBlock* requestBB = llvm::BasicBlock::Create(ctx, "request_tier_up", stubF);
+	llvm::BasicBlock* callBB = llvm::BasicBlock::Create(ctx, "call_target", stubF);
+
+	llvm::IRBuilder<> builder(entryBB);
+	// Counting stops at the threshold, so the calls after the tier-up request only pay a plain load and
+	// never contend on the counter's cache line, and the counter cannot wrap around.
+	llvm::LoadInst* curCnt = builder.CreateLoad(counter);
+	curCnt->setAlignment(TheDataLayout()->getABITypeAlignment(SC_INT_TYPE));
+	curCnt->setAtomic(Monotonic);
+	builder.CreateCondBr(builder.CreateICmpSLT(curCnt, ConstantInt::get(SC_INT_TYPE, threshold)), countBB, callBB);
+
+	builder.SetInsertPoint(countBB);
+	// The count might be increased from multiple threads, the atomic add makes sure only one of them
+	// sees the threshold.
+	llvm::Value* oldCnt = builder.CreateAtomicRMW(AtomicRMWInst::Add, counter, ConstantInt::get(SC_INT_TYPE, 1), Monotonic);
+	builder.CreateCondBr(builder.CreateICmpEQ(oldCnt, ConstantInt::get(SC_INT_TYPE, threshold - 1)), requestBB, callBB);
+
+	builder.SetInsertPoint(requestBB);
+	builder.CreateCall(requestF, builder.CreateBitCast(slot, Type::getInt8PtrTy(ctx)));
+	builder.CreateBr(callBB);
+
+	builder.SetInsertPoint(callBB);
+	llvm::LoadInst* target = builder.CreateLoad(slot);
+	target->setAlignment(TheDataLayout()->getPointerABIAlignment());
+	target->setAtomic(Monotonic);
+	std::vector<llvm::Value*> args;
+	for (Function::arg_iterator AI = stubF->arg_begin(); AI != stubF->arg_end(); ++AI)
+		args.push_back(AI);
+	llvm::CallInst* call = builder.CreateCall(target, args);
+	call->setTailCall();
+	if (stubF->getReturnType()->isVoidTy())
+		builder.CreateRetVoid();
+	else
+		builder.CreateRet(call);
+
+	return stubF;
+}
 
+bool CG_Context::EmitObjectCode(llvm::Module* M, std::string& outObj, llvm::TargetMachine* pTM)
+{
+	if (!pTM)
+		pTM = TheTargetMachine();
+	// Generate the object the same way MCJIT does, but into our own buffer.
+	llvm::PassManager PM;
+	PM.add(new DataLayoutPass());
+	llvm::SmallVector<char, 4096> objBuffer;
+	llvm::raw_svector_ostream objStream(objBuffer);
+	llvm::MCContext* pMCCtx = NULL;
+	if (pTM->addPassesToEmitMC(PM, pMCCtx, objStream, false))
+		return false;
+	PM.run(*M);
+	objStream.flush();
+	outObj.assign(objBuffer.begin(), objBuffer.end());
 	return true;
 }
 
-void DestoryCodeGen()
+void CG_Context::AddLoopVectorizeHint(llvm::BranchInst* loopLatch, int width)
+{
+	llvm::LLVMContext& ctx = loopLatch->getContext();
+	SmallVector<Metadata*, 4> loopArgs;
+	// The first operand is reserved for the self reference of the loop ID
+	MDNode* tempNode = MDNode::getTemporary(ctx, None);
+	loopArgs.push_back(tempNode);
+
+	Metadata* enableArgs[] = { MDString::get(ctx, "llvm.loop.vectorize.enable"), 
+		ConstantAsMetadata::get(ConstantInt::getTrue(ctx)) };
+	loopArgs.push_back(MDNode::get(ctx, enableArgs));
+	if (width > 1) {
+		Metadata* widthArgs[] = { MDString::get(ctx, "llvm.loop.vectorize.width"), 
+			ConstantAsMetadata::get(ConstantInt::get(Type::getInt32Ty(ctx), width)) };
+		loopArgs.push_back(MDNode::get(ctx, widthArgs));
+	}
+
+	MDNode* loopID = MDNode::get(ctx, loopArgs);
+	loopID->replaceOperandWith(0, loopID);
+	MDNode::deleteTemporary(tempNode);
+	loopLatch->setMetadata("llvm.loop", loopID);
+}
+
+// Sum up all the elements of the float vector, the halves are added with shuffles while the element 
+// count is even, the remaining elements are extracted and added.
+static llvm::Value* CreateHorizontalAdd(llvm::IRBuilder<>& builder, llvm::Value* srcValue)
+{
+	if (!srcValue->getType()->isVectorTy())
+		return srcValue;
+
+	int elemCnt = srcValue->getType()->getVectorNumElements();
+	while (elemCnt > 2 && (elemCnt % 2) == 0) {
+		int halfCnt = elemCnt / 2;
+		llvm::SmallVector<Constant*, 4> loIdxs, hiIdxs;
+		for (int i = 0; i < halfCnt; ++i) {
+			loIdxs.push_back(builder.getInt32(i));
+			hiIdxs.push_back(builder.getInt32(i + halfCnt));
+		}
+		llvm::Value* undefValue = llvm::UndefValue::get(srcValue->getType());
+		llvm::Value* lo = builder.CreateShuffleVector(srcValue, undefValue, llvm::ConstantVector::get(loIdxs));
+		llvm::Value* hi = builder.CreateShuffleVector(srcValue, undefValue, llvm::ConstantVector::get(hiIdxs));
+		srcValue = builder.CreateFAdd(lo, hi);
+		elemCnt = halfCnt;
+	}
+
+	llvm::Value* sum = builder.CreateExtractElement(srcValue, builder.getInt32(0));
+	for (int i = 1; i < elemCnt; ++i)
+		sum = builder.CreateFAdd(sum, builder.CreateExtractElement(srcValue, builder.getInt32(i)));
+	return sum;
+}
+
+static llvm::Value* CreateShuffle3(llvm::IRBuilder<>& builder, llvm::Value* srcValue, int i0, int i1, int i2)
+{
+	llvm::Constant* idxs[] = { builder.getInt32(i0), builder.getInt32(i1), builder.getInt32(i2) };
+	return builder.CreateShuffleVector(srcValue, llvm::UndefValue::get(srcValue->getType()), llvm::ConstantVector::get(idxs));
+}
+
+llvm::Value* CG_Context::CreateIntrinsicCall(IntrinsicFunc func, const std::vector<llvm::Value*>& args, VarType argType)
+{
+	// The LLVM intrinsics used here are all overloaded on the single float or float vector type of the arguments.
+	llvm::Type* overloadType = ConvertToLLVMType(argType);
+	bool isInt = IsIntegerType(argType);
+
+	switch (func) {
+	case kIntrinsicSin:
+		return Builder().CreateCall(Intrinsic::getDeclaration(TheModule(), Intrinsic::sin, overloadType), args);
+	case kIntrinsicCos:
+		return Builder().CreateCall(Intrinsic::getDeclaration(TheModule(), Intrinsic::cos, overloadType), args);
+	case kIntrinsicPow:
+		return Builder().CreateCall(Intrinsic::getDeclaration(TheModule(), Intrinsic::pow, overloadType), args);
+	case kIntrinsicSqrt:
+		return Builder().CreateCall(Intrinsic::getDeclaration(TheModule(), Intrinsic::sqrt, overloadType), args);
+	case kIntrinsicFabs:
+		return Builder().CreateCall(Intrinsic::getDeclaration(TheModule(), Intrinsic::fabs, overloadType), args);
+	case kIntrinsicMad:
+		// fmuladd is fused into a single FMA instruction when the target supports it
+		return Builder().CreateCall(Intrinsic::getDeclaration(TheModule(), Intrinsic::fmuladd, overloadType), args);
+	case kIntrinsicLerp:
+	{
+		// lerp(a, b, t) = a + t * (b - a)
+		llvm::Value* diff = Builder().CreateFSub(args[1], args[0]);
+		llvm::Value* madArgs[] = { args[2], diff, args[0] };
+		return Builder().CreateCall(Intrinsic::getDeclaration(TheModule(), Intrinsic::fmuladd, overloadType), madArgs);
+	}
+	case kIntrinsicRsqrt:
+	{
+		llvm::Value* sqrtValue = Builder().CreateCall(Intrinsic::getDeclaration(TheModule(), Intrinsic::sqrt, overloadType), args[0]);
+		return Builder().CreateFDiv(ConstantFP::get(overloadType, 1.0), sqrtValue);
+	}
+	case kIntrinsicDot:
+		return CreateHorizontalAdd(Builder(), Builder().CreateFMul(args[0], args[1]));
+	case kIntrinsicLength:
+	{
+		llvm::Value* dotValue = CreateHorizontalAdd(Builder(), Builder().CreateFMul(args[0], args[0]));
+		return Builder().CreateCall(Intrinsic::getDeclaration(TheModule(), Intrinsic::sqrt, SC_FLOAT_TYPE), dotValue);
+	}
+	case kIntrinsicNormalize:
+	{
+		llvm::Value* dotValue = CreateHorizontalAdd(Builder(), Builder().CreateFMul(args[0], args[0]));
+		llvm::Value* lenValue = Builder().CreateCall(Intrinsic::getDeclaration(TheModule(), Intrinsic::sqrt, SC_FLOAT_TYPE), dotValue);
+		llvm::Value* invLen = Builder().CreateFDiv(ConstantFP::get(SC_FLOAT_TYPE, 1.0), lenValue);
+		return Builder().CreateFMul(args[0], CastValueType(invLen, VarType::kFloat, argType));
+	}
+	case kIntrinsicCross:
+	{
+		// cross(a, b) = a.yzx * b.zxy - a.zxy * b.yzx
+		llvm::Value* l = Builder().CreateFMul(CreateShuffle3(Builder(), args[0], 1, 2, 0), CreateShuffle3(Builder(), args[1], 2, 0, 1));
+		llvm::Value* r = Builder().CreateFMul(CreateShuffle3(Builder(), args[0], 2, 0, 1), CreateShuffle3(Builder(), args[1], 1, 2, 0));
+		return Builder().CreateFSub(l, r);
+	}
+	case kIntrinsicMin:
+	{
+		llvm::Value* cmp = isInt ? Builder().CreateICmpSLT(args[0], args[1]) : Builder().CreateFCmpOLT(args[0], args[1]);
+		return Builder().CreateSelect(cmp, args[0], args[1]);
+	}
+	case kIntrinsicMax:
+	{
+		llvm::Value* cmp = isInt ? Builder().CreateICmpSGT(args[0], args[1]) : Builder().CreateFCmpOGT(args[0], args[1]);
+		return Builder().CreateSelect(cmp, args[0], args[1]);
+	}
+	case kIntrinsicClamp:
+	case kIntrinsicSaturate:
+	{
+		// clamp(x, lo, hi) = min(max(x, lo), hi), saturate(x) = clamp(x, 0, 1)
+		llvm::Value* lo = (func == kIntrinsicSaturate) ? ConstantFP::get(overloadType, 0.0) : args[1];
+		llvm::Value* hi = (func == kIntrinsicSaturate) ? ConstantFP::get(overloadType, 1.0) : args[2];
+		llvm::Value* cmpLo = isInt ? Builder().CreateICmpSGT(args[0], lo) : Builder().CreateFCmpOGT(args[0], lo);
+		llvm::Value* value = Builder().CreateSelect(cmpLo, args[0], lo);
+		llvm::Value* cmpHi = isInt ? Builder().CreateICmpSLT(value, hi) : Builder().CreateFCmpOLT(value, hi);
+		return Builder().CreateSelect(cmpHi, value, hi);
+	}
+	case kIntrinsicAny:
+	case kIntrinsicAll:
+	{
+		if (!args[0]->getType()->isVectorTy())
+			return args[0];
+		// Gather the sign bits of the lanes into an integer, which is a single movmsk instruction.
+		unsigned elemCnt = args[0]->getType()->getVectorNumElements();
+		llvm::Value* bits = Builder().CreateBitCast(ConvertMaskToBool(args[0]), Builder().getIntNTy(elemCnt));
+		if (func == kIntrinsicAny)
+			return Builder().CreateICmpNE(bits, llvm::Constant::getNullValue(bits->getType()));
+		else
+			return Builder().CreateICmpEQ(bits, llvm::Constant::getAllOnesValue(bits->getType()));
+	}
+	}
+
+	assert(0);
+	return NULL;
+}
+
+llvm::Value* CG_Context::CreateGather(llvm::Value* basePtr, llvm::Value* idxVec)
+{
+	llvm::Type* elemType = basePtr->getType()->getPointerElementType();
+	unsigned elemCnt = idxVec->getType()->getVectorNumElements();
+	llvm::Type* vecType = VectorType::get(elemType, elemCnt);
+
+	// Use the AVX2 gather instruction for the 4 and 8 lanes of the 32-bit elements.
+	if ((elemCnt == 4 || elemCnt == 8) && (elemType->isFloatTy() || elemType->isIntegerTy(32)) && s_pCurState->hasAVX2) {
+		Intrinsic::ID gatherID;
+		if (elemType->isFloatTy())
+			gatherID = (elemCnt == 4) ? Intrinsic::x86_avx2_gather_d_ps : Intrinsic::x86_avx2_gather_d_ps_256;
+		else
+			gatherID = (elemCnt == 4) ? Intrinsic::x86_avx2_gather_d_d : Intrinsic::x86_avx2_gather_d_d_256;
+		// The lane is loaded when the sign bit of its mask is set, i.e. all the lanes are loaded.
+		llvm::Value* mask = Builder().CreateBitCast(llvm::Constant::getAllOnesValue(idxVec->getType()), vecType);
+		llvm::Value* args[] = { llvm::UndefValue::get(vecType), Builder().CreateBitCast(basePtr, Builder().getInt8PtrTy()), 
+			idxVec, mask, Builder().getInt8(4) };
+		return Builder().CreateCall(Intrinsic::getDeclaration(TheModule(), gatherID), args);
+	}
+
+	llvm::Value* ret = llvm::UndefValue::get(vecType);
+	for (unsigned i = 0; i < elemCnt; ++i) {
+		llvm::Value* idx = Builder().CreateExtractElement(idxVec, Builder().getInt32(i));
+		llvm::Value* elemValue = Builder().CreateLoad(Builder().CreateGEP(basePtr, idx));
+		ret = Builder().CreateInsertElement(ret, elemValue, Builder().getInt32(i));
+	}
+	return elemType == SC_BOOL_TYPE ? ConvertBoolToMask(ret) : ret;
+}
+
+void CG_Context::CreateScatter(llvm::Value* basePtr, llvm::Value* idxVec, llvm::Value* value)
+{
+	// There's no scatter instruction before AVX-512, the lanes are stored in order so the last lane wins
+	// if the indices are repeated.
+	unsigned elemCnt = idxVec->getType()->getVectorNumElements();
+	if (basePtr->getType()->getPointerElementType() == SC_BOOL_TYPE)
+		value = ConvertMaskToBool(value);
+	for (unsigned i = 0; i < elemCnt; ++i) {
+		llvm::Value* idx = Builder().CreateExtractElement(idxVec, Builder().getInt32(i));
+		llvm::Value* elemValue = Builder().CreateExtractElement(value, Builder().getInt32(i));
+		Builder().CreateStore(elemValue, Builder().CreateGEP(basePtr, idx));
+	}
+}
+
+void CG_Context::ApplyFPMode(FPMode mode)
+{
+	if (mode == kFPModeFast) {
+		FastMathFlags fmf;
+		fmf.setUnsafeAlgebra();
+		Builder().SetFastMathFlags(fmf);
+	}
+	else if (mode == kFPModePrecise)
+		Builder().clearFastMathFlags();
+}
+
+static bool IsLaneScalarType(llvm::Type* tp)
+{
+	return tp->isFloatingPointTy() || tp->isIntegerTy();
+}
+
+static llvm::Type* GetLaneStorageType(llvm::Type* tp)
+{
+	// The hosting C++ code stores the boolean as SC::Boolean
+	return tp->isIntegerTy(1) ? SC_INT_TYPE : tp;
+}
+
+// The scalar component of a structure, which is one stream in the SoA layout.
+struct LayoutLeaf {
+	// The indices from the structure down to the scalar
+	std::vector<unsigned> path;
+	// Whether the last index selects the element of a vector
+	bool inVector;
+	// Whether the scalar is a boolean in the KSC layout, which is the lane mask if it is in a vector. The lanes
+	// of the boolean vectors are only told from the int lanes in the layout type(see "ConvertToLayoutType").
+	bool isBoolean;
+	// The type of the scalar in the packed and the SoA layouts
+	llvm::Type* storageType;
+};
+
+static void CollectLayoutLeaves(llvm::Type* tp, std::vector<unsigned>& path, std::vector<LayoutLeaf>& leaves)
+{
+	if (tp->isStructTy()) {
+		for (unsigned i = 0; i < tp->getStructNumElements(); ++i) {
+			path.push_back(i);
+			CollectLayoutLeaves(tp->getStructElementType(i), path, leaves);
+			path.pop_back();
+		}
+	}
+	else if (tp->isArrayTy()) {
+		for (unsigned i = 0; i < (unsigned)tp->getArrayNumElements(); ++i) {
+			path.push_back(i);
+			CollectLayoutLeaves(tp->getArrayElementType(), path, leaves);
+			path.pop_back();
+		}
+	}
+	else {
+		bool isVector = tp->isVectorTy();
+		llvm::Type* scalarType = isVector ? tp->getVectorElementType() : tp;
+		int cnt = isVector ? (int)tp->getVectorNumElements() : 1;
+		for (int i = 0; i < cnt; ++i) {
+			LayoutLeaf leaf;
+			leaf.path = path;
+			if (isVector)
+				leaf.path.push_back(i);
+			leaf.inVector = isVector;
+			leaf.isBoolean = scalarType->isIntegerTy(1);
+			leaf.storageType = GetLaneStorageType(scalarType);
+			leaves.push_back(leaf);
+		}
+	}
+}
+
+static llvm::Value* CreateLeafGEP(llvm::IRBuilder<>& builder, llvm::Value* elemPtr, const std::vector<unsigned>& path, size_t depth)
+{
+	std::vector<llvm::Value*> indices;
+	indices.push_back(builder.getInt32(0));
+	for (size_t i = 0; i < depth; ++i)
+		indices.push_back(builder.getInt32(path[i]));
+	return builder.CreateGEP(elemPtr, indices);
+}
+
+// Load the component of the element "elemIdx", "base" is the typed pointer to the structure array for the AoS layouts, 
+// or the typed stream of the component for the SoA layout. The value is returned in its packed representation.
+static llvm::Value* LoadLayoutLeaf(llvm::IRBuilder<>& builder, MemLayout layout, const LayoutLeaf& leaf, llvm::Value* base, llvm::Value* elemIdx)
+{
+	llvm::Value* elemPtr = builder.CreateGEP(base, elemIdx);
+	if (layout == kLayoutSoA)
+		return builder.CreateLoad(elemPtr);
+
+	if (layout == kLayoutPacked)
+		return builder.CreateLoad(CreateLeafGEP(builder, elemPtr, leaf.path, leaf.path.size()));
+
+	llvm::Value* value = NULL;
+	if (leaf.inVector) {
+		llvm::Value* vecValue = builder.CreateLoad(CreateLeafGEP(builder, elemPtr, leaf.path, leaf.path.size() - 1));
+		value = builder.CreateExtractElement(vecValue, builder.getInt32(leaf.path.back()));
+	}
+	else
+		value = builder.CreateLoad(CreateLeafGEP(builder, elemPtr, leaf.path, leaf.path.size()));
+	if (leaf.isBoolean)
+		value = leaf.inVector ? builder.CreateAnd(value, ConstantInt::get(leaf.storageType, 1)) : builder.CreateZExt(value, leaf.storageType);
+	return value;
+}
+
+static void StoreLayoutLeaf(llvm::IRBuilder<>& builder, MemLayout layout, const LayoutLeaf& leaf, llvm::Value* base, llvm::Value* elemIdx, llvm::Value* value)
+{
+	llvm::Value* elemPtr = builder.CreateGEP(base, elemIdx);
+	if (layout == kLayoutSoA) {
+		builder.CreateStore(value, elemPtr);
+		return;
+	}
+
+	if (layout == kLayoutPacked) {
+		builder.CreateStore(value, CreateLeafGEP(builder, elemPtr, leaf.path, leaf.path.size()));
+		return;
+	}
+
+	if (leaf.isBoolean) {
+		value = builder.CreateICmpNE(value, ConstantInt::get(leaf.storageType, 0));
+		if (leaf.inVector)
+			value = builder.CreateSExt(value, SC_MASK_LANE_TYPE);
+	}
+	if (leaf.inVector) {
+		// The vector is updated as a whole, the optimizer merges the updates of all its components.
+		llvm::Value* vecPtr = CreateLeafGEP(builder, elemPtr, leaf.path, leaf.path.size() - 1);
+		llvm::Value* vecValue = builder.CreateInsertElement(builder.CreateLoad(vecPtr), value, builder.getInt32(leaf.path.back()));
+		builder.CreateStore(vecValue, vecPtr);
+	}
+	else
+		builder.CreateStore(value, CreateLeafGEP(builder, elemPtr, leaf.path, leaf.path.size()));
+}
+
+// Load the stream pointers from the table at the beginning of the SoA memory.
+static void LoadSoAStreams(llvm::IRBuilder<>& builder, llvm::Value* pSoAData, const std::vector<LayoutLeaf>& leaves, std::vector<llvm::Value*>& outStreams)
+{
+	llvm::Value* streamTable = builder.CreateBitCast(pSoAData, Type::getInt8PtrTy(builder.getContext())->getPointerTo());
+	for (size_t i = 0; i < leaves.size(); ++i) {
+		llvm::Value* stream = builder.CreateLoad(builder.CreateGEP(streamTable, builder.getInt32((int)i)));
+		outStreams.push_back(builder.CreateBitCast(stream, leaves[i].storageType->getPointerTo()));
+	}
+}
+
+llvm::Function* CG_Context::CreateKernelDriver(llvm::Function* F, const KSC_FunctionDesc& fDesc, int width, const std::string& driverName)
+{
+	// The kernel takes one array of "width" elements for each argument(and one more for the return value),
+	// it runs the function for every lane in a loop that is forced to be vectorized with the same width,
+	// so each lane of the SIMD registers holds one invocation of the function. The structure is passed as
+	// the SoA memory instead, the lane gathers it from the streams into a temporary in the KSC layout.
+	llvm::Module* M = F->getParent();
+	llvm::LLVMContext& ctx = M->getContext();
+	llvm::Type* bytePtrType = Type::getInt8PtrTy(ctx);
+	std::vector<llvm::Type*> soaTypes;
+	std::vector<llvm::Type*> driverArgTypes;
+	int Idx = 0;
+	for (Function::arg_iterator AI = F->arg_begin(); AI != F->arg_end(); ++AI, ++Idx) {
+		llvm::Type* argType = AI->getType();
+		llvm::Type* elemType = argType->isPointerTy() ? argType->getPointerElementType() : argType;
+		const KSC_TypeInfo& typeInfo = fDesc.mArgumentTypes[Idx];
+		bool isSoA = elemType->isStructTy() && typeInfo.hStruct && typeInfo.arraySize <= 0;
+		if (!isSoA && !IsLaneScalarType(elemType))
+			return NULL;
+		soaTypes.push_back(isSoA ? ConvertToLayoutType(typeInfo) : NULL);
+		driverArgTypes.push_back(isSoA ? bytePtrType : GetLaneStorageType(elemType)->getPointerTo());
+	}
+	llvm::Type* retType = F->getReturnType();
+	bool isRetSoA = retType->isStructTy() && fDesc.mReturnType.hStruct;
+	soaTypes.push_back(isRetSoA ? ConvertToLayoutType(fDesc.mReturnType) : NULL);
+	if (!retType->isVoidTy()) {
+		if (!isRetSoA && !IsLaneScalarType(retType))
+			return NULL;
+		driverArgTypes.push_back(isRetSoA ? bytePtrType : GetLaneStorageType(retType)->getPointerTo());
+	}
+
+	FunctionType* FT = FunctionType::get(Type::getVoidTy(ctx), driverArgTypes, false);
+	Function* driverF = Function::Create(FT, GlobalValue::ExternalLinkage, driverName, M);
+	llvm::BasicBlock* entryBB = llvm::BasicBlock::Create(ctx, "entry", driverF);
+	llvm::BasicBlock* loopBB = llvm::BasicBlock::Create(ctx, "lane_loop", driverF);
+	llvm::BasicBlock* exitBB = llvm::BasicBlock::Create(ctx, "exit", driverF);
+
+	llvm::IRBuilder<> builder(entryBB);
+	// The boolean passed by reference and the structure need a temporary in their own representation
+	std::vector<llvm::Value*> argTemps;
+	std::vector<std::vector<LayoutLeaf> > soaLeaves(soaTypes.size());
+	std::vector<std::vector<llvm::Value*> > soaStreams(soaTypes.size());
+	Function::arg_iterator driverAI = driverF->arg_begin();
+	Idx = 0;
+	for (Function::arg_iterator AI = F->arg_begin(); AI != F->arg_end(); ++AI, ++driverAI, ++Idx) {
+		llvm::Type* argType = AI->getType();
+		llvm::Value* temp = NULL;
+		if (soaTypes[Idx]) {
+			std::vector<unsigned> path;
+			CollectLayoutLeaves(soaTypes[Idx], path, soaLeaves[Idx]);
+			LoadSoAStreams(builder, driverAI, soaLeaves[Idx], soaStreams[Idx]);
+			temp = builder.CreateAlloca(argType->isPointerTy() ? argType->getPointerElementType() : argType);
+		}
+		else if (argType->isPointerTy() && argType->getPointerElementType()->isIntegerTy(1))
+			temp = builder.CreateAlloca(SC_BOOL_TYPE);
+		argTemps.push_back(temp);
+	}
+	llvm::Value* retTemp = NULL;
+	if (isRetSoA) {
+		std::vector<unsigned> path;
+		CollectLayoutLeaves(soaTypes[Idx], path, soaLeaves[Idx]);
+		LoadSoAStreams(builder, driverAI, soaLeaves[Idx], soaStreams[Idx]);
+		retTemp = builder.CreateAlloca(retType);
+	}
+	builder.CreateBr(loopBB);
+
+	builder.SetInsertPoint(loopBB);
+	llvm::PHINode* laneIdx = builder.CreatePHI(SC_INT_TYPE, 2, "lane");
+	laneIdx->addIncoming(ConstantInt::get(SC_INT_TYPE, 0), entryBB);
+	llvm::Value* zeroIdx = ConstantInt::get(SC_INT_TYPE, 0);
+
+	std::vector<llvm::Value*> args;
+	std::vector<llvm::Value*> elemPtrs;
+	driverAI = driverF->arg_begin();
+	Idx = 0;
+	for (Function::arg_iterator AI = F->arg_begin(); AI != F->arg_end(); ++AI, ++driverAI, ++Idx) {
+		if (soaTypes[Idx]) {
+			// The leaves are collected from the layout type, so the boolean vectors become the lane masks
+			for (size_t li = 0; li < soaLeaves[Idx].size(); ++li) {
+				llvm::Value* value = LoadLayoutLeaf(builder, kLayoutSoA, soaLeaves[Idx][li], soaStreams[Idx][li], laneIdx);
+				StoreLayoutLeaf(builder, kLayoutKSC, soaLeaves[Idx][li], argTemps[Idx], zeroIdx, value);
+			}
+			elemPtrs.push_back(NULL);
+			args.push_back(AI->getType()->isPointerTy() ? argTemps[Idx] : (llvm::Value*)builder.CreateLoad(argTemps[Idx]));
+			continue;
+		}
+		llvm::Value* elemPtr = builder.CreateGEP(driverAI, laneIdx);
+		elemPtrs.push_back(elemPtr);
+		if (argTemps[Idx]) {
+			builder.CreateStore(builder.CreateICmpNE(builder.CreateLoad(elemPtr), ConstantInt::get(SC_INT_TYPE, 0)), argTemps[Idx]);
+			args.push_back(argTemps[Idx]);
+		}
+		else if (AI->getType()->isPointerTy())
+			args.push_back(elemPtr);
+		else if (AI->getType()->isIntegerTy(1))
+			args.push_back(builder.CreateICmpNE(builder.CreateLoad(elemPtr), ConstantInt::get(SC_INT_TYPE, 0)));
+		else
+			args.push_back(builder.CreateLoad(elemPtr));
+	}
+
+	llvm::Value* retValue = builder.CreateCall(F, args);
+	Idx = 0;
+	for (Function::arg_iterator AI = F->arg_begin(); AI != F->arg_end(); ++AI, ++Idx) {
+		if (!argTemps[Idx] || !AI->getType()->isPointerTy())
+			continue;
+		if (soaTypes[Idx]) {
+			// Scatter the structure passed by reference back to the streams
+			for (size_t li = 0; li < soaLeaves[Idx].size(); ++li) {
+				llvm::Value* value = LoadLayoutLeaf(builder, kLayoutKSC, soaLeaves[Idx][li], argTemps[Idx], zeroIdx);
+				StoreLayoutLeaf(builder, kLayoutSoA, soaLeaves[Idx][li], soaStreams[Idx][li], laneIdx, value);
+			}
+		}
+		else
+			builder.CreateStore(builder.CreateZExt(builder.CreateLoad(argTemps[Idx]), SC_INT_TYPE), elemPtrs[Idx]);
+	}
+	if (retTemp) {
+		builder.CreateStore(retValue, retTemp);
+		for (size_t li = 0; li < soaLeaves[Idx].size(); ++li) {
+			llvm::Value* value = LoadLayoutLeaf(builder, kLayoutKSC, soaLeaves[Idx][li], retTemp, zeroIdx);
+			StoreLayoutLeaf(builder, kLayoutSoA, soaLeaves[Idx][li], soaStreams[Idx][li], laneIdx, value);
+		}
+	}
+	else if (!retType->isVoidTy()) {
+		if (retType->isIntegerTy(1))
+			retValue = builder.CreateZExt(retValue, SC_INT_TYPE);
+		builder.CreateStore(retValue, builder.CreateGEP(driverAI, laneIdx));
+	}
+
+	llvm::Value* nextIdx = builder.CreateAdd(laneIdx, ConstantInt::get(SC_INT_TYPE, 1));
+	laneIdx->addIncoming(nextIdx, loopBB);
+	llvm::BranchInst* loopLatch = builder.CreateCondBr(builder.CreateICmpSLT(nextIdx, ConstantInt::get(SC_INT_TYPE, width)), loopBB, exitBB);
+	AddLoopVectorizeHint(loopLatch, width);
+
+	builder.SetInsertPoint(exitBB);
+	builder.CreateRetVoid();
+	return driverF;
+}
+
+bool CG_Context::IsKernelVectorized(llvm::Function* driverF, int width)
+{
+	if (width <= 1)
+		return true;
+	// The lane loop is left if the vectorizer gives up, e.g. on the control flow it cannot if-convert.
+	SmallVector<std::pair<const BasicBlock*, const BasicBlock*>, 4> backEdges;
+	llvm::FindFunctionBackedges(*driverF, backEdges);
+	if (!backEdges.empty())
+		return false;
+
+	bool hasVectorCode = false;
+	for (llvm::Function::iterator BB = driverF->begin(); BB != driverF->end(); ++BB) {
+		for (llvm::BasicBlock::iterator I = BB->begin(); I != BB->end(); ++I) {
+			// A call to anything but an intrinsic runs once per lane.
+			if (llvm::CallInst* pCall = llvm::dyn_cast<llvm::CallInst>(I)) {
+				llvm::Function* callee = pCall->getCalledFunction();
+				if (!callee || !callee->isIntrinsic())
+					return false;
+			}
+			if (I->getType()->isVectorTy())
+				hasVectorCode = true;
+		}
+	}
+	return hasVectorCode;
+}
+
+llvm::Function* CG_Context::CreateArrayDriver(llvm::Function* F, const std::vector<int>& argStrides, int retStride, 
+	int dispatchIdArg, bool isRangeDriver, const std::string& driverName)
+{
+	// The driver runs the function over "count" elements in a loop. The element of each argument(and the 
+	// return value) is located by the base pointer plus the index times its byte stride, zero stride means 
+	// every invocation shares the same element. "F" takes the arguments in packed layout, which is the same as
+	// the hosting C++ code. The structure with the stride "KSC_SOA_STRIDE" is gathered from the SoA streams instead.
+	llvm::Module* M = F->getParent();
+	llvm::LLVMContext& ctx = M->getContext();
+	llvm::Type* bytePtrType = Type::getInt8PtrTy(ctx);
+	llvm::Type* intPtrType = TheDataLayout()->getIntPtrType(ctx);
+
+	std::vector<llvm::Type*> soaTypes;
+	for (Function::arg_iterator AI = F->arg_begin(); AI != F->arg_end(); ++AI) {
+		llvm::Type* argType = AI->getType();
+		llvm::Type* elemType = argType->isPointerTy() ? argType->getPointerElementType() : argType;
+		soaTypes.push_back(argStrides[soaTypes.size()] == KSC_SOA_STRIDE ? elemType : NULL);
+	}
+	soaTypes.push_back(retStride == KSC_SOA_STRIDE ? F->getReturnType() : NULL);
+	for (size_t i = 0; i < soaTypes.size(); ++i) {
+		if (soaTypes[i] && !soaTypes[i]->isStructTy())
+			return NULL;
+	}
+
+	std::vector<llvm::Type*> driverArgTypes;
+	driverArgTypes.push_back(bytePtrType->getPointerTo());
+	driverArgTypes.push_back(SC_INT_TYPE);
+	if (isRangeDriver)
+		driverArgTypes.push_back(SC_INT_TYPE);
+	FunctionType* FT = FunctionType::get(Type::getVoidTy(ctx), driverArgTypes, false);
+	Function* driverF = Function::Create(FT, GlobalValue::ExternalLinkage, driverName, M);
+	Function::arg_iterator driverAI = driverF->arg_begin();
+	llvm::Value* basesArg = driverAI++;
+	// The array driver runs [0, count) while the range driver runs [begin, end)
+	llvm::Value* beginArg = isRangeDriver ? (llvm::Value*)(driverAI++) : ConstantInt::get(SC_INT_TYPE, 0);
+	llvm::Value* countArg = driverAI;
+
+	llvm::BasicBlock* entryBB = llvm::BasicBlock::Create(ctx, "entry", driverF);
+	llvm::BasicBlock* loopBB = llvm::BasicBlock::Create(ctx, "element_loop", driverF);
+	llvm::BasicBlock* exitBB = llvm::BasicBlock::Create(ctx, "exit", driverF);
+
+	llvm::IRBuilder<> builder(entryBB);
+	int baseCnt = (int)F->arg_size() + (F->getReturnType()->isVoidTy() ? 0 : 1);
+	std::vector<llvm::Value*> bases;
+	for (int i = 0; i < baseCnt; ++i)
+		bases.push_back(builder.CreateLoad(builder.CreateGEP(basesArg, ConstantInt::get(SC_INT_TYPE, i))));
+	// The SoA structures are gathered into a temporary in the packed layout for each element
+	std::vector<std::vector<LayoutLeaf> > soaLeaves(soaTypes.size());
+	std::vector<std::vector<llvm::Value*> > soaStreams(soaTypes.size());
+	std::vector<llvm::Value*> soaTemps(soaTypes.size(), (llvm::Value*)NULL);
+	for (int i = 0; i < baseCnt; ++i) {
+		if (!soaTypes[i])
+			continue;
+		std::vector<unsigned> path;
+		CollectLayoutLeaves(soaTypes[i], path, soaLeaves[i]);
+		LoadSoAStreams(builder, bases[i], soaLeaves[i], soaStreams[i]);
+		soaTemps[i] = builder.CreateAlloca(soaTypes[i]);
+	}
+	builder.CreateCondBr(builder.CreateICmpSLT(beginArg, countArg), loopBB, exitBB);
+
+	builder.SetInsertPoint(loopBB);
+	llvm::PHINode* elemIdx = builder.CreatePHI(SC_INT_TYPE, 2, "element");
+	elemIdx->addIncoming(beginArg, entryBB);
+	llvm::Value* wideIdx = builder.CreateSExt(elemIdx, intPtrType);
+
+	std::vector<llvm::Value*> args;
+	llvm::Value* zeroIdx = ConstantInt::get(intPtrType, 0);
+	int Idx = 0;
+	for (Function::arg_iterator AI = F->arg_begin(); AI != F->arg_end(); ++AI, ++Idx) {
+		if (Idx == dispatchIdArg) {
+			args.push_back(elemIdx);
+			continue;
+		}
+		llvm::Value* elemPtr = bases[Idx];
+		if (soaTypes[Idx]) {
+			for (size_t li = 0; li < soaLeaves[Idx].size(); ++li) {
+				llvm::Value* value = LoadLayoutLeaf(builder, kLayoutSoA, soaLeaves[Idx][li], soaStreams[Idx][li], wideIdx);
+				StoreLayoutLeaf(builder, kLayoutPacked, soaLeaves[Idx][li], soaTemps[Idx], zeroIdx, value);
+			}
+			elemPtr = soaTemps[Idx];
+		}
+		else if (argStrides[Idx] != 0)
+			elemPtr = builder.CreateGEP(elemPtr, builder.CreateMul(wideIdx, ConstantInt::get(intPtrType, argStrides[Idx])));
+		llvm::Type* argType = AI->getType();
+		if (argType->isPointerTy())
+			args.push_back(builder.CreateBitCast(elemPtr, argType));
+		else
+			args.push_back(builder.CreateLoad(builder.CreateBitCast(elemPtr, argType->getPointerTo())));
+	}
+
+	llvm::Value* retValue = builder.CreateCall(F, args);
+	// Scatter the structures passed by reference back to the SoA streams
+	for (int i = 0; i < (int)F->arg_size(); ++i) {
+		if (!soaTypes[i] || !args[i]->getType()->isPointerTy())
+			continue;
+		for (size_t li = 0; li < soaLeaves[i].size(); ++li) {
+			llvm::Value* value = LoadLayoutLeaf(builder, kLayoutPacked, soaLeaves[i][li], soaTemps[i], zeroIdx);
+			StoreLayoutLeaf(builder, kLayoutSoA, soaLeaves[i][li], soaStreams[i][li], wideIdx, value);
+		}
+	}
+	if (!F->getReturnType()->isVoidTy()) {
+		int retIdx = (int)soaTypes.size() - 1;
+		if (soaTypes[retIdx]) {
+			builder.CreateStore(retValue, soaTemps[retIdx]);
+			for (size_t li = 0; li < soaLeaves[retIdx].size(); ++li) {
+				llvm::Value* value = LoadLayoutLeaf(builder, kLayoutPacked, soaLeaves[retIdx][li], soaTemps[retIdx], zeroIdx);
+				StoreLayoutLeaf(builder, kLayoutSoA, soaLeaves[retIdx][li], soaStreams[retIdx][li], wideIdx, value);
+			}
+		}
+		else {
+			llvm::Value* retPtr = builder.CreateGEP(bases[Idx], builder.CreateMul(wideIdx, ConstantInt::get(intPtrType, retStride)));
+			builder.CreateStore(retValue, builder.CreateBitCast(retPtr, F->getReturnType()->getPointerTo()));
+		}
+	}
+
+	llvm::Value* nextIdx = builder.CreateAdd(elemIdx, ConstantInt::get(SC_INT_TYPE, 1));
+	elemIdx->addIncoming(nextIdx, loopBB);
+	llvm::BranchInst* loopLatch = builder.CreateCondBr(builder.CreateICmpSLT(nextIdx, countArg), loopBB, exitBB);
+	AddLoopVectorizeHint(loopLatch, 0);
+
+	builder.SetInsertPoint(exitBB);
+	builder.CreateRetVoid();
+	return driverF;
+}
+
+void CG_Context::GetSoAStreamSizes(llvm::Type* structType, std::vector<int>& outSizes)
+{
+	std::vector<LayoutLeaf> leaves;
+	std::vector<unsigned> path;
+	CollectLayoutLeaves(structType, path, leaves);
+	for (size_t i = 0; i < leaves.size(); ++i)
+		outSizes.push_back((int)TheDataLayout()->getTypeAllocSize(leaves[i].storageType));
+}
+
+llvm::Function* CG_Context::CreateLayoutConverter(llvm::Module* M, const KSC_TypeInfo& typeInfo, MemLayout srcLayout, MemLayout destLayout, const std::string& name)
+{
+	// The converter copies the structure array component by component, the loop is left to the vectorizer.
+	// The leaves come from the layout type, so the boolean vector lanes are converted between the masks of 
+	// the KSC layout and the 0 or 1 of the other layouts.
+	llvm::LLVMContext& ctx = M->getContext();
+	llvm::Type* bytePtrType = Type::getInt8PtrTy(ctx);
+	llvm::Type* intPtrType = TheDataLayout()->getIntPtrType(ctx);
+	llvm::Type* structType = ConvertToLLVMType(typeInfo);
+	llvm::Type* packedType = ConvertToPackedType(structType);
+	std::vector<LayoutLeaf> leaves;
+	std::vector<unsigned> path;
+	CollectLayoutLeaves(ConvertToLayoutType(typeInfo), path, leaves);
+
+	llvm::Type* converterArgTypes[] = { bytePtrType, bytePtrType, SC_INT_TYPE };
+	FunctionType* FT = FunctionType::get(Type::getVoidTy(ctx), converterArgTypes, false);
+	Function* converterF = Function::Create(FT, GlobalValue::ExternalLinkage, name, M);
+	Function::arg_iterator AI = converterF->arg_begin();
+	llvm::Value* srcArg = AI++;
+	llvm::Value* destArg = AI++;
+	llvm::Value* countArg = AI;
+
+	llvm::BasicBlock* entryBB = llvm::BasicBlock::Create(ctx, "entry", converterF);
+	llvm::BasicBlock* loopBB = llvm::BasicBlock::Create(ctx, "element_loop", converterF);
+	llvm::BasicBlock* exitBB = llvm::BasicBlock::Create(ctx, "exit", converterF);
+
+	llvm::IRBuilder<> builder(entryBB);
+	MemLayout layouts[2] = { srcLayout, destLayout };
+	llvm::Value* args[2] = { srcArg, destArg };
+	std::vector<llvm::Value*> bases[2];
+	for (int i = 0; i < 2; ++i) {
+		if (layouts[i] == kLayoutSoA)
+			LoadSoAStreams(builder, args[i], leaves, bases[i]);
+		else {
+			llvm::Type* elemType = layouts[i] == kLayoutKSC ? structType : packedType;
+			bases[i].assign(leaves.size(), builder.CreateBitCast(args[i], elemType->getPointerTo()));
+		}
+	}
+	builder.CreateCondBr(builder.CreateICmpSGT(countArg, ConstantInt::get(SC_INT_TYPE, 0)), loopBB, exitBB);
+
+	builder.SetInsertPoint(loopBB);
+	llvm::PHINode* elemIdx = builder.CreatePHI(SC_INT_TYPE, 2, "element");
+	elemIdx->addIncoming(ConstantInt::get(SC_INT_TYPE, 0), entryBB);
+	llvm::Value* wideIdx = builder.CreateSExt(elemIdx, intPtrType);
+	for (size_t i = 0; i < leaves.size(); ++i) {
+		llvm::Value* value = LoadLayoutLeaf(builder, srcLayout, leaves[i], bases[0][i], wideIdx);
+		StoreLayoutLeaf(builder, destLayout, leaves[i], bases[1][i], wideIdx, value);
+	}
+
+	llvm::Value* nextIdx = builder.CreateAdd(elemIdx, ConstantInt::get(SC_INT_TYPE, 1));
+	elemIdx->addIncoming(nextIdx, loopBB);
+	llvm::BranchInst* loopLatch = builder.CreateCondBr(builder.CreateICmpSLT(nextIdx, countArg), loopBB, exitBB);
+	AddLoopVectorizeHint(loopLatch, 0);
+
+	builder.SetInsertPoint(exitBB);
+	builder.CreateRetVoid();
+	return converterF;
+}
+
+std::string CG_Context::MakeSymbolName(const std::string& funcName)
 {
-	CG_Context::TheExecutionEngine->removeModule(CG_Context::TheModule);
-	delete CG_Context::TheModule;
-	delete CG_Context::TheFPM;
-	delete CG_Context::TheExecutionEngine;
+	// Every module is added to the same execution engine, so the symbols defined by the module are
+	// decorated with the module name to keep them from clashing with the ones of other modules.
+	return funcName + "." + TheModule()->getModuleIdentifier();
 }
 
 
@@ -132,34 +1364,79 @@ llvm::Type* CG_Context::ConvertToLLVMType(VarType tp)
 	case VarType::kBoolean:
 		return SC_BOOL_TYPE;
 	case VarType::kBoolean2:
-		return VectorType::get(SC_BOOL_TYPE, 2);
+		return VectorType::get(SC_MASK_LANE_TYPE, 2);
 	case VarType::kBoolean3:
-		return VectorType::get(SC_BOOL_TYPE, 3);
+		return VectorType::get(SC_MASK_LANE_TYPE, 3);
 	case VarType::kBoolean4:
-		return VectorType::get(SC_BOOL_TYPE, 4);
+		return VectorType::get(SC_MASK_LANE_TYPE, 4);
 	case VarType::kBoolean8:
-		return VectorType::get(SC_BOOL_TYPE, 8);
+		return VectorType::get(SC_MASK_LANE_TYPE, 8);
 	case VarType::kExternType:
-		return llvm::PointerType::get(Type::getInt8Ty(getGlobalContext()), 0);
+		return llvm::PointerType::get(Type::getInt8Ty(CG_Context::TheLLVMContext()), 0);
 	case VarType::kVoid:
-		return Type::getVoidTy(getGlobalContext());
+		return Type::getVoidTy(CG_Context::TheLLVMContext());
 	}
 
 	return NULL;
 }
 
+static llvm::Type* ConvertTypeInfo(const KSC_TypeInfo& typeInfo, bool boolLanes)
+{
+	llvm::Type* ret = NULL;
+	if (typeInfo.hStruct) {
+		const KSC_StructDesc* pStructDesc = (const KSC_StructDesc*)typeInfo.hStruct;
+		std::vector<llvm::Type*> elemTypes;
+		for (size_t i = 0; i < pStructDesc->size(); ++i)
+			elemTypes.push_back(ConvertTypeInfo((*pStructDesc)[i], boolLanes));
+		// The literal structure has the same layout as the named one created for the KSCL structure
+		ret = StructType::get(CG_Context::TheLLVMContext(), elemTypes);
+	}
+	else if (boolLanes && IsBooleanType(typeInfo.type) && TypeElementCnt(typeInfo.type) > 1)
+		ret = VectorType::get(SC_BOOL_TYPE, TypeElementCnt(typeInfo.type));
+	else
+		ret = CG_Context::ConvertToLLVMType(typeInfo.type);
+
+	if (ret && typeInfo.arraySize > 0)
+		ret = ArrayType::get(ret, typeInfo.arraySize);
+	return ret;
+}
+
+llvm::Type* CG_Context::ConvertToLLVMType(const KSC_TypeInfo& typeInfo)
+{
+	return ConvertTypeInfo(typeInfo, false);
+}
+
+llvm::Type* CG_Context::ConvertToLayoutType(const KSC_TypeInfo& typeInfo)
+{
+	return ConvertTypeInfo(typeInfo, true);
+}
+
 int CG_Context::GetSizeOfLLVMType(VarType tp)
 {
 	llvm::Type* type = ConvertToLLVMType(tp);
 	assert(type);
-	return (int)TheDataLayout->getTypeAllocSize(type);
+	return (int)TheDataLayout()->getTypeAllocSize(type);
 }
 
 int CG_Context::GetAlignmentOfLLVMType(VarType tp)
 {
 	llvm::Type* type = ConvertToLLVMType(tp);
 	assert(type);
-	return (int)TheDataLayout->getABITypeAlignment(type);
+	return (int)TheDataLayout()->getABITypeAlignment(type);
+}
+
+llvm::Value* CG_Context::ConvertBoolToMask(llvm::Value* boolValue)
+{
+	llvm::Type* maskType = SC_MASK_LANE_TYPE;
+	if (boolValue->getType()->isVectorTy())
+		maskType = VectorType::get(maskType, boolValue->getType()->getVectorNumElements());
+	return Builder().CreateSExt(boolValue, maskType);
+}
+
+llvm::Value* CG_Context::ConvertMaskToBool(llvm::Value* maskValue)
+{
+	// Testing the sign bit lets the backend feed the mask to blendv/movmsk directly.
+	return Builder().CreateICmpSLT(maskValue, llvm::Constant::getNullValue(maskValue->getType()));
 }
 
 llvm::Type* CG_Context::ConvertToPackedType(llvm::Type* srcType)
@@ -175,8 +1452,6 @@ llvm::Type* CG_Context::ConvertToPackedType(llvm::Type* srcType)
 		llvm::VectorType* vType = dyn_cast<llvm::VectorType>(srcActualType);
 		llvm::Type* elemType = vType->getElementType();
 		unsigned int elemCnt = vType->getNumElements();
-		if (elemType == SC_BOOL_TYPE) 
-			elemType = SC_INT_TYPE;
 		destType = llvm::ArrayType::get(elemType, elemCnt);
 	}
 	else if (srcActualType->isStructTy()) {
@@ -185,7 +1460,7 @@ llvm::Type* CG_Context::ConvertToPackedType(llvm::Type* srcType)
 		for (unsigned int i = 0; i < structType->getNumElements(); ++i) {
 			newTypes.push_back(ConvertToPackedType(structType->getElementType(i)));
 		}
-		destType = llvm::StructType::create(getGlobalContext(), newTypes);
+		destType = llvm::StructType::get(CG_Context::TheLLVMContext(), newTypes);
 	}
 	else if (srcActualType->isArrayTy()) {
 		llvm::ArrayType* arrayType = dyn_cast<llvm::ArrayType>(srcActualType);
@@ -206,170 +1481,153 @@ llvm::Type* CG_Context::ConvertToPackedType(llvm::Type* srcType)
 		return destType;
 }
 
-void CG_Context::ConvertValueToPacked(llvm::Value* srcValue, llvm::Value* destPtr)
+// The packed vector is an array of scalars, it is moved with a single unaligned vector load or store.
+static llvm::Value* LoadPackedVector(llvm::Value* srcPtr, llvm::VectorType* vType)
 {
-	llvm::Type* srcType = NULL;
-	llvm::Value* srcActualValue = NULL;
-	if (srcValue->getType()->isPointerTy()) {
-		llvm::PointerType* srcPtrType = dyn_cast<llvm::PointerType>(srcValue->getType());
-		srcType = srcPtrType->getElementType();
-		srcActualValue = sBuilder.CreateLoad(srcValue);
-	}
-	else {
-		srcType = srcValue->getType();
-		srcActualValue = srcValue;
-	}
-
-	llvm::Value* destValuePtr = destPtr;
-
-	if (srcType->isVectorTy()) {
+	llvm::Value* vecPtr = CG_Context::Builder().CreateBitCast(srcPtr, vType->getPointerTo());
+	// The load of the 3-element vector reads 12 bytes only, so the packed float3 is never over-read.
+	unsigned alignment = CG_Context::TheDataLayout()->getABITypeAlignment(vType->getElementType());
+	return CG_Context::Builder().CreateAlignedLoad(vecPtr, alignment);
+}
 
-		llvm::VectorType* vType = dyn_cast<llvm::VectorType>(srcType);
-		for (unsigned int i = 0; i < vType->getNumElements(); ++i) {
-			llvm::Value* idx = Constant::getIntegerValue(SC_INT_TYPE, APInt(sizeof(Int)*8, (uint64_t)i));
-			llvm::Value* elemValue = sBuilder.CreateExtractElement(srcActualValue, idx);
-			if (vType->getElementType() == SC_BOOL_TYPE) {
-				elemValue = CG_Context::sBuilder.CreateSelect(elemValue, 
-					Constant::getIntegerValue(SC_INT_TYPE, APInt(1, (uint64_t)1, true)),
-					Constant::getIntegerValue(SC_INT_TYPE, APInt(1, (uint64_t)0, true)));
-			}
-			std::vector<llvm::Value*> indices(2);
-			indices[1] = idx;
-			indices[0] = Constant::getIntegerValue(SC_INT_TYPE, APInt(sizeof(Int)*8, (uint64_t)0));
-			llvm::Value* elemPtr = sBuilder.CreateGEP(destValuePtr, indices);
-			sBuilder.CreateStore(elemValue, elemPtr);
-		}
-		
-	}
-	else if (srcType->isArrayTy() || srcType->isStructTy()) {
+static void StorePackedVector(llvm::Value* value, llvm::Value* destPtr)
+{
+	llvm::VectorType* vType = dyn_cast<llvm::VectorType>(value->getType());
+	llvm::Value* vecPtr = CG_Context::Builder().CreateBitCast(destPtr, vType->getPointerTo());
+	unsigned alignment = CG_Context::TheDataLayout()->getABITypeAlignment(vType->getElementType());
+	CG_Context::Builder().CreateAlignedStore(value, vecPtr, alignment);
+}
 
-		unsigned int idxCnt = 0;
-		if (srcType->isStructTy()) {
-			llvm::StructType* pStructType = dyn_cast<llvm::StructType>(srcType);
-			if (pStructType)
-				idxCnt = pStructType->getNumElements();
-		}
-		else {
-			llvm::ArrayType* pArrayType = dyn_cast<llvm::ArrayType>(srcType);
-			if (pArrayType)
-				idxCnt = (int)pArrayType->getNumElements();
-		}
+// Whether the layout type(see "ConvertToLayoutType") is a boolean vector, whose lanes are the masks in the KSC 
+// layout but 0 or 1 in the packed layout.
+static bool IsBoolVectorLayout(llvm::Type* layoutType)
+{
+	return layoutType->isVectorTy() && layoutType->getVectorElementType()->isIntegerTy(1);
+}
 
-		for (unsigned int Idx = 0; Idx < idxCnt; ++Idx) {
+// The whole vector is converted at once, "icmp ne 0" takes any non-zero element written by the hosting code as true.
+static llvm::Value* ConvertBoolVectorFromPacked(llvm::Value* value)
+{
+	return CG_Context::ConvertBoolToMask(CG_Context::Builder().CreateICmpNE(value, llvm::Constant::getNullValue(value->getType())));
+}
 
-			llvm::Value* destIdx = Constant::getIntegerValue(SC_INT_TYPE, APInt(sizeof(Int)*8, (uint64_t)Idx));
-			std::vector<llvm::Value*> indices(2);
-			indices[1] = destIdx;
-			indices[0] = Constant::getIntegerValue(SC_INT_TYPE, APInt(sizeof(Int)*8, (uint64_t)0));
-			llvm::Value* destElemPtr = sBuilder.CreateGEP(destValuePtr, indices);
+static llvm::Value* ConvertBoolVectorToPacked(llvm::Value* value)
+{
+	return CG_Context::Builder().CreateAnd(value, llvm::ConstantInt::get(value->getType(), 1));
+}
 
-			std::vector<unsigned int> srcIdx(1);
-			srcIdx[0] = Idx;
-			llvm::Value* srcElemValue = sBuilder.CreateExtractValue(srcActualValue, srcIdx);
+static unsigned GetAggregateElementCount(llvm::Type* tp)
+{
+	if (tp->isStructTy())
+		return tp->getStructNumElements();
+	else if (tp->isArrayTy())
+		return (unsigned)tp->getArrayNumElements();
+	else
+		return 0;
+}
 
-			ConvertValueToPacked(srcElemValue, destElemPtr);
+static llvm::Type* GetAggregateElementType(llvm::Type* tp, unsigned idx)
+{
+	return tp->isStructTy() ? tp->getStructElementType(idx) : tp->getArrayElementType();
+}
 
-			++Idx;
+void CG_Context::ConvertValueToPacked(llvm::Value* srcValue, llvm::Value* destPtr, llvm::Type* layoutType)
+{
+	if (srcValue->getType()->isPointerTy()) {
+		// Convert the value in memory member by member, so the aggregate is never loaded as a whole.
+		llvm::Type* srcType = srcValue->getType()->getPointerElementType();
+		if (srcType->isStructTy() || srcType->isArrayTy()) {
+			unsigned idxCnt = GetAggregateElementCount(srcType);
+			for (unsigned Idx = 0; Idx < idxCnt; ++Idx) {
+				llvm::Value* srcElemPtr = Builder().CreateConstGEP2_32(srcValue, 0, Idx);
+				llvm::Value* destElemPtr = Builder().CreateConstGEP2_32(destPtr, 0, Idx);
+				ConvertValueToPacked(srcElemPtr, destElemPtr, GetAggregateElementType(layoutType, Idx));
+			}
 		}
+		else
+			ConvertValueToPacked(Builder().CreateLoad(srcValue), destPtr, layoutType);
+		return;
+	}
 
+	llvm::Type* srcType = srcValue->getType();
+	if (srcType->isVectorTy()) {
+		if (IsBoolVectorLayout(layoutType))
+			srcValue = ConvertBoolVectorToPacked(srcValue);
+		StorePackedVector(srcValue, destPtr);
 	}
-	else {
-		if (srcType == SC_BOOL_TYPE) {
-			srcActualValue = CG_Context::sBuilder.CreateSelect(srcActualValue, 
-				Constant::getIntegerValue(SC_INT_TYPE, APInt(1, (uint64_t)1, true)),
-				Constant::getIntegerValue(SC_INT_TYPE, APInt(1, (uint64_t)0, true)));
+	else if (srcType->isArrayTy() || srcType->isStructTy()) {
+		unsigned idxCnt = GetAggregateElementCount(srcType);
+		for (unsigned Idx = 0; Idx < idxCnt; ++Idx) {
+			llvm::Value* destElemPtr = Builder().CreateConstGEP2_32(destPtr, 0, Idx);
+			ConvertValueToPacked(Builder().CreateExtractValue(srcValue, Idx), destElemPtr, GetAggregateElementType(layoutType, Idx));
 		}
-		sBuilder.CreateStore(srcActualValue, destValuePtr);
+	}
+	else {
+		if (srcType == SC_BOOL_TYPE)
+			srcValue = Builder().CreateZExt(srcValue, SC_INT_TYPE);
+		Builder().CreateStore(srcValue, destPtr);
 	}
 }
 
-llvm::Value* CG_Context::ConvertValueFromPacked(llvm::Value* srcValue, llvm::Type* destType)
+// Load the packed value in memory into the value of "destType" in KSC layout.
+static void LoadFromPacked(llvm::Value* srcPtr, llvm::Value* destPtr, llvm::Type* destType, llvm::Type* layoutType)
 {
-	llvm::Type* srcType = NULL;
-	llvm::Value* srcActualValue = NULL;
-	if (srcValue->getType()->isPointerTy()) {
-		llvm::PointerType* srcPtrType = dyn_cast<llvm::PointerType>(srcValue->getType());
-		srcType = srcPtrType->getElementType();
-		srcActualValue = sBuilder.CreateLoad(srcValue);
+	if (destType->isVectorTy()) {
+		llvm::Value* value = LoadPackedVector(srcPtr, dyn_cast<llvm::VectorType>(destType));
+		if (IsBoolVectorLayout(layoutType))
+			value = ConvertBoolVectorFromPacked(value);
+		CG_Context::Builder().CreateStore(value, destPtr);
+	}
+	else if (destType->isStructTy() || destType->isArrayTy()) {
+		unsigned idxCnt = GetAggregateElementCount(destType);
+		for (unsigned Idx = 0; Idx < idxCnt; ++Idx) {
+			llvm::Value* srcElemPtr = CG_Context::Builder().CreateConstGEP2_32(srcPtr, 0, Idx);
+			llvm::Value* destElemPtr = CG_Context::Builder().CreateConstGEP2_32(destPtr, 0, Idx);
+			LoadFromPacked(srcElemPtr, destElemPtr, destElemPtr->getType()->getPointerElementType(), GetAggregateElementType(layoutType, Idx));
+		}
 	}
 	else {
-		srcType = srcValue->getType();
-		srcActualValue = srcValue;
+		llvm::Value* value = CG_Context::Builder().CreateLoad(srcPtr);
+		if (destType == SC_BOOL_TYPE)
+			value = CG_Context::Builder().CreateICmpNE(value, ConstantInt::get(SC_INT_TYPE, 0));
+		CG_Context::Builder().CreateStore(value, destPtr);
 	}
+}
 
-	llvm::Type* destActualType = destType;
-	if (destType->isPointerTy()) {
-		llvm::PointerType* destPtrType = dyn_cast<llvm::PointerType>(destType);
-		destActualType = destPtrType->getElementType();
+llvm::Value* CG_Context::ConvertValueFromPacked(llvm::Value* srcValue, llvm::Type* destType, llvm::Type* layoutType)
+{
+	if (srcValue->getType()->isPointerTy()) {
+		llvm::Type* destActualType = destType->isPointerTy() ? destType->getPointerElementType() : destType;
+		llvm::Value* destValuePtr = Builder().CreateAlloca(destActualType);
+		LoadFromPacked(srcValue, destValuePtr, destActualType, layoutType);
+		return destValuePtr;
 	}
-	llvm::Value* destValuePtr = sBuilder.CreateAlloca(destActualType);
 
-	if (destActualType->isVectorTy()) {
-
-		llvm::Value* newVecValue = llvm::UndefValue::get(destActualType);
-		llvm::VectorType* vType = dyn_cast<llvm::VectorType>(destActualType);
-		llvm::Type* elemType = vType->getElementType();
-		assert(vType);
+	// The packed value is in registers, so it is converted without going through memory.
+	llvm::Type* srcType = srcValue->getType();
+	if (destType->isVectorTy()) {
 		assert(srcType->isArrayTy());
-		for (unsigned int i = 0; i < vType->getNumElements(); ++i) {
-			llvm::Value* idx = Constant::getIntegerValue(SC_INT_TYPE, APInt(sizeof(Int)*8, (uint64_t)i));
-			std::vector<llvm::Value*> indices(2);
-			indices[1] = idx;
-			indices[0] = Constant::getIntegerValue(SC_INT_TYPE, APInt(sizeof(Int)*8, (uint64_t)0));
-
-			std::vector<unsigned int> srcIdx(1);
-			srcIdx[0] = i;
-			llvm::Value* elemValue = sBuilder.CreateExtractValue(srcActualValue, srcIdx);
-			if (elemType == SC_BOOL_TYPE) {
-				elemValue = sBuilder.CreateICmpNE(elemValue, Constant::getIntegerValue(SC_INT_TYPE, APInt(sizeof(Int)*8, (uint64_t)0, true)));
-			}
-			newVecValue = sBuilder.CreateInsertElement(newVecValue, elemValue, idx);
-			
-		}
-		sBuilder.CreateStore(newVecValue, destValuePtr);
+		llvm::VectorType* vType = dyn_cast<llvm::VectorType>(destType);
+		llvm::Value* newVecValue = llvm::UndefValue::get(vType);
+		for (unsigned int i = 0; i < vType->getNumElements(); ++i)
+			newVecValue = Builder().CreateInsertElement(newVecValue, Builder().CreateExtractValue(srcValue, i), Builder().getInt32(i));
+		return IsBoolVectorLayout(layoutType) ? ConvertBoolVectorFromPacked(newVecValue) : newVecValue;
 	}
-	else if (destActualType->isStructTy() || destActualType->isArrayTy()) {
-
-		unsigned int idxCnt = 0;
-		if (destActualType->isStructTy()) {
-			llvm::StructType* pStructType = dyn_cast<llvm::StructType>(destActualType);
-			if (pStructType)
-				idxCnt = pStructType->getNumElements();
-		}
-		else {
-			llvm::ArrayType* pArrayType = dyn_cast<llvm::ArrayType>(destActualType);
-			if (pArrayType)
-				idxCnt = (int)pArrayType->getNumElements();
-		}
-		for (unsigned int Idx = 0; Idx < idxCnt; ++Idx) {
-
-			llvm::Value* destIdx = Constant::getIntegerValue(SC_INT_TYPE, APInt(sizeof(Int)*8, (uint64_t)Idx));
-			std::vector<llvm::Value*> indices(2);
-			indices[1] = destIdx;
-			indices[0] = Constant::getIntegerValue(SC_INT_TYPE, APInt(sizeof(Int)*8, (uint64_t)0));
-			llvm::Value* destElemPtr = sBuilder.CreateGEP(destValuePtr, indices);
-			llvm::PointerType* destElemPtrType = dyn_cast<llvm::PointerType>(destElemPtr->getType());
-
-			std::vector<unsigned int> srcIdx(1);
-			srcIdx[0] = Idx;
-			llvm::Value* srcElemValue = sBuilder.CreateExtractValue(srcActualValue, srcIdx);
-
-			llvm::Value* convertedSrcValue = ConvertValueFromPacked(srcElemValue, destElemPtrType->getElementType());
-			sBuilder.CreateStore(convertedSrcValue, destElemPtr);
+	else if (destType->isStructTy() || destType->isArrayTy()) {
+		llvm::Value* newValue = llvm::UndefValue::get(destType);
+		unsigned idxCnt = GetAggregateElementCount(destType);
+		for (unsigned Idx = 0; Idx < idxCnt; ++Idx) {
+			llvm::Value* elemValue = ConvertValueFromPacked(Builder().CreateExtractValue(srcValue, Idx), 
+				GetAggregateElementType(destType, Idx), GetAggregateElementType(layoutType, Idx));
+			newValue = Builder().CreateInsertValue(newValue, elemValue, Idx);
 		}
-
+		return newValue;
 	}
 	else {
-		if (srcType == SC_BOOL_TYPE) {
-			srcActualValue = sBuilder.CreateICmpNE(srcActualValue, Constant::getIntegerValue(SC_INT_TYPE, APInt(sizeof(Int)*8, (uint64_t)0, true)));
-		}
-		sBuilder.CreateStore(srcActualValue, destValuePtr);
+		if (destType == SC_BOOL_TYPE)
+			return Builder().CreateICmpNE(srcValue, ConstantInt::get(SC_INT_TYPE, 0));
+		return srcValue;
 	}
-
-	if (srcValue->getType()->isPointerTy())
-		return destValuePtr;
-	else
-		return sBuilder.CreateLoad(destValuePtr);
 }
 
 llvm::Function* CG_Context::CreateFunctionWithPackedArguments(const KSC_FunctionDesc& fDesc)
@@ -377,12 +1635,15 @@ llvm::Function* CG_Context::CreateFunctionWithPackedArguments(const KSC_Function
 	llvm::Function* wrapperF = NULL;
 	std::vector<llvm::Type*> wrapperF_argTypes;
 	std::vector<llvm::Type*> orgArgTypes;
+	std::vector<llvm::Type*> layoutTypes;
 	int Idx = 0;
 	bool hasJIRPacked = false;
 	for (Function::arg_iterator AI = fDesc.F->arg_begin(); AI != fDesc.F->arg_end(); ++AI, ++Idx) {
 		llvm::Type* argType = AI->getType();
 		orgArgTypes.push_back(argType);
-		if (fDesc.needJITPacked[Idx])
+		layoutTypes.push_back(ConvertToLayoutType(fDesc.mArgumentTypes[Idx]));
+		// The boolean vector passed by value is 0 or 1 from the hosting code as well
+		if (fDesc.needJITPacked[Idx] || (!argType->isPointerTy() && IsBoolVectorLayout(layoutTypes[Idx])))
 			hasJIRPacked = true;
 		wrapperF_argTypes.push_back(fDesc.needJITPacked[Idx] ? SC::CG_Context::ConvertToPackedType(argType) : argType);
 	}
@@ -394,21 +1655,26 @@ llvm::Function* CG_Context::CreateFunctionWithPackedArguments(const KSC_Function
 	}
 	
 	FunctionType *FT = FunctionType::get(wrappedRetType, wrapperF_argTypes, false);
-	wrapperF = Function::Create(FT, Function::ExternalLinkage, fDesc.F->getName() + "_packed", CG_Context::TheModule);
+	wrapperF = Function::Create(FT, Function::ExternalLinkage, fDesc.F->getName() + "_packed", fDesc.F->getParent());
 
-	BasicBlock *BB = BasicBlock::Create(getGlobalContext(), "entry_packed", wrapperF);
-	sBuilder.SetInsertPoint(BB);
+	BasicBlock *BB = BasicBlock::Create(CG_Context::TheLLVMContext(), "entry_packed", wrapperF);
+	Builder().SetInsertPoint(BB);
 
 	std::vector<llvm::Value*> args;
 	// Convert the packed arguments to non-packed ones
 	//
 	Idx = 0;
 	for (Function::arg_iterator AI = wrapperF->arg_begin(); AI != wrapperF->arg_end(); ++AI, ++Idx) {
-		args.push_back(fDesc.needJITPacked[Idx] ? ConvertValueFromPacked(AI, orgArgTypes[Idx]) : AI);
+		if (fDesc.needJITPacked[Idx])
+			args.push_back(ConvertValueFromPacked(AI, orgArgTypes[Idx], layoutTypes[Idx]));
+		else if (!orgArgTypes[Idx]->isPointerTy() && IsBoolVectorLayout(layoutTypes[Idx]))
+			args.push_back(ConvertBoolVectorFromPacked(AI));
+		else
+			args.push_back(AI);
 	}
 	// Invoke the target function
 	//
-	llvm::Value* retValue = sBuilder.CreateCall(fDesc.F, args);
+	llvm::Value* retValue = Builder().CreateCall(fDesc.F, args);
 	// Convert back the non-packed arguments to packed ones(if they're passed-by-reference)
 	//
 	Idx = 0;
@@ -416,18 +1682,18 @@ llvm::Function* CG_Context::CreateFunctionWithPackedArguments(const KSC_Function
 		if (wrapperAI->getType()->isPointerTy()) {
 			assert(args[Idx]->getType()->isPointerTy());
 			if (fDesc.needJITPacked[Idx])
-				ConvertValueToPacked(sBuilder.CreateLoad(args[Idx]), wrapperAI);
+				ConvertValueToPacked(args[Idx], wrapperAI, layoutTypes[Idx]);
 		}
 	}
 
 	if (!fDesc.F->getReturnType()->isVoidTy()) {
-		llvm::Value* retValuePtr = sBuilder.CreateAlloca(wrapperF->getReturnType());
-		ConvertValueToPacked(retValue, retValuePtr);
+		llvm::Value* retValuePtr = Builder().CreateAlloca(wrapperF->getReturnType());
+		ConvertValueToPacked(retValue, retValuePtr, ConvertToLayoutType(fDesc.mReturnType));
 	
-		sBuilder.CreateRet(sBuilder.CreateLoad(retValuePtr));
+		Builder().CreateRet(Builder().CreateLoad(retValuePtr));
 	}
 	else
-		sBuilder.CreateRetVoid();
+		Builder().CreateRetVoid();
 
 	return wrapperF;
 }
@@ -435,7 +1701,7 @@ llvm::Function* CG_Context::CreateFunctionWithPackedArguments(const KSC_Function
 llvm::Value* CG_Context::GetVariableValue(const std::string& name, bool includeParent)
 {
 	llvm::Value* ptr = GetVariablePtr(name, includeParent);
-	return ptr ? sBuilder.CreateLoad(ptr, name) : NULL;
+	return ptr ? Builder().CreateLoad(ptr, name) : NULL;
 }
 
 llvm::Value* CG_Context::GetVariablePtr(const std::string& name, bool includeParent)
@@ -516,7 +1782,7 @@ llvm::Type* CG_Context::NewStructType(const Exp_StructDef* pStructDef)
 	}
 	ArrayRef<Type*> typeArray(&elemTypes[0], elemCnt);
 
-	llvm::Type* ret = StructType::create(getGlobalContext(), typeArray, pStructDef->GetStructureName().c_str());
+	llvm::Type* ret = StructType::create(CG_Context::TheLLVMContext(), typeArray, pStructDef->GetStructureName().c_str());
 	mStructTypes[pStructDef] = ret;
 	return ret;
 }
@@ -529,17 +1795,32 @@ void CG_Context::AddFunctionDecl(const std::string& funcName, llvm::Function* pF
 
 llvm::Function* CG_Context::GetFuncDeclByName(const std::string& funcName)
 {
+	llvm::Function* pF = NULL;
 	if (mFuncDecls.find(funcName) != mFuncDecls.end())
-		return mFuncDecls[funcName];
+		pF = mFuncDecls[funcName];
 	else
-		return mpParent ? mpParent->GetFuncDeclByName(funcName) : NULL;
+		pF = mpParent ? mpParent->GetFuncDeclByName(funcName) : NULL;
+
+	if (pF && pF->getParent() != TheModule()) {
+		// The function lives in another module(e.g. the shared code), so only reference it by declaration
+		// and let the JIT linker resolve it.
+		llvm::Function* pDecl = TheModule()->getFunction(pF->getName());
+		if (!pDecl)
+			pDecl = Function::Create(pF->getFunctionType(), Function::ExternalLinkage, pF->getName(), TheModule());
+		return pDecl;
+	}
+	return pF;
 }
 
 bool RootDomain::CompileToIR(CG_Context* pPredefine, KSC_ModuleDesc& mouduleDesc, CG_Context* pUseCtx)
 {
+	assert(mouduleDesc.M);
+	CG_Context::TheModule() = mouduleDesc.M;
 	CG_Context* cgCtx = pUseCtx ?
 		pUseCtx :
 		pPredefine->CreateChildContext(pPredefine->GetCurrentFunc(), pPredefine->GetFuncRetBlk(), pPredefine->GetRetValuePtr());
+	// The float operations of the whole module get the fast-math flags unless a function or block says otherwise.
+	CG_Context::ApplyFPMode(mouduleDesc.mOptions.fastMath ? kFPModeFast : kFPModePrecise);
 
 	for (int i = 0; i < (int)mExpressions.size(); ++i) {
 		llvm::Value* value = mExpressions[i]->GenerateCode(cgCtx);
@@ -549,7 +1830,9 @@ bool RootDomain::CompileToIR(CG_Context* pPredefine, KSC_ModuleDesc& mouduleDesc
 			llvm::Function* funcValue = llvm::dyn_cast_or_null<llvm::Function>(value);
 			KSC_FunctionDesc* pFuncDesc = new KSC_FunctionDesc;
 			pFuncDesc->pJIT_Func = NULL;
+			pFuncDesc->pTierSlot = NULL;
 			pFuncDesc->F = funcValue;
+			pFuncDesc->pModule = &mouduleDesc;
 			for (int ai = 0; ai < pFuncDecl->GetArgumentCnt(); ++ai)
 				pFuncDesc->needJITPacked.push_back(pFuncDecl->GetArgumentDesc(ai)->needJITPacked ? 1 : 0);
 			pFuncDecl->ConvertToDescription(*pFuncDesc, *cgCtx);
@@ -564,6 +1847,7 @@ bool RootDomain::CompileToIR(CG_Context* pPredefine, KSC_ModuleDesc& mouduleDesc
 		}
 	}
 
+	CG_Context::Builder().clearFastMathFlags();
 	if (pUseCtx == NULL)
 		delete cgCtx;
 	return true;
@@ -584,9 +1868,9 @@ llvm::Value* CG_Context::CastValueType(llvm::Value* srcValue, VarType srcType, V
 		//
 		if (needTypeConvert) {
 			if (isF2I)
-				return sBuilder.CreateFPToSI(srcValue, SC_INT_TYPE);
+				return Builder().CreateFPToSI(srcValue, SC_INT_TYPE);
 			else
-				return sBuilder.CreateSIToFP(srcValue, SC_FLOAT_TYPE);
+				return Builder().CreateSIToFP(srcValue, SC_FLOAT_TYPE);
 		}
 		else
 			return srcValue;
@@ -599,11 +1883,11 @@ llvm::Value* CG_Context::CastValueType(llvm::Value* srcValue, VarType srcType, V
 		if (needTypeConvert) {
 			if (isF2I) {
 				llvm::Type* pDestType = ConvertToLLVMType(MakeType(destType, destElemCnt));
-				return sBuilder.CreateFPToSI(srcValue, pDestType);
+				return Builder().CreateFPToSI(srcValue, pDestType);
 			}
 			else {
 				llvm::Type* pDestType = ConvertToLLVMType(MakeType(destType, destElemCnt));
-				return sBuilder.CreateSIToFP(srcValue, pDestType);
+				return Builder().CreateSIToFP(srcValue, pDestType);
 			}
 		}
 		else {
@@ -618,14 +1902,14 @@ llvm::Value* CG_Context::CastValueType(llvm::Value* srcValue, VarType srcType, V
 		llvm::Type* pDestType = ConvertToLLVMType(MakeType(destType, destElemCnt));
 		llvm::SmallVector<Constant*, 4> Idxs;
 		for (int i = 0; i < destElemCnt; ++i) 
-			Idxs.push_back(sBuilder.getInt32(i));
-		llvm::Value* truncatedValue = sBuilder.CreateShuffleVector(srcValue, llvm::UndefValue::get(srcValue->getType()), llvm::ConstantVector::get(Idxs));
+			Idxs.push_back(Builder().getInt32(i));
+		llvm::Value* truncatedValue = Builder().CreateShuffleVector(srcValue, llvm::UndefValue::get(srcValue->getType()), llvm::ConstantVector::get(Idxs));
 		if (needTypeConvert) {
 			if (isF2I) {
-				return sBuilder.CreateFPToSI(truncatedValue, pDestType);
+				return Builder().CreateFPToSI(truncatedValue, pDestType);
 			}
 			else {
-				return sBuilder.CreateSIToFP(truncatedValue, pDestType);
+				return Builder().CreateSIToFP(truncatedValue, pDestType);
 			}
 		}
 		else
@@ -640,15 +1924,17 @@ llvm::Value* CG_Context::CastValueType(llvm::Value* srcValue, VarType srcType, V
 		llvm::Value* convertSrcValue = srcValue;
 		if (needTypeConvert) {
 			if (isF2I) {
-				convertSrcValue = sBuilder.CreateFPToSI(srcValue, SC_INT_TYPE);
+				convertSrcValue = Builder().CreateFPToSI(srcValue, SC_INT_TYPE);
 			}
 			else {
-				convertSrcValue = sBuilder.CreateSIToFP(srcValue, SC_FLOAT_TYPE);
+				convertSrcValue = Builder().CreateSIToFP(srcValue, SC_FLOAT_TYPE);
 			}
 		}
+		if (IsBooleanType(destType))
+			convertSrcValue = ConvertBoolToMask(convertSrcValue);
 		for (int i = 0; i < destElemCnt; ++i) {
 			llvm::Value* idx = Constant::getIntegerValue(SC_INT_TYPE, APInt(sizeof(Int)*8, (uint64_t)i));
-			destValue = sBuilder.CreateInsertElement(destValue, convertSrcValue, idx);
+			destValue = Builder().CreateInsertElement(destValue, convertSrcValue, idx);
 		}
 		return destValue;
 	}
@@ -658,58 +1944,68 @@ llvm::Value* CG_Context::CastValueType(llvm::Value* srcValue, VarType srcType, V
 
 llvm::Value* CG_Context::CreateBinaryExpression(const std::string& opStr, 
 		llvm::Value* pL, llvm::Value* pR, VarType Ltype, VarType Rtype)
+{
+	llvm::Value* ret = CreateBinaryInstruction(opStr, pL, pR, Ltype, Rtype);
+	// The vector comparisons produce the i1 vectors, widen them to the lane masks.
+	if (ret && ret->getType()->isVectorTy() && ret->getType()->getVectorElementType() == SC_BOOL_TYPE)
+		ret = ConvertBoolToMask(ret);
+	return ret;
+}
+
+llvm::Value* CG_Context::CreateBinaryInstruction(const std::string& opStr, 
+		llvm::Value* pL, llvm::Value* pR, VarType Ltype, VarType Rtype)
 {
 	llvm::Value* R_Value = CastValueType(pR, Rtype, Ltype);
 	assert(R_Value);
 	if (IsFloatType(Ltype)) {
 		// Generate instruction for float type
 		if (opStr == "+") 
-			return sBuilder.CreateFAdd(pL, R_Value);
+			return Builder().CreateFAdd(pL, R_Value);
 		else if (opStr == "-") 
-			return sBuilder.CreateFSub(pL, R_Value);
+			return Builder().CreateFSub(pL, R_Value);
 		else if (opStr == "*") 
-			return sBuilder.CreateFMul(pL, R_Value);
+			return Builder().CreateFMul(pL, R_Value);
 		else if (opStr == "/") 
-			return sBuilder.CreateFDiv(pL, R_Value);
+			return Builder().CreateFDiv(pL, R_Value);
 		else if (opStr == ">") 
-			return sBuilder.CreateFCmpOGT(pL, R_Value);
+			return Builder().CreateFCmpOGT(pL, R_Value);
 		else if (opStr == ">=") 
-			return sBuilder.CreateFCmpOGE(pL, R_Value);
+			return Builder().CreateFCmpOGE(pL, R_Value);
 		else if (opStr == "<") 
-			return sBuilder.CreateFCmpOLT(pL, R_Value);
+			return Builder().CreateFCmpOLT(pL, R_Value);
 		else if (opStr == "<=") 
-			return sBuilder.CreateFCmpOLE(pL, R_Value);
+			return Builder().CreateFCmpOLE(pL, R_Value);
 		else if (opStr == "==") 
-			return sBuilder.CreateFCmpOEQ(pL, R_Value);
+			return Builder().CreateFCmpOEQ(pL, R_Value);
 		else if (opStr == "!=") 
-			return sBuilder.CreateFCmpONE(pL, R_Value);
+			return Builder().CreateFCmpONE(pL, R_Value);
 	}
 	else {
 		// Generate instruction for integer type
 		if (opStr == "+") 
-			return sBuilder.CreateAdd(pL, R_Value);
+			return Builder().CreateAdd(pL, R_Value);
 		else if (opStr == "-") 
-			return sBuilder.CreateSub(pL, R_Value);
+			return Builder().CreateSub(pL, R_Value);
 		else if (opStr == "*") 
-			return sBuilder.CreateMul(pL, R_Value);
+			return Builder().CreateMul(pL, R_Value);
 		else if (opStr == "/") 
-			return sBuilder.CreateSDiv(pL, R_Value);
+			return Builder().CreateSDiv(pL, R_Value);
 		else if (opStr == ">") 
-			return sBuilder.CreateICmpSGT(pL, R_Value);
+			return Builder().CreateICmpSGT(pL, R_Value);
 		else if (opStr == ">=") 
-			return sBuilder.CreateICmpSGE(pL, R_Value);
+			return Builder().CreateICmpSGE(pL, R_Value);
 		else if (opStr == "<") 
-			return sBuilder.CreateICmpSLT(pL, R_Value);
+			return Builder().CreateICmpSLT(pL, R_Value);
 		else if (opStr == "<=") 
-			return sBuilder.CreateICmpSLE(pL, R_Value);
+			return Builder().CreateICmpSLE(pL, R_Value);
 		else if (opStr == "==") 
-			return sBuilder.CreateICmpEQ(pL, R_Value);
+			return Builder().CreateICmpEQ(pL, R_Value);
 		else if (opStr == "!=") 
-			return sBuilder.CreateICmpNE(pL, R_Value);
+			return Builder().CreateICmpNE(pL, R_Value);
 		else if (opStr == "||" || opStr == "|") 
-			return sBuilder.CreateOr(pL, R_Value); // boolean values are treated as i1 integer
+			return Builder().CreateOr(pL, R_Value); // boolean values are treated as i1 integer or lane masks
 		else if (opStr == "&&" || opStr == "&") 
-			return sBuilder.CreateAnd(pL, R_Value); // boolean values are treated as i1 integer
+			return Builder().CreateAnd(pL, R_Value); // boolean values are treated as i1 integer or lane masks
 
 	}
 	
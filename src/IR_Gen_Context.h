@@ -15,26 +15,91 @@
 #include <llvm/Analysis/Passes.h>
 #include <llvm/IR/DataLayout.h>
 #include <llvm/Transforms/Scalar.h>
+#include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/IPO/PassManagerBuilder.h>
+#include <llvm/Target/TargetMachine.h>
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/IR/Intrinsics.h>
 #pragma warning(pop)
 #include "global_symbols.h"
+#include "object_cache.h"
 
 using namespace llvm;
 
 #ifdef WANT_DOUBLE_FLOAT
-#define SC_FLOAT_TYPE Type::getDoubleTy(getGlobalContext())
+#define SC_FLOAT_TYPE Type::getDoubleTy(SC::CG_Context::TheLLVMContext())
 #else
-#define SC_FLOAT_TYPE Type::getFloatTy(getGlobalContext())
+#define SC_FLOAT_TYPE Type::getFloatTy(SC::CG_Context::TheLLVMContext())
 #endif
 
-#define SC_INT_TYPE Type::getInt32Ty(getGlobalContext())
-#define SC_BOOL_TYPE Type::getInt1Ty(getGlobalContext())
+#define SC_INT_TYPE Type::getInt32Ty(SC::CG_Context::TheLLVMContext())
+#define SC_BOOL_TYPE Type::getInt1Ty(SC::CG_Context::TheLLVMContext())
+// The lane of the boolean vector is a full-width mask(all bits set for true), the same width as the float 
+// and int lanes it is compared from, so the comparisons and selects map to the SIMD compare and blend instructions.
+#define SC_MASK_LANE_TYPE Type::getInt32Ty(SC::CG_Context::TheLLVMContext())
 
 namespace SC {
 
-bool InitializeCodeGen();
-void DestoryCodeGen();
+// The code generation objects of one KSC context. Each state has its own LLVM context and execution engine,
+// so the threads generating code with different states share nothing mutable.
+struct CodeGenState
+{
+	llvm::LLVMContext llvmContext;
+	llvm::IRBuilder<> builder;
+	// The module that receives the IR currently being generated, each compiled KSC module owns its own one.
+	llvm::Module* module;
+	llvm::ExecutionEngine* executionEngine;
+	const llvm::DataLayout* dataLayout;
+	GobalSymbolMemManager* symbolMemMgr;
+	llvm::TargetMachine* targetMachine;
+	// The shared code IR with all the definitions marked available_externally, NULL if no function is defined.
+	llvm::Module* sharedCodeIR;
+	// Whether the target machine supports AVX2, queried once when the state is created.
+	bool hasAVX2;
+
+	CodeGenState();
+};
+
+// Create the state along with its execution engine, the predefined(shared) code goes to its initial module.
+// NULL is returned if the JIT target cannot be created.
+CodeGenState* CreateCodeGenState(const std::hash_map<std::string, void*>& externalSymbols);
+void DestroyCodeGenState(CodeGenState* pState);
+// Bind the state to the calling thread for the lifetime of the scope, the code generation on this thread
+// works on the bound state. The scopes can be nested, the previous binding is restored on exit.
+class CodeGenScope
+{
+private:
+	CodeGenState* mpPrevState;
+public:
+	explicit CodeGenScope(CodeGenState* pState);
+	~CodeGenScope();
+};
+// Override the CPU and features that the JIT generates code for, it must be called before any state is created.
+bool SetCodeGenTarget(const char* cpuName, const char* features);
+// Return the SIMD width implied by the JIT target features, or zero if the host features cannot be detected.
+int GetCodeGenSIMDWidth();
+// Return the string that identifies the target triple, CPU and features the JIT generates code for.
+std::string GetCodeGenTargetDesc();
+// Create an empty module that is configured for the JIT target, the caller owns the returned module
+// until it is handed to the execution engine.
+llvm::Module* CreateCodeGenModule(const std::string& name);
+// Create the execution engine of a KSC module, which takes the ownership of "M". The module and its late modules 
+// are JIT-ed into the memory of this engine, so destroying it frees their code and data. The external functions
+// and the shared code are resolved through the engine of the bound state. NULL is returned on failure, "M" is
+// freed then.
+llvm::ExecutionEngine* CreateModuleEngine(llvm::Module* M);
+// Destroy the execution engine of the module along with the JIT-ed code and data, and free the IR of the module.
+void DestroyCodeGenModule(KSC_ModuleDesc& moduleDesc);
+// Keep a copy of the shared code IR, so that its function bodies can be imported into the user modules.
+void SetSharedCodeModule(const llvm::Module* sharedM);
+// Link the shared code functions into the module as available_externally definitions, which makes them
+// visible to the inliner of the module while the calls not inlined still go to the shared code.
+bool ImportSharedCode(llvm::Module* M);
+// Split the defined functions of the module into "partitionCnt" parts of about the same size, then optimize and
+// emit the parts on as many threads, each in its own LLVM context. "outObjs" receives the object code of the parts,
+// which reference each other by symbol names, so the local symbols of the module are made external. The calls
+// across the parts are not inlined.
+bool EmitModulePartitions(llvm::Module* M, int partitionCnt, OptLevel optLevel, std::vector<std::string>& outObjs);
 
 class CG_Context
 {
@@ -49,21 +114,50 @@ private:
 	std::hash_map<const Exp_StructDef*, llvm::Type*> mStructTypes;
 	
 public:
-	static llvm::Module *TheModule;
-	static llvm::ExecutionEngine* TheExecutionEngine;
-	static llvm::FunctionPassManager* TheFPM;
-	static const llvm::DataLayout* TheDataLayout;
-	static llvm::IRBuilder<> sBuilder;
-	static GobalSymbolMemManager* TheSymbolMemMgr;
+	// The objects of the code generation state bound to the calling thread, see "CodeGenScope".
+	static llvm::LLVMContext& TheLLVMContext();
+	static llvm::Module*& TheModule();
+	static llvm::ExecutionEngine* TheExecutionEngine();
+	static const llvm::DataLayout* TheDataLayout();
+	static llvm::IRBuilder<>& Builder();
+	static GobalSymbolMemManager* TheSymbolMemMgr();
+	static llvm::TargetMachine* TheTargetMachine();
+	// The object cache is shared by all the states, it is safe to use from multiple threads.
+	static JITObjectCache* TheObjectCache;
 
 public:
 	static llvm::Type* ConvertToLLVMType(VarType tp);
+	static llvm::Type* ConvertToLLVMType(const KSC_TypeInfo& typeInfo);
+	// The same as "ConvertToLLVMType" except that the lanes of the boolean vectors are i1, so the conversions 
+	// between the layouts can tell the boolean vectors(0 or 1 outside the KSC layout) from the int vectors.
+	static llvm::Type* ConvertToLayoutType(const KSC_TypeInfo& typeInfo);
 	static int GetSizeOfLLVMType(VarType tp);
 	static int GetAlignmentOfLLVMType(VarType tp);
 	static llvm::Type* ConvertToPackedType(llvm::Type* srcType);
-	static void ConvertValueToPacked(llvm::Value* srcValue, llvm::Value* destPtr);
-	static llvm::Value* ConvertValueFromPacked(llvm::Value* srcValue, llvm::Type* destType);
+	static void ConvertValueToPacked(llvm::Value* srcValue, llvm::Value* destPtr, llvm::Type* layoutType);
+	static llvm::Value* ConvertValueFromPacked(llvm::Value* srcValue, llvm::Type* destType, llvm::Type* layoutType);
+	// Convert the i1(or i1 vector) to the lane mask and back, the mask lane is true when its sign bit is set.
+	static llvm::Value* ConvertBoolToMask(llvm::Value* boolValue);
+	static llvm::Value* ConvertMaskToBool(llvm::Value* maskValue);
 	static llvm::Function* CreateFunctionWithPackedArguments(const KSC_FunctionDesc& fDesc);
+	// The target machine defaults to the one of the bound state, the threads without any state must pass their own.
+	static void OptimizeModule(llvm::Module* M, OptLevel optLevel, llvm::TargetMachine* pTM = NULL);
+	static bool EmitObjectCode(llvm::Module* M, std::string& outObj, llvm::TargetMachine* pTM = NULL);
+	static std::string MakeSymbolName(const std::string& funcName);
+	static llvm::Function* CreateTierUpStub(llvm::Function* F, int threshold, std::string& outSlotName);
+	// The types of the structure arguments and return value are taken from "fDesc", they are in the SoA layout.
+	static llvm::Function* CreateKernelDriver(llvm::Function* F, const KSC_FunctionDesc& fDesc, int width, const std::string& driverName);
+	// Whether the optimized kernel driver runs its lanes with the SIMD instructions, i.e. the function is inlined
+	// and the lane loop is replaced by the vector code.
+	static bool IsKernelVectorized(llvm::Function* driverF, int width);
+	// The range driver, "void Driver(void* const* ppBases, int begin, int end)", runs a sub-range for the dispatch.
+	// The argument "dispatchIdArg"(-1 if none) receives the element index instead of being read from its base.
+	static llvm::Function* CreateArrayDriver(llvm::Function* F, const std::vector<int>& argStrides, int retStride, 
+		int dispatchIdArg, bool isRangeDriver, const std::string& driverName);
+	static void AddLoopVectorizeHint(llvm::BranchInst* loopLatch, int width);
+	static void ApplyFPMode(FPMode mode);
+	static void GetSoAStreamSizes(llvm::Type* structType, std::vector<int>& outSizes);
+	static llvm::Function* CreateLayoutConverter(llvm::Module* M, const KSC_TypeInfo& typeInfo, MemLayout srcLayout, MemLayout destLayout, const std::string& name);
 
 	CG_Context();
 	llvm::Function* GetCurrentFunc();
@@ -81,8 +175,17 @@ public:
 
 	llvm::Value* CastValueType(llvm::Value* srcValue, VarType srcType, VarType destType);
 
+	llvm::Value* CreateIntrinsicCall(IntrinsicFunc func, const std::vector<llvm::Value*>& args, VarType argType);
+	// Load or store the array elements of "basePtr" at the indices of the integer vector, lane by lane.
+	static llvm::Value* CreateGather(llvm::Value* basePtr, llvm::Value* idxVec);
+	static void CreateScatter(llvm::Value* basePtr, llvm::Value* idxVec, llvm::Value* value);
+
 	llvm::Value* CreateBinaryExpression(const std::string& opStr, 
 		llvm::Value* pL, llvm::Value* pR, VarType Ltype, VarType Rtype);
+
+private:
+	llvm::Value* CreateBinaryInstruction(const std::string& opStr, 
+		llvm::Value* pL, llvm::Value* pR, VarType Ltype, VarType Rtype);
 };
 
 } // namespace SC
\ No newline at end of file
@@ -32,7 +32,7 @@ llvm::Value* Expression::GenerateCode(CG_Context* context) const
 llvm::Value* Exp_Constant::GenerateCode(CG_Context* context) const
 {
 	if (mIsFromFloat) 
-		return ConstantFP::get(getGlobalContext(), APFloat((Float)mValue));
+		return ConstantFP::get(CG_Context::TheLLVMContext(), APFloat((Float)mValue));
 	else
 		return Constant::getIntegerValue(SC_INT_TYPE, APInt(sizeof(Int)*8, (uint64_t)mValue, true));
 }
@@ -46,7 +46,7 @@ llvm::Value* Exp_VarDef::GenerateCode(CG_Context* context) const
 		llvm::Value* pInitValue = mpInitValue->GenerateCode(context);
 
 		llvm::Value* initValue = context->CastValueType(pInitValue, mpInitValue->GetCachedTypeInfo().type, mVarType);
-		CG_Context::sBuilder.CreateStore(initValue, varPtr);
+		CG_Context::Builder().CreateStore(initValue, varPtr);
 	}
 	return varPtr;
 }
@@ -70,12 +70,12 @@ llvm::Value* Exp_VariableRef::GenerateCode(CG_Context* context) const
 llvm::Value* Exp_UnaryOp::GenerateCode(CG_Context* context) const
 {
 	if (mOpType == "!")
-		return CG_Context::sBuilder.CreateNot(mpExpr->GenerateCode(context));
+		return CG_Context::Builder().CreateNot(mpExpr->GenerateCode(context));
 	else if (mOpType == "-") {
 		if (SC::IsFloatType(mCachedTypeInfo.type))
-			return CG_Context::sBuilder.CreateFNeg(mpExpr->GenerateCode(context));
+			return CG_Context::Builder().CreateFNeg(mpExpr->GenerateCode(context));
 		else
-			return CG_Context::sBuilder.CreateNeg(mpExpr->GenerateCode(context));
+			return CG_Context::Builder().CreateNeg(mpExpr->GenerateCode(context));
 	}
 	else {
 		assert(0);
@@ -87,7 +87,7 @@ llvm::Value* Exp_UnaryOp::GenerateCode(CG_Context* context) const
 void Exp_VariableRef::GenerateAssignCode(CG_Context* context, llvm::Value* pValue) const
 {
 	llvm::Value* varPtr = context->GetVariablePtr(mpDef->GetVarName().ToStdString(), true);
-	CG_Context::sBuilder.CreateStore(pValue, varPtr);
+	CG_Context::Builder().CreateStore(pValue, varPtr);
 }
 
 
@@ -117,6 +117,10 @@ llvm::Value* Exp_BinaryOp::GenerateCode(CG_Context* context) const
 
 llvm::Value* Exp_FunctionDecl::GenerateCode(CG_Context* context) const
 {
+	// The calls to the intrinsic functions are generated in place, they don't need the declarations.
+	if (GetIntrinsic() != kIntrinsicNone)
+		return NULL;
+
 	// handle the argument types
 	Function *F = context->GetFuncDeclByName(mFuncName);
 	llvm::Type* retType = NULL;
@@ -146,7 +150,8 @@ llvm::Value* Exp_FunctionDecl::GenerateCode(CG_Context* context) const
 			retType = context->ConvertToLLVMType(mReturnType);
 
 		FunctionType *FT = FunctionType::get(retType, funcArgTypes, false);
-		F = Function::Create(FT, Function::ExternalLinkage, mFuncName, CG_Context::TheModule);
+		// External functions keep their names so that they can be resolved with the global symbols.
+		F = Function::Create(FT, Function::ExternalLinkage, mHasBody ? CG_Context::MakeSymbolName(mFuncName) : mFuncName, CG_Context::TheModule());
 	}
 
 	if (F) {
@@ -157,10 +162,10 @@ llvm::Value* Exp_FunctionDecl::GenerateCode(CG_Context* context) const
 	}
 
 	if (!mHasBody) {
-		// Function doens't have the body, so it must be an external function.
-		auto& symbolLUT = CG_Context::TheSymbolMemMgr->mGlobalFuncSymbols;
+		// Function doens't have the body, so it must be an external function. The memory managers of the
+		// execution engines resolve it by its name.
+		auto& symbolLUT = CG_Context::TheSymbolMemMgr()->mGlobalFuncSymbols;
 		if (symbolLUT.find(mFuncName) != symbolLUT.end()) {
-			CG_Context::TheExecutionEngine->addGlobalMapping(F, symbolLUT[mFuncName]);
 			return F;
 		}
 		else {
@@ -176,13 +181,21 @@ llvm::Value* Exp_FunctionDecl::GenerateCode(CG_Context* context) const
 	}
 	
 	// Create a new basic block to start insertion into, this basic blokc is a must for a function.
-	BasicBlock *BB = BasicBlock::Create(getGlobalContext(), mFuncName + "_entry", F);
+	BasicBlock *BB = BasicBlock::Create(CG_Context::TheLLVMContext(), mFuncName + "_entry", F);
 
 	// Create the basic block for exiting code which handles the return value, it will be inserted into function body later.
-	BasicBlock *retBB = BasicBlock::Create(getGlobalContext(), mFuncName + "_exit");
+	BasicBlock *retBB = BasicBlock::Create(CG_Context::TheLLVMContext(), mFuncName + "_exit");
 	
-	CG_Context::sBuilder.SetInsertPoint(BB);
-	llvm::Value* pRetValuePtr = mReturnType == VarType::kVoid ? NULL : CG_Context::sBuilder.CreateAlloca(retType, 0, mFuncName + "_retValue");
+	CG_Context::Builder().SetInsertPoint(BB);
+	FastMathFlags parentFMF = CG_Context::Builder().getFastMathFlags();
+	CG_Context::ApplyFPMode(mFPMode);
+	if (CG_Context::Builder().getFastMathFlags().unsafeAlgebra()) {
+		// Let the code generator use the unsafe transforms on this function as well, e.g. the reciprocal estimates.
+		F->addFnAttr("unsafe-fp-math", "true");
+		F->addFnAttr("no-infs-fp-math", "true");
+		F->addFnAttr("no-nans-fp-math", "true");
+	}
+	llvm::Value* pRetValuePtr = mReturnType == VarType::kVoid ? NULL : CG_Context::Builder().CreateAlloca(retType, 0, mFuncName + "_retValue");
 	CG_Context* funcGC_ctx = context->CreateChildContext(F, retBB, pRetValuePtr);
 
 	Function::arg_iterator AI = F->arg_begin();
@@ -196,7 +209,7 @@ llvm::Value* Exp_FunctionDecl::GenerateCode(CG_Context* context) const
 		else {
 			llvm::Value* funcArg = funcGC_ctx->NewVariable(pVarDef, NULL);
 			// Store the input argument's value in the the local variables.
-			CG_Context::sBuilder.CreateStore(AI, funcArg);
+			CG_Context::Builder().CreateStore(AI, funcArg);
 		}
 	}
 
@@ -207,16 +220,16 @@ llvm::Value* Exp_FunctionDecl::GenerateCode(CG_Context* context) const
 
 	// Now insert the exit basic block
 	F->getBasicBlockList().push_back(retBB);
-	CG_Context::sBuilder.CreateBr(retBB);
+	CG_Context::Builder().CreateBr(retBB);
 
 	assert(retType);
-	CG_Context::sBuilder.SetInsertPoint(retBB);
+	CG_Context::Builder().SetInsertPoint(retBB);
 	if (mReturnType == VarType::kVoid)
-		CG_Context::sBuilder.CreateRetVoid();
+		CG_Context::Builder().CreateRetVoid();
 	else
-		CG_Context::sBuilder.CreateRet(CG_Context::sBuilder.CreateLoad(pRetValuePtr));
-
+		CG_Context::Builder().CreateRet(CG_Context::Builder().CreateLoad(pRetValuePtr));
 
+	CG_Context::Builder().SetFastMathFlags(parentFMF);
 	delete funcGC_ctx;
 	return F;
 }
@@ -224,9 +237,12 @@ llvm::Value* Exp_FunctionDecl::GenerateCode(CG_Context* context) const
 llvm::Value* CodeDomain::GenerateCode(CG_Context* context) const
 {
 	CG_Context* domain_ctx = context->CreateChildContext(context->GetCurrentFunc(), context->GetFuncRetBlk(), context->GetRetValuePtr());
+	FastMathFlags parentFMF = CG_Context::Builder().getFastMathFlags();
+	CG_Context::ApplyFPMode(mFPMode);
 	for (int i = 0; i < (int)mExpressions.size(); ++i) {
 		mExpressions[i]->GenerateCode(domain_ctx);
 	}
+	CG_Context::Builder().SetFastMathFlags(parentFMF);
 	delete domain_ctx;
 	return NULL; // the domain doesn't have the value to return
 }
@@ -238,10 +254,10 @@ llvm::Value* Exp_FuncRet::GenerateCode(CG_Context* context) const
 		assert(retVal);
 		const SC::Exp_StructDef* structDef;
 		Value* convertedValue = context->CastValueType(retVal, mCachedTypeInfo.type, mpFuncDecl->GetReturnType(structDef));
-		return CG_Context::sBuilder.CreateStore(convertedValue, context->GetRetValuePtr());
+		return CG_Context::Builder().CreateStore(convertedValue, context->GetRetValuePtr());
 	}
 
-	CG_Context::sBuilder.CreateBr(context->GetFuncRetBlk());
+	CG_Context::Builder().CreateBr(context->GetFuncRetBlk());
 	return NULL;
 }
 
@@ -250,12 +266,14 @@ void Exp_DotOp::GenerateAssignCode(CG_Context* context, llvm::Value* pValue) con
 	Exp_ValueEval::ValuePtrInfo valuePtrInfo = GetValuePtr(context);
 	assert(valuePtrInfo.valuePtr);
 	if (!valuePtrInfo.belongToVector) {
-		CG_Context::sBuilder.CreateStore(pValue, valuePtrInfo.valuePtr);
+		CG_Context::Builder().CreateStore(pValue, valuePtrInfo.valuePtr);
 	}
 	else {
 		llvm::Value* idx = Constant::getIntegerValue(SC_INT_TYPE, APInt(sizeof(Int)*8, (uint64_t)valuePtrInfo.vecElemIdx));
-		llvm::Value* updatedValue = CG_Context::sBuilder.CreateInsertElement(CG_Context::sBuilder.CreateLoad(valuePtrInfo.valuePtr), pValue, idx);
-		CG_Context::sBuilder.CreateStore(updatedValue, valuePtrInfo.valuePtr);
+		if (IsBooleanType(GetCachedTypeInfo().type))
+			pValue = CG_Context::ConvertBoolToMask(pValue);
+		llvm::Value* updatedValue = CG_Context::Builder().CreateInsertElement(CG_Context::Builder().CreateLoad(valuePtrInfo.valuePtr), pValue, idx);
+		CG_Context::Builder().CreateStore(updatedValue, valuePtrInfo.valuePtr);
 	}
 }
 
@@ -283,7 +301,7 @@ Exp_ValueEval::ValuePtrInfo Exp_DotOp::GetValuePtr(CG_Context* context) const
 			std::vector<llvm::Value*> indices(2);
 			indices[0] = Constant::getIntegerValue(SC_INT_TYPE, APInt(sizeof(Int)*8, (uint64_t)0));
 			indices[1] = Constant::getIntegerValue(SC_INT_TYPE, APInt(sizeof(Int)*8, (uint64_t)elemIdx));
-			llvm::Value* structElemPtr = CG_Context::sBuilder.CreateGEP(parentPtrInfo.valuePtr, indices);
+			llvm::Value* structElemPtr = CG_Context::Builder().CreateGEP(parentPtrInfo.valuePtr, indices);
 			const Exp_StructDef* dummyStructDef = NULL;
 			int subTypeArraySize = -1;
 			pParentStructDef->GetElementType(elemIdx, dummyStructDef, subTypeArraySize);
@@ -318,10 +336,12 @@ llvm::Value* Exp_DotOp::GenerateCode(CG_Context* context) const
 	Exp_ValueEval::ValuePtrInfo valuePtrInfo = GetValuePtr(context);
 	if (valuePtrInfo.valuePtr) {
 		
-		llvm::Value* ret = CG_Context::sBuilder.CreateLoad(valuePtrInfo.valuePtr);
+		llvm::Value* ret = CG_Context::Builder().CreateLoad(valuePtrInfo.valuePtr);
 		if  (valuePtrInfo.belongToVector) {
 			llvm::Value* idx = Constant::getIntegerValue(SC_INT_TYPE, APInt(sizeof(Int)*8, (uint64_t)valuePtrInfo.vecElemIdx));
-			ret = CG_Context::sBuilder.CreateExtractElement(ret, idx);
+			ret = CG_Context::Builder().CreateExtractElement(ret, idx);
+			if (IsBooleanType(GetCachedTypeInfo().type))
+				ret = CG_Context::ConvertMaskToBool(ret);
 		}
 		return ret;
 	}
@@ -331,9 +351,9 @@ llvm::Value* Exp_DotOp::GenerateCode(CG_Context* context) const
 		int elemCnt = ConvertSwizzle(mOpStr.c_str(), swizzleIdx);
 		llvm::SmallVector<Constant*, 4> Idxs;
 		for (int i = 0; i < elemCnt; ++i) 
-			Idxs.push_back(CG_Context::sBuilder.getInt32(swizzleIdx[i]));
+			Idxs.push_back(CG_Context::Builder().getInt32(swizzleIdx[i]));
 		llvm::Value* srcValue = mpExp->GenerateCode(context);
-		llvm::Value* swizzledValue = CG_Context::sBuilder.CreateShuffleVector(srcValue, llvm::UndefValue::get(srcValue->getType()), llvm::ConstantVector::get(Idxs));
+		llvm::Value* swizzledValue = CG_Context::Builder().CreateShuffleVector(srcValue, llvm::UndefValue::get(srcValue->getType()), llvm::ConstantVector::get(Idxs));
 		return swizzledValue;
 	}
 }
@@ -349,7 +369,7 @@ llvm::Value* Exp_BuiltInInitializer::GenerateCode(CG_Context* context) const
 	else {
 		int elemIdx = 0;
 		llvm::Value* outVar = llvm::UndefValue::get(CG_Context::ConvertToLLVMType(mType));
-		for (int exp_i = 0; exp_i < 4; ++exp_i) {
+		for (int exp_i = 0; exp_i < MAX_INITIALIZER_EXPRS; ++exp_i) {
 			if (mpSubExprs[exp_i] == NULL)
 				break;
 			llvm::Value* tmpVar = mpSubExprs[exp_i]->GenerateCode(context);
@@ -361,11 +381,11 @@ llvm::Value* Exp_BuiltInInitializer::GenerateCode(CG_Context* context) const
 			if (subElemCnt > 1) {
 				for (int i = 0; i < subElemCnt; ++i) {
 					llvm::Value* idx = Constant::getIntegerValue(SC_INT_TYPE, APInt(sizeof(Int)*8, (uint64_t)i));
-					llvm::Value* elemValue = CG_Context::sBuilder.CreateExtractElement(tmpVar, idx);
+					llvm::Value* elemValue = CG_Context::Builder().CreateExtractElement(tmpVar, idx);
 					elemValue = context->CastValueType(elemValue, srcElemType, destElemType);
 
 					idx = Constant::getIntegerValue(SC_INT_TYPE, APInt(sizeof(Int)*8, (uint64_t)elemIdx++));
-					outVar = CG_Context::sBuilder.CreateInsertElement(outVar, elemValue, idx);
+					outVar = CG_Context::Builder().CreateInsertElement(outVar, elemValue, idx);
 				}
 			}
 			else {
@@ -373,7 +393,7 @@ llvm::Value* Exp_BuiltInInitializer::GenerateCode(CG_Context* context) const
 				llvm::Value* elemValue = tmpVar;
 				elemValue = context->CastValueType(elemValue, subType, destElemType);
 
-				outVar = CG_Context::sBuilder.CreateInsertElement(outVar, elemValue, idx);
+				outVar = CG_Context::Builder().CreateInsertElement(outVar, elemValue, idx);
 			}
 		}
 		
@@ -392,11 +412,25 @@ Exp_ValueEval::ValuePtrInfo Exp_VariableRef::GetValuePtr(CG_Context* context) co
 	return retValuePtr;
 }
 
+// Return the pointer to the first element of the array.
+static llvm::Value* GetArrayBasePtr(const Exp_ValueEval::ValuePtrInfo& arrayPtrInfo)
+{
+	if (arrayPtrInfo.isFixedArray)
+		return CG_Context::Builder().CreateConstGEP2_32(arrayPtrInfo.valuePtr, 0, 0);
+	else
+		return arrayPtrInfo.valuePtr;
+}
+
 llvm::Value* Exp_Indexer::GenerateCode(CG_Context* context) const
 {
+	if (mIsVectorIndex) {
+		llvm::Value* idx = mpIndex->GenerateCode(context);
+		return CG_Context::CreateGather(GetArrayBasePtr(mpExp->GetValuePtr(context)), idx);
+	}
+
 	Exp_ValueEval::ValuePtrInfo ptrInfo = GetValuePtr(context);
 	assert(ptrInfo.belongToVector == false);
-	return CG_Context::sBuilder.CreateLoad(ptrInfo.valuePtr);
+	return CG_Context::Builder().CreateLoad(ptrInfo.valuePtr);
 }
 
 Exp_ValueEval::ValuePtrInfo Exp_Indexer::GetValuePtr(CG_Context* context) const
@@ -405,6 +439,11 @@ Exp_ValueEval::ValuePtrInfo Exp_Indexer::GetValuePtr(CG_Context* context) const
 	retValuePtr.vecElemIdx = -1;
 	retValuePtr.belongToVector = false;
 	retValuePtr.isFixedArray = false;
+	retValuePtr.valuePtr = NULL;
+	// The gathered elements are not contiguous in memory
+	if (mIsVectorIndex)
+		return retValuePtr;
+
 	llvm::Value* idx = mpIndex->GenerateCode(context);
 	Exp_ValueEval::ValuePtrInfo parentPtrInfo = mpExp->GetValuePtr(context);
 	assert(parentPtrInfo.valuePtr != NULL && parentPtrInfo.belongToVector == false);
@@ -419,19 +458,34 @@ Exp_ValueEval::ValuePtrInfo Exp_Indexer::GetValuePtr(CG_Context* context) const
 	else
 		indices[0] = idx;
 
-	retValuePtr.valuePtr = CG_Context::sBuilder.CreateGEP(parentPtrInfo.valuePtr, indices);
+	retValuePtr.valuePtr = CG_Context::Builder().CreateGEP(parentPtrInfo.valuePtr, indices);
 	return retValuePtr;
 }
 
 void Exp_Indexer::GenerateAssignCode(CG_Context* context, llvm::Value* pValue) const
 {
+	if (mIsVectorIndex) {
+		llvm::Value* idx = mpIndex->GenerateCode(context);
+		CG_Context::CreateScatter(GetArrayBasePtr(mpExp->GetValuePtr(context)), idx, pValue);
+		return;
+	}
+
 	Exp_ValueEval::ValuePtrInfo ptrInfo = GetValuePtr(context);
 	assert(ptrInfo.belongToVector == false);
-	CG_Context::sBuilder.CreateStore(pValue, ptrInfo.valuePtr);
+	CG_Context::Builder().CreateStore(pValue, ptrInfo.valuePtr);
 }
 
 llvm::Value* Exp_FunctionCall::GenerateCode(CG_Context* context) const
 {
+	if (mpFuncDef->GetIntrinsic() != kIntrinsicNone) {
+		std::vector<llvm::Value*> args;
+		for (int i = 0; i < (int)mInputArgs.size(); ++i) {
+			llvm::Value* argValue = mInputArgs[i]->GenerateCode(context);
+			args.push_back(context->CastValueType(argValue, mInputArgs[i]->GetCachedTypeInfo().type, mIntrinsicArgType));
+		}
+		return context->CreateIntrinsicCall(mpFuncDef->GetIntrinsic(), args, mIntrinsicArgType);
+	}
+
 	llvm::Function* pF = context->GetFuncDeclByName(mpFuncDef->GetFunctionName());
 	assert(pF);
 	std::vector<llvm::Value*> args;
@@ -447,7 +501,7 @@ llvm::Value* Exp_FunctionCall::GenerateCode(CG_Context* context) const
 			args.push_back(argValue);
 		}
 	}
-	return CG_Context::sBuilder.CreateCall(pF, args);
+	return CG_Context::Builder().CreateCall(pF, args);
 }
 
 
@@ -455,19 +509,19 @@ llvm::Value* Exp_If::GenerateCode(CG_Context* context) const
 {
 	llvm::Value* condValue = mpCondValue->GenerateCode(context);
 
-	if (condValue->getType() != llvm::Type::getInt1Ty(getGlobalContext())) {
+	if (condValue->getType() != llvm::Type::getInt1Ty(CG_Context::TheLLVMContext())) {
 		// Perform the value type to boolean conversion if necessary
 		//
 		if (mpCondValue->GetCachedTypeInfo().type == VarType::kFloat) {
-			condValue = CG_Context::sBuilder.CreateFCmpONE(condValue, ConstantFP::get(getGlobalContext(), APFloat(0.0f)));
+			condValue = CG_Context::Builder().CreateFCmpONE(condValue, ConstantFP::get(CG_Context::TheLLVMContext(), APFloat(0.0f)));
 		}
 		else if (mpCondValue->GetCachedTypeInfo().type == VarType::kInt) {
-			condValue = CG_Context::sBuilder.CreateICmpNE(condValue, Constant::getIntegerValue(SC_INT_TYPE, APInt(sizeof(Int)*8, (uint64_t)0, true)));
+			condValue = CG_Context::Builder().CreateICmpNE(condValue, Constant::getIntegerValue(SC_INT_TYPE, APInt(sizeof(Int)*8, (uint64_t)0, true)));
 		}
 		else if (mpCondValue->GetCachedTypeInfo().type == VarType::kExternType) {
-			condValue = CG_Context::sBuilder.CreatePtrToInt(condValue, Type::getInt64Ty(getGlobalContext()));
+			condValue = CG_Context::Builder().CreatePtrToInt(condValue, Type::getInt64Ty(CG_Context::TheLLVMContext()));
 			llvm::Value* nullPtrValue = Constant::getIntegerValue(SC_INT_TYPE, APInt(64, (uint64_t)0, true));
-			condValue = CG_Context::sBuilder.CreateICmpNE(condValue, nullPtrValue);
+			condValue = CG_Context::Builder().CreateICmpNE(condValue, nullPtrValue);
 		}
 		else
 			assert(1);
@@ -478,14 +532,14 @@ llvm::Value* Exp_If::GenerateCode(CG_Context* context) const
 
 	// Create blocks for the then and else cases.  Insert the 'then' block at the
 	// end of the function.
-	BasicBlock* pThenBB = BasicBlock::Create(getGlobalContext(), "then", pCurFunc);
-	BasicBlock* pElseBB = BasicBlock::Create(getGlobalContext(), "else");
-	BasicBlock* pMergeBB = BasicBlock::Create(getGlobalContext(), "ifcont");
+	BasicBlock* pThenBB = BasicBlock::Create(CG_Context::TheLLVMContext(), "then", pCurFunc);
+	BasicBlock* pElseBB = BasicBlock::Create(CG_Context::TheLLVMContext(), "else");
+	BasicBlock* pMergeBB = BasicBlock::Create(CG_Context::TheLLVMContext(), "ifcont");
   
-	CG_Context::sBuilder.CreateCondBr(condValue, pThenBB, pElseBB);
+	CG_Context::Builder().CreateCondBr(condValue, pThenBB, pElseBB);
   
 	// Emit then value.
-	CG_Context::sBuilder.SetInsertPoint(pThenBB);
+	CG_Context::Builder().SetInsertPoint(pThenBB);
   
 	if (mpIfDomain) {
 		// Code gen for if block
@@ -494,13 +548,13 @@ llvm::Value* Exp_If::GenerateCode(CG_Context* context) const
 		delete childCtx;
 	}
   
-	CG_Context::sBuilder.CreateBr(pMergeBB);
+	CG_Context::Builder().CreateBr(pMergeBB);
 	// Codegen of 'Then' can change the current block, update ThenBB for the PHI.
-	pThenBB = CG_Context::sBuilder.GetInsertBlock();
+	pThenBB = CG_Context::Builder().GetInsertBlock();
   
 	// Emit else block.
 	pCurFunc->getBasicBlockList().push_back(pElseBB);
-	CG_Context::sBuilder.SetInsertPoint(pElseBB);
+	CG_Context::Builder().SetInsertPoint(pElseBB);
   
 	if (mpElseDomain) {
 		// Code gen for else block
@@ -509,15 +563,15 @@ llvm::Value* Exp_If::GenerateCode(CG_Context* context) const
 		delete childCtx;
 	}
   
-	CG_Context::sBuilder.CreateBr(pMergeBB);
+	CG_Context::Builder().CreateBr(pMergeBB);
 	// Codegen of 'Else' can change the current block, update ElseBB for the PHI.
-	pElseBB = CG_Context::sBuilder.GetInsertBlock();
+	pElseBB = CG_Context::Builder().GetInsertBlock();
   
 	// Emit merge block.
 	pCurFunc->getBasicBlockList().push_back(pMergeBB);
-	CG_Context::sBuilder.SetInsertPoint(pMergeBB);
+	CG_Context::Builder().SetInsertPoint(pMergeBB);
 	llvm::Type* phiRetTy = SC_INT_TYPE;
-	llvm::PHINode *PN = CG_Context::sBuilder.CreatePHI(phiRetTy, 2, "iftmp");
+	llvm::PHINode *PN = CG_Context::Builder().CreatePHI(phiRetTy, 2, "iftmp");
   
 	llvm::Value* voidUndef = llvm::UndefValue::get(phiRetTy);
 	PN->addIncoming(voidUndef, pThenBB);
@@ -534,17 +588,17 @@ llvm::Value* Exp_For::GenerateCode(CG_Context* context) const
 	mStartStepCond->GetExpression(0)->GenerateCode(pForCtx);
 	// Make the new basic block for the loop header, inserting after current block.
 	llvm::Function* pCurFunc = pForCtx->GetCurrentFunc();
-	llvm::BasicBlock *PreheaderBB = CG_Context::sBuilder.GetInsertBlock();
-	llvm::BasicBlock *LoopBB = llvm::BasicBlock::Create(getGlobalContext(), "loop", pCurFunc);
+	llvm::BasicBlock *PreheaderBB = CG_Context::Builder().GetInsertBlock();
+	llvm::BasicBlock *LoopBB = llvm::BasicBlock::Create(CG_Context::TheLLVMContext(), "loop", pCurFunc);
   
 	// Insert an explicit fall through from the current block to the LoopBB.
-	CG_Context::sBuilder.CreateBr(LoopBB);
+	CG_Context::Builder().CreateBr(LoopBB);
 
 	// Start insertion in LoopBB.
-	CG_Context::sBuilder.SetInsertPoint(LoopBB);
+	CG_Context::Builder().SetInsertPoint(LoopBB);
   
 	// Start the PHI node with an entry for Start.
-	PHINode *PN = CG_Context::sBuilder.CreatePHI(phiRetTy, 2);
+	PHINode *PN = CG_Context::Builder().CreatePHI(phiRetTy, 2);
 	PN->addIncoming(voidUndef, PreheaderBB);
   
 	// Emit the body of the loop.  This, like any other expr, can change the
@@ -560,17 +614,17 @@ llvm::Value* Exp_For::GenerateCode(CG_Context* context) const
 	assert(contCond);
   
 	// Create the "after loop" block and insert it.
-	BasicBlock *LoopEndBB = CG_Context::sBuilder.GetInsertBlock();
-	BasicBlock *AfterBB = BasicBlock::Create(getGlobalContext(), "afterloop", pCurFunc);
+	BasicBlock *LoopEndBB = CG_Context::Builder().GetInsertBlock();
+	BasicBlock *AfterBB = BasicBlock::Create(CG_Context::TheLLVMContext(), "afterloop", pCurFunc);
   
 	// Insert the conditional branch into the end of LoopEndBB.
 	if (contCond->getType() == SC_INT_TYPE) {
-		contCond = CG_Context::sBuilder.CreateICmpNE(contCond, Constant::getIntegerValue(SC_INT_TYPE, APInt(sizeof(Int)*8, (uint64_t)0, true)));	
+		contCond = CG_Context::Builder().CreateICmpNE(contCond, Constant::getIntegerValue(SC_INT_TYPE, APInt(sizeof(Int)*8, (uint64_t)0, true)));	
 	}
-	CG_Context::sBuilder.CreateCondBr(contCond, LoopBB, AfterBB);
+	CG_Context::Builder().CreateCondBr(contCond, LoopBB, AfterBB);
   
 	// Any new code will be inserted in AfterBB.
-	CG_Context::sBuilder.SetInsertPoint(AfterBB);
+	CG_Context::Builder().SetInsertPoint(AfterBB);
   
 	// Add a new entry to the PHI node for the backedge.
 	PN->addIncoming(voidUndef, LoopEndBB);
@@ -586,7 +640,11 @@ llvm::Value* Exp_ConstString::GenerateCode(CG_Context* context) const
 
 llvm::Value* Exp_Select::GenerateCode(CG_Context* context) const
 {
-	return CG_Context::sBuilder.CreateSelect(mpCondValue->GenerateCode(context), mpFirstValue->GenerateCode(context), mpSecondValue->GenerateCode(context));
+	llvm::Value* condValue = mpCondValue->GenerateCode(context);
+	// The boolean vector is the lane mask, which selects the lanes by the sign bit just like blendvps.
+	if (condValue->getType()->isVectorTy())
+		condValue = CG_Context::ConvertMaskToBool(condValue);
+	return CG_Context::Builder().CreateSelect(condValue, mpFirstValue->GenerateCode(context), mpSecondValue->GenerateCode(context));
 }
 
 int Exp_StructDef::GetStructSize() const
@@ -612,14 +670,14 @@ void Exp_StructDef::ConvertToDescription(KSC_StructDesc& ref, CG_Context& ctx) c
 	ref.clear();
 	ref.mMemberIndices.clear();
 	llvm::Type* structType = ctx.GetStructType(this);
-	ref.mStructSize = (int)CG_Context::TheDataLayout->getTypeAllocSize(structType);
-	ref.mAlignment = CG_Context::TheDataLayout->getPrefTypeAlignment(structType);
-	int structAlignment = CG_Context::TheDataLayout->getPrefTypeAlignment(structType);
+	ref.mStructSize = (int)CG_Context::TheDataLayout()->getTypeAllocSize(structType);
+	ref.mAlignment = CG_Context::TheDataLayout()->getPrefTypeAlignment(structType);
+	int structAlignment = CG_Context::TheDataLayout()->getPrefTypeAlignment(structType);
+	const llvm::StructLayout* structLayout = CG_Context::TheDataLayout()->getStructLayout(llvm::cast<llvm::StructType>(structType));
 
 	const Exp_StructDef* childStruct;
 	int arraySize;
 	VarType type;
-	int curMemOffset = 0;
 	for (int i = 0; i < GetElementCount(); ++i) {
 		childStruct = NULL;
 		arraySize = 0;
@@ -632,7 +690,7 @@ void Exp_StructDef::ConvertToDescription(KSC_StructDesc& ref, CG_Context& ctx) c
 			childStruct->ConvertToDescription(*pStructDesc, ctx);
 			hStruct = (StructHandle)pStructDesc;
 			typeSize = pStructDesc->mStructSize;
-			typeAlignment = CG_Context::TheDataLayout->getPrefTypeAlignment(ctx.GetStructType(childStruct));
+			typeAlignment = CG_Context::TheDataLayout()->getPrefTypeAlignment(ctx.GetStructType(childStruct));
 		}
 		else {
 			typeSize = CG_Context::GetSizeOfLLVMType(type);
@@ -643,15 +701,14 @@ void Exp_StructDef::ConvertToDescription(KSC_StructDesc& ref, CG_Context& ctx) c
 		std::hash_map<int, Exp_VarDef*>::const_iterator it = mIdx2ValueDefs.find(i);
 		KSC_StructDesc::MemberInfo memberInfo;
 		memberInfo.idx = i;
-		memberInfo.mem_offset = curMemOffset;
+		// The offset and size take the padding and the array members into account
+		memberInfo.mem_offset = (int)structLayout->getElementOffset(i);
 		memberInfo.type_string = it->second->GetTypeString().ToStdString();
-		memberInfo.mem_size = typeSize;
+		memberInfo.mem_size = (int)CG_Context::TheDataLayout()->getTypeAllocSize(structType->getStructElementType(i));
 
 		ref.mMemberIndices[it->second->GetVarName().ToStdString()] = memberInfo;
 		newElem.typeString = ref.mMemberIndices[it->second->GetVarName().ToStdString()].type_string.c_str();
 		ref.push_back(newElem);
-
-		curMemOffset += memberInfo.mem_size;
 	}
 }
 
@@ -671,7 +728,7 @@ void Exp_FunctionDecl::ConvertToDescription(KSC_FunctionDesc& desc, CG_Context&
 			mArgments[i].typeInfo.pStructDef->ConvertToDescription(*pStructDesc, ctx);
 			kscType.hStruct = pStructDesc;
 			typeSize = pStructDesc->mStructSize;
-			typeAlignment = CG_Context::TheDataLayout->getPrefTypeAlignment(ctx.GetStructType(mArgments[i].typeInfo.pStructDef));
+			typeAlignment = CG_Context::TheDataLayout()->getPrefTypeAlignment(ctx.GetStructType(mArgments[i].typeInfo.pStructDef));
 		}
 		else {
 			typeSize = CG_Context::GetSizeOfLLVMType(mArgments[i].typeInfo.type);
@@ -685,6 +742,21 @@ void Exp_FunctionDecl::ConvertToDescription(KSC_FunctionDesc& desc, CG_Context&
 		kscType.isKSCLayout = !mArgments[i].needJITPacked;
 		desc.mArgumentTypes[i] = kscType;
 	}
+
+	// Handle the return value, which is always returned in the packed layout
+	KSC_TypeInfo retType = {mReturnType, 0, 0, 0, NULL, NULL, false, false};
+	if (mReturnType == VarType::kStructure) {
+		KSC_StructDesc* pStructDesc = new KSC_StructDesc;
+		mpRetStruct->ConvertToDescription(*pStructDesc, ctx);
+		retType.hStruct = pStructDesc;
+		retType.sizeOfType = pStructDesc->mStructSize;
+		retType.alignment = CG_Context::TheDataLayout()->getPrefTypeAlignment(ctx.GetStructType(mpRetStruct));
+	}
+	else if (mReturnType != VarType::kVoid) {
+		retType.sizeOfType = CG_Context::GetSizeOfLLVMType(mReturnType);
+		retType.alignment = CG_Context::GetAlignmentOfLLVMType(mReturnType);
+	}
+	desc.mReturnType = retType;
 }
 
 } // namespace SC
\ No newline at end of file
@@ -1,24 +1,309 @@
 #include "../inc/SC_API.h"
 #include "IR_Gen_Context.h"
 #include "parser_AST_Gen.h"
+#include "jit_worker.h"
+#include "dispatch_pool.h"
+#include "module_binary.h"
 #include <string>
 #include <list>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <stdio.h>
 #include <llvm/Support/Host.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/raw_ostream.h>
 #include <llvm/IR/Verifier.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Object/ObjectFile.h>
 
 
-static std::string			s_lastErrMsg;
-SC::RootDomain*				s_predefineDomain = NULL;
-SC::CG_Context				s_predefineCtx;
-KSC_ModuleDesc*				s_predefineModule = NULL;
-std::list<KSC_ModuleDesc*>	s_modules;						
+// Everything a compiling session owns, the contexts share nothing mutable so that they can compile
+// on different threads at the same time.
+struct KSC_Context
+{
+	SC::CodeGenState*			pCodeGen;
+	std::string					lastErrMsg;
+	SC::RootDomain*				pPredefineDomain;
+	SC::CG_Context				predefineCtx;
+	KSC_ModuleDesc*				pPredefineModule;
+	std::list<KSC_ModuleDesc*>	modules;
+	// The count of the modules compiled with the same content hash, which makes their symbols unique.
+	std::map<std::string, int>	moduleHashCnt;
+	// LLVM code generation is not thread-safe, this lock serializes the APIs touching the LLVM objects
+	// of this context between the threads of the hosting application and the JIT worker.
+	std::recursive_mutex		codeGenMutex;
+	SC::JITWorker				jitWorker;
+	// The JIT-ed layout converters, keyed by the structure layout and the conversion.
+	std::map<std::string, void*>	layoutConverters;
+	// The shared code the context is created with, the batch compile creates its helper contexts with it.
+	std::string					sharedCode;
+	bool						hasSharedCode;
+	// The helper contexts of the batch compile, each worker thread but the first compiles in one of them.
+	// They are created on demand and destroyed along with this context. The lock serializes the batches.
+	std::mutex					batchMutex;
+	std::vector<KSC_Context*>	batchContexts;
+	std::vector<std::string>	batchErrMsgs;
+
+	KSC_Context() : pCodeGen(NULL), pPredefineDomain(NULL), pPredefineModule(NULL), hasSharedCode(false) {}
+};
+
+// Lock the context and bind its code generation state to the calling thread.
+class ContextScope
+{
+private:
+	std::lock_guard<std::recursive_mutex> mLock;
+	SC::CodeGenScope mCodeGenScope;
+public:
+	explicit ContextScope(KSC_Context* pCtx) : mLock(pCtx->codeGenMutex), mCodeGenScope(pCtx->pCodeGen) {}
+};
+
+// The context behind the APIs without the context handle, it is created by KSC_Initialize.
+static KSC_Context*			s_pDefaultContext = NULL;
+// The error of the API failing without any context, e.g. the creation of the context. It is kept per thread,
+// so the threads creating the contexts at the same time don't overwrite the message being read.
+static __declspec(thread) char	s_globalErrMsg[4096];
+// The live contexts and the external functions that every context created gets.
+static std::mutex			s_contextMutex;
+static std::list<KSC_Context*>	s_contexts;
+// The count of "KSC_AddExternalFunction" calls updating the contexts outside the mutex, a context removed from
+// the list is destroyed only after they finish.
+static std::condition_variable	s_contextUpdateCond;
+static int					s_contextUpdateCnt = 0;
+static std::hash_map<std::string, void*>	s_externalSymbols;
+static std::once_flag		s_builtInSymbolFlag;
+// The tier-up slots of the JIT-ed tiered modules, the tier-up request identifies the module by its slot.
+static std::mutex			s_tierSlotMutex;
+static std::map<void*, KSC_ModuleDesc*>	s_tierSlots;
+// The pool running the dispatches of all the contexts, so the independent dispatches take turns on it. It's
+// never destroyed, the process might exit with the pool threads running if "KSC_Destory" isn't called.
+static SC::DispatchPool&	s_dispatchPool = *new SC::DispatchPool;
+// Bump this whenever the generated code changes for the same source, so the stale cached objects are not used.
+static const char*			s_codeGenVersion = "ksc_codegen_7";
+
+static void SetGlobalErrMsg(const std::string& errMsg)
+{
+	strncpy_s(s_globalErrMsg, errMsg.c_str(), _TRUNCATE);
+}
 
 static int __int_pow(int base, int p)
 {
 	return _Pow_int(base, p);
 }
 
+static void HashExternalSymbols(llvm::MD5& hash)
+{
+	std::vector<std::string> names;
+	std::hash_map<std::string, void*>::iterator it = SC::CG_Context::TheSymbolMemMgr()->mGlobalFuncSymbols.begin();
+	for (; it != SC::CG_Context::TheSymbolMemMgr()->mGlobalFuncSymbols.end(); ++it)
+		names.push_back(it->first);
+	std::sort(names.begin(), names.end());
+	for (size_t i = 0; i < names.size(); ++i) {
+		hash.update(names[i]);
+		hash.update(";");
+	}
+}
+
+static void HashCompileOptions(llvm::MD5& hash, const KSC_CompileOptions& options)
+{
+	char optionStr[128];
+	sprintf_s(optionStr, "optLevel=%d;tierUpThreshold=%d;fastMath=%d;codeGenThreads=%d;", (int)options.optLevel, 
+		options.tierUpThreshold, options.fastMath ? 1 : 0, std::max(options.codeGenThreads, 1));
+	hash.update(optionStr);
+}
+
+// Every name is taken only once in the context, even after its module is released, so the symbol names decorated
+// with it always identify one module instance.
+static std::string MakeModuleInstanceName(KSC_Context* pCtx, const std::string& prefix, const std::string& hashStr)
+{
+	int& cnt = pCtx->moduleHashCnt[hashStr];
+	char instanceTag[16];
+	sprintf_s(instanceTag, "_%08x", cnt++);
+	return prefix + hashStr + instanceTag;
+}
+
+static std::string MakeModuleName(KSC_Context* pCtx, const char* prefix, llvm::MD5& hash)
+{
+	// The module name decorates the symbols, its content hash names the cached object so it must be the same
+	// across runs for the same content. The instance tag after the hash tells apart the modules of the same
+	// content in the context, see "JITObjectCache".
+	llvm::MD5::MD5Result hashResult;
+	hash.final(hashResult);
+	llvm::SmallString<32> hashStr;
+	llvm::MD5::stringifyResult(hashResult, hashStr);
+	return MakeModuleInstanceName(pCtx, prefix, hashStr.str());
+}
+
+static bool IsTieredModule(const KSC_ModuleDesc* pModule)
+{
+	return pModule->mOptions.tierUpThreshold > 0 && pModule->mOptions.optLevel != SC::kOptNone;
+}
+
+static llvm::Module* CreateLateModule(KSC_ModuleDesc* pModule, const std::string& nameSuffix)
+{
+	llvm::Module* lateM = llvm::CloneModule(pModule->mSourceIR);
+	lateM->setModuleIdentifier(pModule->M->getModuleIdentifier() + nameSuffix);
+	return lateM;
+}
+
+// Create the late module with the bodies of the module only for inlining, the calls not inlined go to
+// the JIT-ed functions of the module.
+static llvm::Module* CreateInliningModule(KSC_ModuleDesc* pModule, const std::string& nameSuffix)
+{
+	llvm::Module* lateM = CreateLateModule(pModule, nameSuffix);
+	for (llvm::Module::iterator F = lateM->begin(); F != lateM->end(); ++F) {
+		if (!F->isDeclaration())
+			F->setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+	}
+	return lateM;
+}
+
+// Pass "kOptNone" for the late module optimized by the caller already.
+static void EmitLateModule(KSC_ModuleDesc* pModule, llvm::Module* lateM, SC::OptLevel optLevel)
+{
+	if (optLevel != SC::kOptNone && !SC::CG_Context::TheObjectCache->PinObject(lateM))
+		SC::CG_Context::OptimizeModule(lateM, optLevel);
+
+	pModule->mpEngine->addModule(std::unique_ptr<llvm::Module>(lateM));
+	pModule->mLateModules.push_back(lateM);
+	pModule->mpEngine->generateCodeForModule(lateM);
+	pModule->mpEngine->finalizeObject();
+}
+
+static bool TierUpModule(KSC_ModuleDesc* pModule)
+{
+	if (pModule->mTierUpM || !pModule->mSourceIR || !IsTieredModule(pModule))
+		return true;
+
+	// The optimized tier is added as another module, its entries are renamed and the rest of its
+	// functions are internalized so that they don't clash with the ones of the unoptimized tier.
+	llvm::Module* lateM = CreateLateModule(pModule, "_tier1");
+
+	std::hash_map<std::string, KSC_FunctionDesc*>::iterator it = pModule->mFunctionDesc.begin();
+	for (; it != pModule->mFunctionDesc.end(); ++it) {
+		if (!it->second->pTierSlot)
+			continue;
+		llvm::Function* entryF = lateM->getFunction(it->second->mEntryName);
+		if (entryF)
+			entryF->setName(it->second->mEntryName + ".tier1");
+	}
+	for (llvm::Module::iterator F = lateM->begin(); F != lateM->end(); ++F) {
+		if (!F->isDeclaration() && !F->hasAvailableExternallyLinkage() && !F->getName().endswith(".tier1"))
+			F->setLinkage(llvm::GlobalValue::InternalLinkage);
+	}
+
+	EmitLateModule(pModule, lateM, pModule->mOptions.optLevel);
+	pModule->mTierUpM = lateM;
+
+	// Redirect the stubs, the callers holding the JIT-ed pointers pick up the optimized code from now on.
+	for (it = pModule->mFunctionDesc.begin(); it != pModule->mFunctionDesc.end(); ++it) {
+		KSC_FunctionDesc* pFuncDesc = it->second;
+		if (!pFuncDesc->pTierSlot)
+			continue;
+		void* pOptFunc = (void*)pModule->mpEngine->getFunctionAddress(pFuncDesc->mEntryName + ".tier1");
+		if (pOptFunc)
+			*(void* volatile*)pFuncDesc->pTierSlot = pOptFunc;
+	}
+	return true;
+}
+
+// This function is called by the JIT-ed tier-up stubs, possibly from any thread of the hosting application.
+static void __ksc_request_tier_up(void* pSlot)
+{
+	KSC_ModuleDesc* pModule = NULL;
+	{
+		std::lock_guard<std::mutex> lock(s_tierSlotMutex);
+		std::map<void*, KSC_ModuleDesc*>::iterator it = s_tierSlots.find(pSlot);
+		if (it != s_tierSlots.end())
+			pModule = it->second;
+	}
+	if (pModule) {
+		KSC_Context* pCtx = pModule->pContext;
+		pCtx->jitWorker.Post([=]() {
+			ContextScope scope(pCtx);
+			TierUpModule(pModule);
+		});
+	}
+}
+
+static void UnregisterTierSlots(KSC_ModuleDesc* pModule)
+{
+	std::lock_guard<std::mutex> lock(s_tierSlotMutex);
+	std::hash_map<std::string, KSC_FunctionDesc*>::iterator it = pModule->mFunctionDesc.begin();
+	for (; it != pModule->mFunctionDesc.end(); ++it) {
+		if (it->second->pTierSlot)
+			s_tierSlots.erase(it->second->pTierSlot);
+	}
+}
+
+static void EmitPredefineCode(KSC_Context* pCtx)
+{
+	// The shared code is emitted by the engine of the context before any module engine resolves its symbols, 
+	// otherwise MCJIT would emit it on the symbol lookup without the optimization.
+	KSC_ModuleDesc* pPredefineModule = pCtx->pPredefineModule;
+	if (pPredefineModule && !pPredefineModule->mCodeEmitted) {
+		if (!SC::CG_Context::TheObjectCache->PinObject(pPredefineModule->M))
+			SC::CG_Context::OptimizeModule(pPredefineModule->M, pPredefineModule->mOptions.optLevel);
+		SC::CG_Context::TheExecutionEngine()->generateCodeForModule(pPredefineModule->M);
+		SC::CG_Context::TheExecutionEngine()->finalizeObject();
+		pPredefineModule->mCodeEmitted = true;
+	}
+}
+
+static void SetStructContext(KSC_StructDesc* pStructDesc, KSC_Context* pCtx)
+{
+	pStructDesc->pContext = pCtx;
+	for (size_t i = 0; i < pStructDesc->size(); ++i) {
+		if ((*pStructDesc)[i].hStruct)
+			SetStructContext((KSC_StructDesc*)(*pStructDesc)[i].hStruct, pCtx);
+	}
+}
+
+// The comparison of the function table entries with the names, in both orders for the debug checks of the STL.
+struct FunctionNameLess
+{
+	bool operator()(const std::pair<std::string, KSC_FunctionDesc*>& l, const char* r) const { return strcmp(l.first.c_str(), r) < 0; }
+	bool operator()(const char* l, const std::pair<std::string, KSC_FunctionDesc*>& r) const { return strcmp(l, r.first.c_str()) < 0; }
+	bool operator()(const std::pair<std::string, KSC_FunctionDesc*>& l, const std::pair<std::string, KSC_FunctionDesc*>& r) const { return l.first < r.first; }
+};
+
+static void BuildFunctionTable(KSC_ModuleDesc* pModule)
+{
+	pModule->mFunctionTable.assign(pModule->mFunctionDesc.begin(), pModule->mFunctionDesc.end());
+	std::sort(pModule->mFunctionTable.begin(), pModule->mFunctionTable.end(), FunctionNameLess());
+}
+
+static KSC_FunctionDesc* FindFunction(const KSC_ModuleDesc* pModule, const char* funcName)
+{
+	std::vector<std::pair<std::string, KSC_FunctionDesc*> >::const_iterator it = 
+		std::lower_bound(pModule->mFunctionTable.begin(), pModule->mFunctionTable.end(), funcName, FunctionNameLess());
+	if (it != pModule->mFunctionTable.end() && it->first == funcName)
+		return it->second;
+	return NULL;
+}
+
+// Record the owning context in the module and its structure descriptions, so the APIs taking their handles
+// work on the right context. The function table is built here as well, the module is complete by then.
+static void SetModuleContext(KSC_ModuleDesc* pModule, KSC_Context* pCtx)
+{
+	BuildFunctionTable(pModule);
+	pModule->pContext = pCtx;
+	std::hash_map<std::string, KSC_StructDesc*>::iterator it_struct = pModule->mGlobalStructures.begin();
+	for (; it_struct != pModule->mGlobalStructures.end(); ++it_struct)
+		SetStructContext(it_struct->second, pCtx);
+
+	std::hash_map<std::string, KSC_FunctionDesc*>::iterator it_func = pModule->mFunctionDesc.begin();
+	for (; it_func != pModule->mFunctionDesc.end(); ++it_func) {
+		std::vector<KSC_TypeInfo>& argTypes = it_func->second->mArgumentTypes;
+		for (size_t i = 0; i < argTypes.size(); ++i) {
+			if (argTypes[i].hStruct)
+				SetStructContext((KSC_StructDesc*)argTypes[i].hStruct, pCtx);
+		}
+	}
+}
+
 static void SplitStringByDot(const char* inStr, std::vector<std::string>& outStrings)
 {
 	const char* pCur = inStr;
@@ -32,11 +317,151 @@ static void SplitStringByDot(const char* inStr, std::vector<std::string>& outStr
 	}
 }
 
-bool KSC_Initialize(const char* sharedCode)
+static void RegisterBuiltInSymbols()
+{
+	// sin, cos, pow, sqrt and fabs are lowered to the LLVM intrinsics, the code generator turns the ones 
+	// without native instructions into calls to the C runtime functions, which are resolved here.
+	s_externalSymbols["sinf"] = sinf;
+	s_externalSymbols["cosf"] = cosf;
+	s_externalSymbols["powf"] = powf;
+	s_externalSymbols["sqrtf"] = sqrtf;
+	s_externalSymbols["fabsf"] = fabsf;
+	s_externalSymbols["ipow"] = __int_pow;
+	s_externalSymbols["asin"] = asinf;
+	s_externalSymbols["acos"] = acosf;
+	s_externalSymbols["__ksc_request_tier_up"] = __ksc_request_tier_up;
+}
+
+static void DestroyContext(KSC_Context* pCtx)
+{
+	for (size_t i = 0; i < pCtx->batchContexts.size(); ++i)
+		DestroyContext(pCtx->batchContexts[i]);
+	pCtx->batchContexts.clear();
+	{
+		std::unique_lock<std::mutex> lock(s_contextMutex);
+		s_contexts.remove(pCtx);
+		s_contextUpdateCond.wait(lock, [] { return s_contextUpdateCnt == 0; });
+	}
+	// The worker thread must be joined here, its destructor doesn't do that.
+	pCtx->jitWorker.Stop();
+	{
+		ContextScope scope(pCtx);
+		// The module engines resolve the shared code with the engine of the context, so they go first.
+		std::list<KSC_ModuleDesc*>::iterator it = pCtx->modules.begin();
+		for (; it != pCtx->modules.end(); ++it) {
+			UnregisterTierSlots(*it);
+			SC::DestroyCodeGenModule(**it);
+			delete *it;
+		}
+		pCtx->modules.clear();
+		delete pCtx->pPredefineModule;
+		pCtx->pPredefineModule = NULL;
+		delete pCtx->pPredefineDomain;
+		pCtx->pPredefineDomain = NULL;
+		pCtx->moduleHashCnt.clear();
+
+		SC::DestroyCodeGenState(pCtx->pCodeGen);
+		pCtx->pCodeGen = NULL;
+	}
+	delete pCtx;
+	SC::Finish_Tokenizer();
+}
+
+static KSC_Context* CreateContext(const char* sharedCode)
 {
 	SC::Initialize_Tokenizer();
-	bool ret = SC::InitializeCodeGen();
+	KSC_Context* pCtx = new KSC_Context;
+	if (sharedCode) {
+		pCtx->sharedCode = sharedCode;
+		pCtx->hasSharedCode = true;
+	}
+	{
+		std::lock_guard<std::mutex> lock(s_contextMutex);
+		std::call_once(s_builtInSymbolFlag, RegisterBuiltInSymbols);
+		pCtx->pCodeGen = SC::CreateCodeGenState(s_externalSymbols);
+		if (pCtx->pCodeGen)
+			s_contexts.push_back(pCtx);
+	}
+	if (!pCtx->pCodeGen) {
+		SetGlobalErrMsg("Failed to create the JIT execution engine.");
+		DestroyContext(pCtx);
+		return NULL;
+	}
 
+	bool ret = false;
+	{
+		ContextScope scope(pCtx);
+		SC::CompilingContext preContext(NULL);
+		const char* intrinsicFuncDecal = 
+			"float sin(float arg);\n"
+			"float cos(float arg);\n"
+			"float pow(float base, float exp);\n"
+			"int ipow(int base, int exp);\n"
+			"float sqrt(float arg);\n"
+			"float fabs(float arg);\n"
+			"float asin(float arg);\n"
+			"float acos(float arg);\n"
+			// The vector built-ins below are generated inline for the arguments of any width, the types 
+			// in these declarations are only nominal.
+			"float dot(float a, float b);\n"
+			"float3 cross(float3 a, float3 b);\n"
+			"float length(float v);\n"
+			"float normalize(float v);\n"
+			"float lerp(float a, float b, float t);\n"
+			"float saturate(float v);\n"
+			"float mad(float a, float b, float c);\n"
+			"float rsqrt(float v);\n"
+			"float min(float a, float b);\n"
+			"float max(float a, float b);\n"
+			"float clamp(float v, float lo, float hi);\n"
+			"bool any(bool v);\n"
+			"bool all(bool v);\n";
+
+		pCtx->pPredefineDomain = new SC::RootDomain(NULL);
+		bool parsed = preContext.ParsePartial(intrinsicFuncDecal, pCtx->pPredefineDomain);
+		if (parsed && sharedCode)
+			parsed = preContext.ParsePartial(sharedCode, pCtx->pPredefineDomain);
+
+		if (!parsed) {
+			std::string errMsg;
+			preContext.PrintErrorMessage(&errMsg);
+			SetGlobalErrMsg(errMsg);
+		}
+		else {
+			KSC_ModuleDesc* pPredefineModule = new KSC_ModuleDesc();
+			pPredefineModule->M = SC::CG_Context::TheModule();
+			{
+				llvm::MD5 hash;
+				hash.update(s_codeGenVersion);
+				hash.update(SC::GetCodeGenTargetDesc());
+				HashExternalSymbols(hash);
+				if (sharedCode)
+					hash.update(sharedCode);
+				HashCompileOptions(hash, pPredefineModule->mOptions);
+				pPredefineModule->M->setModuleIdentifier(MakeModuleName(pCtx, "ksc_predefine_", hash));
+			}
+			ret = pCtx->pPredefineDomain->CompileToIR(NULL, *pPredefineModule, &pCtx->predefineCtx);
+			if (ret) {
+				SetModuleContext(pPredefineModule, pCtx);
+				SC::SetSharedCodeModule(pPredefineModule->M);
+				pCtx->pPredefineModule = pPredefineModule;
+			}
+			else {
+				SetGlobalErrMsg("Failed to compile the shared code.");
+				// The predefined LLVM module is owned by the execution engine
+				delete pPredefineModule;
+			}
+		}
+	}
+	if (!ret) {
+		DestroyContext(pCtx);
+		return NULL;
+	}
+	return pCtx;
+}
+
+bool KSC_Initialize(const char* sharedCode)
+{
 	int CPUInfo[4];
 	__cpuid(CPUInfo, 0x80000000);
     int nExIds = CPUInfo[0];
@@ -55,100 +480,138 @@ bool KSC_Initialize(const char* sharedCode)
 
 
 	printf("KSC running on CPU %s.\n", CPUBrandString);
-	if (ret) {
-
-		SC::CompilingContext preContext(NULL);
-		const char* intrinsicFuncDecal = 
-			"float sin(float arg);\n"
-			"float cos(float arg);\n"
-			"float pow(float base, float exp);\n"
-			"int ipow(int base, int exp);\n"
-			"float sqrt(float arg);\n"
-			"float fabs(float arg);\n"
-			"float asin(float arg);\n"
-			"float acos(float arg);\n";
-
-		KSC_AddExternalFunction("sin", sinf);
-		KSC_AddExternalFunction("cos", cosf);
-		KSC_AddExternalFunction("pow", powf);
-		KSC_AddExternalFunction("ipow", __int_pow);
-		KSC_AddExternalFunction("sqrt", sqrtf);
-		KSC_AddExternalFunction("fabs", fabsf);
-		KSC_AddExternalFunction("asin", asinf);
-		KSC_AddExternalFunction("acos", acosf);
-
-		s_predefineDomain = new SC::RootDomain(NULL);
-		if (!preContext.ParsePartial(intrinsicFuncDecal, s_predefineDomain))
-			return false;
+	if (s_pDefaultContext)
+		return true;
+	s_pDefaultContext = CreateContext(sharedCode);
+	return s_pDefaultContext != NULL;
+}
 
-		if (sharedCode) {
-			if (!preContext.ParsePartial(sharedCode, s_predefineDomain))
-				return false;
-		}
 
-		s_predefineModule = new KSC_ModuleDesc();
-		ret = s_predefineDomain->CompileToIR(NULL, *s_predefineModule, &s_predefineCtx);
-		if (ret)
-			return true;
-		else {
-			delete s_predefineModule;
-			s_predefineModule = NULL;
-			return false;
-		}
+void KSC_Destory()
+{
+	if (s_pDefaultContext) {
+		DestroyContext(s_pDefaultContext);
+		s_pDefaultContext = NULL;
 	}
-	else
-		return false;
+	// The pool is started again by the next dispatch if there's any.
+	s_dispatchPool.Stop();
 }
 
+KSC_ContextHandle KSC_CreateContext(const char* sharedCode)
+{
+	return CreateContext(sharedCode);
+}
 
-void KSC_Destory()
+void KSC_DestroyContext(KSC_ContextHandle hContext)
 {
-	std::list<KSC_ModuleDesc*>::iterator it = s_modules.begin();
-	for (; it != s_modules.end(); ++it) {
-		delete *it;
-	}
-	if (s_predefineModule) {
-		delete s_predefineModule;
-		s_predefineModule = NULL;
-	}
+	KSC_Context* pCtx = (KSC_Context*)hContext;
+	if (!pCtx)
+		return;
+	if (pCtx == s_pDefaultContext)
+		s_pDefaultContext = NULL;
+	DestroyContext(pCtx);
+}
 
-	SC::DestoryCodeGen();
-	SC::Finish_Tokenizer();
+const char* KSC_GetContextErrorMsg(KSC_ContextHandle hContext)
+{
+	KSC_Context* pCtx = (KSC_Context*)hContext;
+	return pCtx ? pCtx->lastErrMsg.c_str() : s_globalErrMsg;
+}
+
+KSC_ContextHandle KSC_GetDefaultContext()
+{
+	return s_pDefaultContext;
 }
 
 
 const char* KSC_GetLastErrorMsg()
 {
-	return s_lastErrMsg.c_str();
+	return KSC_GetContextErrorMsg(s_pDefaultContext);
 }
 
 bool KSC_AddExternalFunction(const char* funcName, void* funcPtr)
 {
-	SC::CG_Context::TheSymbolMemMgr->mGlobalFuncSymbols[funcName] = funcPtr;
+	std::list<KSC_Context*> contexts;
+	{
+		std::lock_guard<std::mutex> lock(s_contextMutex);
+		std::call_once(s_builtInSymbolFlag, RegisterBuiltInSymbols);
+		s_externalSymbols[funcName] = funcPtr;
+		contexts = s_contexts;
+		++s_contextUpdateCnt;
+	}
+	// The contexts already created resolve it as well, though the modules compiled before don't see it.
+	// Each context is locked without holding the list mutex, so a context busy compiling doesn't block the
+	// creation and destroy of the others.
+	std::list<KSC_Context*>::iterator it = contexts.begin();
+	for (; it != contexts.end(); ++it) {
+		ContextScope scope(*it);
+		SC::CG_Context::TheSymbolMemMgr()->mGlobalFuncSymbols[funcName] = funcPtr;
+	}
+	{
+		std::lock_guard<std::mutex> lock(s_contextMutex);
+		--s_contextUpdateCnt;
+	}
+	s_contextUpdateCond.notify_all();
 	return true;
 }
 
-ModuleHandle KSC_Compile(const char* sourceCode)
+bool KSC_SetTargetCPU(const char* cpuName, const char* features)
 {
+	if (!SC::SetCodeGenTarget(cpuName, features)) {
+		SetGlobalErrMsg("The target CPU must be set before any KSC context is created.");
+		if (s_pDefaultContext) {
+			ContextScope scope(s_pDefaultContext);
+			s_pDefaultContext->lastErrMsg = s_globalErrMsg;
+		}
+		return false;
+	}
+	return true;
+}
+
+ModuleHandle KSC_CompileInContext(KSC_ContextHandle hContext, const char* sourceCode, const KSC_CompileOptions* pOptions)
+{
+	KSC_Context* pCtx = (KSC_Context*)hContext;
+	if (!pCtx)
+		return NULL;
 #ifdef WANT_MEM_LEAK_CHECK
 	size_t expInstCnt = SC::Expression::s_instances.size();
 #endif	
+	ContextScope scope(pCtx);
 
 	KSC_ModuleDesc* ret = NULL;
 	{
 		KSC_ModuleDesc* pModuleDesc = new KSC_ModuleDesc;
+		if (pOptions)
+			pModuleDesc->mOptions = *pOptions;
 		SC::CompilingContext scContext(NULL);
-		std::auto_ptr<SC::RootDomain> scDomain(scContext.Parse(sourceCode, s_predefineDomain));
+		std::auto_ptr<SC::RootDomain> scDomain(scContext.Parse(sourceCode, pCtx->pPredefineDomain));
 		if (scDomain.get() == NULL) {
-			scContext.PrintErrorMessage(&s_lastErrMsg);
+			scContext.PrintErrorMessage(&pCtx->lastErrMsg);
+			delete pModuleDesc;
 		}
 		else {
-			if (!scDomain->CompileToIR(&s_predefineCtx, *pModuleDesc)) {
+			// Each module gets its own LLVM module so the JIT cost only depends on the code of this module,
+			// the shared code is referenced by declarations.
+			// The shared code and the target are part of the predefine module name.
+			llvm::MD5 hash;
+			hash.update(pCtx->pPredefineModule->M->getModuleIdentifier());
+			HashExternalSymbols(hash);
+			hash.update(sourceCode);
+			HashCompileOptions(hash, pModuleDesc->mOptions);
+			pModuleDesc->M = SC::CreateCodeGenModule(MakeModuleName(pCtx, "ksc_", hash));
+			if (!scDomain->CompileToIR(&pCtx->predefineCtx, *pModuleDesc)) {
+				delete pModuleDesc->M;
 				delete pModuleDesc;
-				s_lastErrMsg = "Failed to compile.";
+				pCtx->lastErrMsg = "Failed to compile.";
+			}
+			else if (!(pModuleDesc->mpEngine = SC::CreateModuleEngine(pModuleDesc->M))) {
+				// The module is freed by the failed engine creation
+				delete pModuleDesc;
+				pCtx->lastErrMsg = "Failed to create the JIT execution engine.";
 			}
 			else{
-				s_modules.push_back(pModuleDesc);
+				SetModuleContext(pModuleDesc, pCtx);
+				pCtx->modules.push_back(pModuleDesc);
 				ret = pModuleDesc;
 			}
 		}
@@ -160,73 +623,689 @@ ModuleHandle KSC_Compile(const char* sourceCode)
 	return ret;
 }
 
-ModuleHandle KSC_CompileFile(const char* srcFileName)
+ModuleHandle KSC_Compile(const char* sourceCode, const KSC_CompileOptions* pOptions)
+{
+	return KSC_CompileInContext(s_pDefaultContext, sourceCode, pOptions);
+}
+
+bool KSC_SetObjectCacheDir(const char* dirName)
+{
+	if (!SC::CG_Context::TheObjectCache->SetCacheDir(dirName ? dirName : "")) {
+		SetGlobalErrMsg("Failed to create the object cache directory.");
+		if (s_pDefaultContext) {
+			ContextScope scope(s_pDefaultContext);
+			s_pDefaultContext->lastErrMsg = s_globalErrMsg;
+		}
+		return false;
+	}
+	return true;
+}
+
+void KSC_GetObjectCacheStats(int& hits, int& misses)
+{
+	SC::CG_Context::TheObjectCache->GetStats(hits, misses);
+}
+
+void KSC_ReleaseModule(ModuleHandle hModule)
+{
+	KSC_ModuleDesc* pModule = (KSC_ModuleDesc*)hModule;
+	if (!pModule || pModule == pModule->pContext->pPredefineModule)
+		return;
+
+	// The pending asynchronous JIT requests might refer to this module
+	KSC_Context* pCtx = pModule->pContext;
+	pCtx->jitWorker.Flush();
+	ContextScope scope(pCtx);
+	pCtx->modules.remove(pModule);
+	UnregisterTierSlots(pModule);
+	SC::DestroyCodeGenModule(*pModule);
+	delete pModule;
+}
+
+static bool ReadSourceFile(const char* srcFileName, std::vector<char>& content)
 {
 	FILE* f = NULL;
 	fopen_s(&f, srcFileName, "r");
 	if (f == NULL)
-		return NULL;
+		return false;
 	fseek(f, 0, SEEK_END);
 	long len = ftell(f);
 	fseek(f, 0, SEEK_SET);
 
-	std::vector<char> content(len + 1);
+	content.resize(len + 1);
 	content[0] = '\0';
 	size_t readSize = fread(&content.front(), 1, len, f);
 	fclose(f);
 	if (readSize > 0) {
 		content[readSize] = '\0';
-		return KSC_Compile(&content.front());
+		return true;
 	}
 	else
+		return false;
+}
+
+ModuleHandle KSC_CompileFileInContext(KSC_ContextHandle hContext, const char* srcFileName, const KSC_CompileOptions* pOptions)
+{
+	std::vector<char> content;
+	if (!ReadSourceFile(srcFileName, content))
 		return NULL;
+	return KSC_CompileInContext(hContext, &content.front(), pOptions);
+}
+
+ModuleHandle KSC_CompileFile(const char* srcFileName, const KSC_CompileOptions* pOptions)
+{
+	return KSC_CompileFileInContext(s_pDefaultContext, srcFileName, pOptions);
+}
+
+static bool FinalizeModule(KSC_ModuleDesc* pModule, const KSC_FunctionDesc* pDumpFunc);
+
+// Compile and JIT one item of the batch in the context, the error message is recorded for the failed item.
+static ModuleHandle CompileBatchItem(KSC_Context* pCtx, const char* source, bool isFile, const KSC_CompileOptions* pOptions, std::string& outErrMsg)
+{
+	std::vector<char> content;
+	if (isFile) {
+		if (!ReadSourceFile(source, content)) {
+			outErrMsg = std::string("Failed to read the source file: ") + source;
+			return NULL;
+		}
+		source = &content.front();
+	}
+
+	KSC_ModuleDesc* pModule = NULL;
+	bool isFinalized = false;
+	{
+		ContextScope scope(pCtx);
+		pModule = (KSC_ModuleDesc*)KSC_CompileInContext(pCtx, source, pOptions);
+		isFinalized = pModule && FinalizeModule(pModule, NULL);
+		if (!isFinalized)
+			outErrMsg = pCtx->lastErrMsg;
+	}
+	// The release waits for the JIT worker of the context, so it must not hold the context lock.
+	if (pModule && !isFinalized) {
+		KSC_ReleaseModule(pModule);
+		pModule = NULL;
+	}
+	return pModule;
+}
+
+static int CompileBatch(KSC_Context* pCtx, const char** sources, bool isFile, int count, int threads, 
+						ModuleHandle* outHandles, const char** outErrors, const KSC_CompileOptions* pOptions)
+{
+	if (count <= 0)
+		return 0;
+	if (!pCtx) {
+		std::fill(outHandles, outHandles + count, (ModuleHandle)NULL);
+		if (outErrors)
+			std::fill(outErrors, outErrors + count, "KSC is not initialized.");
+		return 0;
+	}
+	if (threads <= 0)
+		threads = (int)std::thread::hardware_concurrency();
+	threads = std::max(1, std::min(threads, count));
+
+	std::lock_guard<std::mutex> batchLock(pCtx->batchMutex);
+	// The LLVM objects of one context are used by one thread at a time, so every worker thread needs its own
+	// context. The first worker uses this context, the rest reuse the helper contexts of the previous batches.
+	while ((int)pCtx->batchContexts.size() < threads - 1) {
+		KSC_Context* pHelperCtx = CreateContext(pCtx->hasSharedCode ? pCtx->sharedCode.c_str() : NULL);
+		if (!pHelperCtx)
+			break;
+		pCtx->batchContexts.push_back(pHelperCtx);
+	}
+	threads = std::min(threads, (int)pCtx->batchContexts.size() + 1);
+
+	std::vector<std::string>& errMsgs = pCtx->batchErrMsgs;
+	errMsgs.assign(count, std::string());
+	// The items are handed out one at a time, so the workers stay busy even if the sources differ a lot in size.
+	std::atomic<int> nextItem(0);
+	std::atomic<int> succeeded(0);
+	auto worker = [&](KSC_Context* pWorkerCtx) {
+		for (int i = nextItem++; i < count; i = nextItem++) {
+			outHandles[i] = CompileBatchItem(pWorkerCtx, sources[i], isFile, pOptions, errMsgs[i]);
+			if (outHandles[i])
+				++succeeded;
+		}
+	};
+
+	std::vector<std::thread> workerThreads;
+	for (int t = 1; t < threads; ++t)
+		workerThreads.push_back(std::thread(worker, pCtx->batchContexts[t - 1]));
+	worker(pCtx);
+	for (size_t t = 0; t < workerThreads.size(); ++t)
+		workerThreads[t].join();
+
+	if (outErrors) {
+		for (int i = 0; i < count; ++i)
+			outErrors[i] = outHandles[i] ? NULL : errMsgs[i].c_str();
+	}
+	return succeeded;
+}
+
+int KSC_CompileBatchInContext(KSC_ContextHandle hContext, const char** sources, int count, int threads, 
+							  ModuleHandle* outHandles, const char** outErrors, const KSC_CompileOptions* pOptions)
+{
+	return CompileBatch((KSC_Context*)hContext, sources, false, count, threads, outHandles, outErrors, pOptions);
+}
+
+int KSC_CompileFileBatchInContext(KSC_ContextHandle hContext, const char** srcFileNames, int count, int threads, 
+								  ModuleHandle* outHandles, const char** outErrors, const KSC_CompileOptions* pOptions)
+{
+	return CompileBatch((KSC_Context*)hContext, srcFileNames, true, count, threads, outHandles, outErrors, pOptions);
+}
+
+int KSC_CompileBatch(const char** sources, int count, int threads, ModuleHandle* outHandles, 
+					 const char** outErrors, const KSC_CompileOptions* pOptions)
+{
+	return KSC_CompileBatchInContext(s_pDefaultContext, sources, count, threads, outHandles, outErrors, pOptions);
+}
+
+int KSC_CompileFileBatch(const char** srcFileNames, int count, int threads, ModuleHandle* outHandles, 
+						 const char** outErrors, const KSC_CompileOptions* pOptions)
+{
+	return KSC_CompileFileBatchInContext(s_pDefaultContext, srcFileNames, count, threads, outHandles, outErrors, pOptions);
+}
+
+// JIT the module in parts on multiple threads, the execution engine of the module links the object code of the parts.
+static bool EmitPartitionedModule(KSC_ModuleDesc* pModule, const std::vector<std::pair<KSC_FunctionDesc*, llvm::Function*> >& wrappers)
+{
+	// Keep every wrapper next to its function, so they go to the same part and the function can be inlined.
+	llvm::Module::FunctionListType& funcList = pModule->M->getFunctionList();
+	for (size_t i = 0; i < wrappers.size(); ++i) {
+		llvm::Function* F = wrappers[i].first->F;
+		llvm::Function* wrapperF = wrappers[i].second;
+		if (wrapperF == F)
+			continue;
+		funcList.remove(wrapperF);
+		funcList.insertAfter(llvm::Module::iterator(F), wrapperF);
+	}
+
+	std::vector<std::string> partObjs;
+	if (!SC::EmitModulePartitions(pModule->M, pModule->mOptions.codeGenThreads, pModule->mOptions.optLevel, partObjs)) {
+		pModule->pContext->lastErrMsg = "Failed to generate the object code.";
+		return false;
+	}
+	std::vector<std::unique_ptr<llvm::MemoryBuffer> > objBuffers;
+	std::vector<std::unique_ptr<llvm::object::ObjectFile> > objFiles;
+	for (size_t i = 0; i < partObjs.size(); ++i) {
+		objBuffers.push_back(std::unique_ptr<llvm::MemoryBuffer>(
+			llvm::MemoryBuffer::getMemBufferCopy(partObjs[i], pModule->M->getModuleIdentifier())));
+		llvm::ErrorOr<std::unique_ptr<llvm::object::ObjectFile> > objFile = 
+			llvm::object::ObjectFile::createObjectFile(objBuffers.back()->getMemBufferRef());
+		if (!objFile) {
+			pModule->pContext->lastErrMsg = "Failed to generate the object code.";
+			return false;
+		}
+		objFiles.push_back(std::move(*objFile));
+	}
+
+	// The module itself is not JIT-ed, otherwise the execution engine would emit it again on finalizing the parts.
+	EmitPredefineCode(pModule->pContext);
+	pModule->mpEngine->removeModule(pModule->M);
+	pModule->mPartitionCnt = (int)partObjs.size();
+	for (size_t i = 0; i < objFiles.size(); ++i) {
+		pModule->mpEngine->addObjectFile(
+			llvm::object::OwningBinary<llvm::object::ObjectFile>(std::move(objFiles[i]), std::move(objBuffers[i])));
+	}
+	pModule->mpEngine->finalizeObject();
+	return true;
+}
+
+static bool FinalizeModule(KSC_ModuleDesc* pModule, const KSC_FunctionDesc* pDumpFunc)
+{
+	if (pModule->mCodeEmitted)
+		return true;
+
+	// MCJIT emits a module only once, so the wrappers of all the functions are created and
+	// optimized first, then the whole module is emitted and relocated in a single codegen pass.
+	std::vector<std::pair<KSC_FunctionDesc*, llvm::Function*> > wrappers;
+	std::hash_map<std::string, KSC_FunctionDesc*>::iterator it = pModule->mFunctionDesc.begin();
+	for (; it != pModule->mFunctionDesc.end(); ++it) {
+		KSC_FunctionDesc* pFuncDesc = it->second;
+		if (!pFuncDesc->F)
+			continue;
+		llvm::Function* wrapperF = SC::CG_Context::CreateFunctionWithPackedArguments(*pFuncDesc);
+		pFuncDesc->mEntryName = wrapperF->getName();
+		wrappers.push_back(std::make_pair(pFuncDesc, wrapperF));
+
+		if (pFuncDesc == pDumpFunc) {
+			printf("------------- Function before JIT wrapping ------------------------\n");
+			pFuncDesc->F->dump();
+			if (pFuncDesc->F != wrapperF) {
+				printf("------------- Function after JIT wrapping ------------------------\n");
+				wrapperF->dump();
+			}
+		}
+	}
+
+	if (llvm::verifyModule(*pModule->M)) {
+		pModule->pContext->lastErrMsg = "Failed to verify the generated code.";
+		return false;
+	}
+
+	// The cached object is read once and kept for MCJIT, so it cannot go away after the optimization is skipped.
+	bool isCached = SC::CG_Context::TheObjectCache->PinObject(pModule->M);
+	// Make the bodies of the shared code visible to the inliner.
+	if (!isCached && pModule->mOptions.optLevel >= SC::kOptDefault) {
+		if (!SC::ImportSharedCode(pModule->M)) {
+			pModule->pContext->lastErrMsg = "Failed to import the shared code.";
+			return false;
+		}
+	}
+
+	pModule->mSourceIR = llvm::CloneModule(pModule->M);
+
+	// The tiered module is JIT-ed without optimization first, the callers go through the tier-up stubs.
+	bool isTiered = IsTieredModule(pModule);
+	std::vector<std::string> entryNames(wrappers.size());
+	std::vector<std::string> slotNames(wrappers.size());
+	for (size_t i = 0; i < wrappers.size(); ++i)
+		entryNames[i] = wrappers[i].second->getName();
+	if (isTiered) {
+		for (size_t i = 0; i < wrappers.size(); ++i) {
+			llvm::Function* stubF = SC::CG_Context::CreateTierUpStub(wrappers[i].second, pModule->mOptions.tierUpThreshold, slotNames[i]);
+			entryNames[i] = stubF->getName();
+		}
+	}
+
+	// The dumped function is optimized in place, so the module to dump is not partitioned.
+	if (!isTiered && !pDumpFunc && pModule->mOptions.codeGenThreads > 1) {
+		if (!EmitPartitionedModule(pModule, wrappers))
+			return false;
+	}
+	else {
+		// The cached object is already optimized
+		if (!isCached)
+			SC::CG_Context::OptimizeModule(pModule->M, isTiered ? SC::kOptNone : pModule->mOptions.optLevel);
+
+		for (size_t i = 0; i < wrappers.size(); ++i) {
+			if (wrappers[i].first == pDumpFunc) {
+				printf("------------- Function after optimization ------------------------\n");
+				wrappers[i].second->dump();
+			}
+		}
+
+		EmitPredefineCode(pModule->pContext);
+		pModule->mpEngine->generateCodeForModule(pModule->M);
+		pModule->mpEngine->finalizeObject();
+	}
+	pModule->mCodeEmitted = true;
+
+	for (size_t i = 0; i < wrappers.size(); ++i) {
+		KSC_FunctionDesc* pFuncDesc = wrappers[i].first;
+		// The tier slot is registered before the pointer is published, the first call might request the tier-up.
+		if (isTiered) {
+			pFuncDesc->pTierSlot = (void**)pModule->mpEngine->getGlobalValueAddress(slotNames[i]);
+			std::lock_guard<std::mutex> lock(s_tierSlotMutex);
+			s_tierSlots[pFuncDesc->pTierSlot] = pModule;
+		}
+		void* pFunc = (void*)pModule->mpEngine->getFunctionAddress(entryNames[i]);
+		pFuncDesc->pJIT_Func.store(pFunc, std::memory_order_release);
+	}
+	return true;
 }
 
 void* KSC_GetFunctionPtr(FunctionHandle hFunc, bool bDump)
 {
 	KSC_FunctionDesc* pFuncDesc = (KSC_FunctionDesc*)hFunc;
-	if (!pFuncDesc || !pFuncDesc->F)
+	if (!pFuncDesc)
 		return NULL;
 
-	if (pFuncDesc->pJIT_Func)
-		return pFuncDesc->pJIT_Func;
+	// The published pointer is returned without waiting for the JIT of other modules in the context.
+	// The functions loaded from module binary have no IR but only the JIT-ed pointer.
+	void* pFunc = pFuncDesc->pJIT_Func.load(std::memory_order_acquire);
+	if (pFunc)
+		return pFunc;
 
-	llvm::Function* wrapperF = SC::CG_Context::CreateFunctionWithPackedArguments(*pFuncDesc);
+	ContextScope scope(pFuncDesc->pModule->pContext);
+	if (!pFuncDesc->F)
+		return pFuncDesc->pJIT_Func.load(std::memory_order_relaxed);
 
-	if (bDump) {
-		printf("------------- Function before JIT wrapping ------------------------\n");
-		pFuncDesc->F->dump();
+	if (!FinalizeModule(pFuncDesc->pModule, bDump ? pFuncDesc : NULL))
+		return NULL;
+	return pFuncDesc->pJIT_Func.load(std::memory_order_relaxed);
+}
+
+bool KSC_GetFunctionPtrAsync(FunctionHandle hFunc, KSC_JITCallback callback, void* userData)
+{
+	KSC_FunctionDesc* pFuncDesc = (KSC_FunctionDesc*)hFunc;
+	if (!pFuncDesc || (!pFuncDesc->F && !pFuncDesc->pJIT_Func))
+		return false;
+
+	pFuncDesc->pModule->pContext->jitWorker.Post([=]() {
+		void* pFunc = KSC_GetFunctionPtr(hFunc, false);
+		// The callback is invoked without holding the lock so that it is free to call other KSC APIs
+		if (callback)
+			callback(hFunc, pFunc, userData);
+	});
+	return true;
+}
+
+void* KSC_TryGetFunctionPtr(FunctionHandle hFunc)
+{
+	KSC_FunctionDesc* pFuncDesc = (KSC_FunctionDesc*)hFunc;
+	if (!pFuncDesc)
+		return NULL;
+
+	// Never wait for the module being JIT-ed by another thread
+	return pFuncDesc->pJIT_Func.load(std::memory_order_acquire);
+}
+
+bool KSC_FinalizeModule(ModuleHandle hModule)
+{
+	KSC_ModuleDesc* pModule = (KSC_ModuleDesc*)hModule;
+	if (!pModule)
+		return false;
+	ContextScope scope(pModule->pContext);
+	return FinalizeModule(pModule, NULL);
+}
+
+bool KSC_GetFunctionPtrs(ModuleHandle hModule, const char** funcNames, int count, void** outPtrs)
+{
+	KSC_ModuleDesc* pModule = (KSC_ModuleDesc*)hModule;
+	if (!pModule)
+		return false;
+	ContextScope scope(pModule->pContext);
+	if (!FinalizeModule(pModule, NULL))
+		return false;
+
+	bool ret = true;
+	for (int i = 0; i < count; ++i) {
+		KSC_FunctionDesc* pFuncDesc = FindFunction(pModule, funcNames[i]);
+		outPtrs[i] = pFuncDesc ? pFuncDesc->pJIT_Func.load(std::memory_order_relaxed) : NULL;
+		if (!outPtrs[i]) {
+			pModule->pContext->lastErrMsg = "Function not found: ";
+			pModule->pContext->lastErrMsg += funcNames[i];
+			ret = false;
+		}
 	}
-	if (bDump && pFuncDesc->F != wrapperF) {
-		printf("------------- Function after JIT wrapping ------------------------\n");
-		wrapperF->dump();
+	return ret;
+}
+
+void* KSC_GetKernelPtr(FunctionHandle hFunc, int width)
+{
+	KSC_FunctionDesc* pFuncDesc = (KSC_FunctionDesc*)hFunc;
+	if (!pFuncDesc)
+		return NULL;
+	if (width <= 0)
+		width = KSC_GetSIMDWidth();
+
+	KSC_ModuleDesc* pModule = pFuncDesc->pModule;
+	ContextScope scope(pModule->pContext);
+	std::map<int, void*>::iterator it = pFuncDesc->mKernelPtrs.find(width);
+	if (it != pFuncDesc->mKernelPtrs.end())
+		return it->second;
+
+	if (!pFuncDesc->F || !pModule->M) {
+		pModule->pContext->lastErrMsg = "The kernel can only be created for the function with IR.";
+		return NULL;
+	}
+	// The kernel module only carries the function bodies for inlining, the functions must be JIT-ed already
+	if (!FinalizeModule(pModule, NULL))
+		return NULL;
+
+	std::string funcName = pFuncDesc->F->getName();
+	char widthStr[32];
+	sprintf_s(widthStr, ".kernel%d", width);
+	llvm::Module* lateM = CreateInliningModule(pModule, std::string("_") + funcName + widthStr);
+	llvm::Function* kernelF = lateM->getFunction(funcName);
+	kernelF->addFnAttr(llvm::Attribute::AlwaysInline);
+	std::string driverName = funcName + widthStr;
+	if (!SC::CG_Context::CreateKernelDriver(kernelF, *pFuncDesc, width, driverName)) {
+		pModule->pContext->lastErrMsg = "The kernel only supports the scalar and structure arguments and return value.";
+		delete lateM;
+		return NULL;
 	}
 
-	if (!llvm::verifyFunction(*wrapperF)) {
-		SC::CG_Context::TheFPM->run(*wrapperF);
-		if (bDump) {
-			printf("------------- Function after FPM optimization ------------------------\n");
-			wrapperF->dump();
+	// The vectorizers are needed regardless of the optimization level of the module. The kernel no wider than
+	// the scalar calls is rejected, the cached object has passed the check when it was generated.
+	if (!SC::CG_Context::TheObjectCache->PinObject(lateM)) {
+		SC::CG_Context::OptimizeModule(lateM, pModule->mOptions.optLevel == SC::kOptAggressive ? SC::kOptAggressive : SC::kOptDefault);
+		if (!SC::CG_Context::IsKernelVectorized(lateM->getFunction(driverName), width)) {
+			pModule->pContext->lastErrMsg = "The function cannot be vectorized into the kernel, it might call the functions"
+				" that are not inlined or have the control flow that the vectorizer cannot convert.";
+			delete lateM;
+			return NULL;
 		}
-		void* ret = (void*)SC::CG_Context::TheExecutionEngine->getFunctionAddress(wrapperF->getName());
-		pFuncDesc->pJIT_Func = ret;
-		return ret;
 	}
+	EmitLateModule(pModule, lateM, SC::kOptNone);
+	void* pKernel = (void*)pModule->mpEngine->getFunctionAddress(driverName);
+	pFuncDesc->mKernelPtrs[width] = pKernel;
+	return pKernel;
+}
+
+static void* GetArrayDriver(KSC_FunctionDesc* pFuncDesc, const int* argStrides, int retStride, bool isRangeDriver)
+{
+	KSC_ModuleDesc* pModule = pFuncDesc->pModule;
+	ContextScope scope(pModule->pContext);
+	if (!pFuncDesc->F || !pModule->M) {
+		pModule->pContext->lastErrMsg = "The array driver can only be created for the function with IR.";
+		return NULL;
+	}
+	if (!FinalizeModule(pModule, NULL))
+		return NULL;
+
+	// The driver calls the entry with packed arguments, whose layout is the same as the hosting C++ code.
+	llvm::Function* entryF = pModule->mSourceIR->getFunction(pFuncDesc->mEntryName);
+	int dispatchIdArg = -1;
+	int Idx = 0;
+	for (llvm::Function::arg_iterator AI = pFuncDesc->F->arg_begin(); AI != pFuncDesc->F->arg_end(); ++AI, ++Idx) {
+		if (AI->getName() == KSC_DISPATCH_THREAD_ID)
+			dispatchIdArg = Idx;
+	}
+	std::vector<int> strides;
+	Idx = 0;
+	for (llvm::Function::arg_iterator AI = entryF->arg_begin(); AI != entryF->arg_end(); ++AI, ++Idx) {
+		llvm::Type* elemType = AI->getType()->isPointerTy() ? AI->getType()->getPointerElementType() : AI->getType();
+		// The dispatch thread ID is not read from memory
+		if (Idx == dispatchIdArg)
+			strides.push_back(0);
+		else
+			strides.push_back(argStrides ? argStrides[Idx] : (int)SC::CG_Context::TheDataLayout()->getTypeAllocSize(elemType));
+	}
+	llvm::Type* retType = entryF->getReturnType();
+	if (!retType->isVoidTy())
+		retStride = (retStride > 0 || retStride == KSC_SOA_STRIDE) ? retStride : (int)SC::CG_Context::TheDataLayout()->getTypeAllocSize(retType);
 	else
+		retStride = 0;
+	strides.push_back(retStride);
+
+	std::map<std::vector<int>, void*>& driverPtrs = isRangeDriver ? pFuncDesc->mDispatchDriverPtrs : pFuncDesc->mArrayDriverPtrs;
+	std::map<std::vector<int>, void*>::iterator it = driverPtrs.find(strides);
+	if (it != driverPtrs.end())
+		return it->second;
+
+	std::string driverName = pFuncDesc->mEntryName + (isRangeDriver ? ".dispatch" : ".array");
+	for (size_t i = 0; i < strides.size(); ++i) {
+		char strideStr[32];
+		if (strides[i] == KSC_SOA_STRIDE)
+			sprintf_s(strideStr, "_soa");
+		else
+			sprintf_s(strideStr, "_%d", strides[i]);
+		driverName += strideStr;
+	}
+	llvm::Module* lateM = CreateInliningModule(pModule, std::string("_") + driverName);
+	llvm::Function* lateEntryF = lateM->getFunction(pFuncDesc->mEntryName);
+	lateEntryF->addFnAttr(llvm::Attribute::AlwaysInline);
+	lateM->getFunction(pFuncDesc->F->getName())->addFnAttr(llvm::Attribute::AlwaysInline);
+	strides.pop_back();
+	if (!SC::CG_Context::CreateArrayDriver(lateEntryF, strides, retStride, dispatchIdArg, isRangeDriver, driverName)) {
+		pModule->pContext->lastErrMsg = "Only the structure arguments and return value can be in the SoA layout.";
+		delete lateM;
+		return NULL;
+	}
+	strides.push_back(retStride);
+
+	EmitLateModule(pModule, lateM, pModule->mOptions.optLevel == SC::kOptAggressive ? SC::kOptAggressive : SC::kOptDefault);
+	void* pDriver = (void*)pModule->mpEngine->getFunctionAddress(driverName);
+	driverPtrs[strides] = pDriver;
+	return pDriver;
+}
+
+void* KSC_GetArrayDriver(FunctionHandle hFunc, const int* argStrides, int retStride)
+{
+	KSC_FunctionDesc* pFuncDesc = (KSC_FunctionDesc*)hFunc;
+	if (!pFuncDesc)
 		return NULL;
+	return GetArrayDriver(pFuncDesc, argStrides, retStride, false);
 }
 
-FunctionHandle KSC_GetFunctionHandleByName(const char* funcName, ModuleHandle hModule)
+typedef void (*DispatchDriver)(void* const* ppBases, int begin, int end);
+
+bool KSC_Dispatch(FunctionHandle hFunc, int count, int grainSize, void* const* ppBases, const int* argStrides, int retStride)
+{
+	KSC_FunctionDesc* pFuncDesc = (KSC_FunctionDesc*)hFunc;
+	if (!pFuncDesc)
+		return false;
+	DispatchDriver pDriver = (DispatchDriver)GetArrayDriver(pFuncDesc, argStrides, retStride, true);
+	if (!pDriver)
+		return false;
+
+	// A few grains per thread leave room for stealing without paying much for the scheduling.
+	if (grainSize <= 0)
+		grainSize = std::max(count / (s_dispatchPool.GetConcurrency() * 8), 1);
+	s_dispatchPool.Dispatch(count, grainSize, [=](int begin, int end) {
+		pDriver(ppBases, begin, end);
+	});
+	return true;
+}
+
+bool KSC_SaveModuleBinary(ModuleHandle hModule, const char* fileName)
 {
 	KSC_ModuleDesc* pModule = (KSC_ModuleDesc*)hModule;
-	if (!pModule)
+	if (!pModule || pModule == pModule->pContext->pPredefineModule)
+		return false;
+
+	KSC_Context* pCtx = pModule->pContext;
+	ContextScope scope(pCtx);
+	if (!pModule->M) {
+		pCtx->lastErrMsg = "The module loaded from binary cannot be saved again.";
+		return false;
+	}
+	if (!FinalizeModule(pModule, NULL))
+		return false;
+
+	// For the tiered module, the optimized tier is saved. Its entries are the renamed ones.
+	const char* entrySuffix = "";
+	llvm::Module* srcM = pModule->M;
+	if (IsTieredModule(pModule)) {
+		TierUpModule(pModule);
+		if (!pModule->mTierUpM)
+			return false;
+		srcM = pModule->mTierUpM;
+		entrySuffix = ".tier1";
+	}
+
+	// The partitioned module is not optimized as a whole, so a copy of it is optimized for the binary.
+	std::unique_ptr<llvm::Module> optimizedM;
+	if (pModule->mPartitionCnt > 0) {
+		optimizedM.reset(llvm::CloneModule(srcM));
+		SC::CG_Context::OptimizeModule(optimizedM.get(), pModule->mOptions.optLevel);
+		srcM = optimizedM.get();
+	}
+
+	std::string objData;
+	if (!SC::CG_Context::TheObjectCache->ReadObject(srcM, objData) && 
+		!SC::CG_Context::EmitObjectCode(srcM, objData)) {
+		pCtx->lastErrMsg = "Failed to generate the object code.";
+		return false;
+	}
+
+	SC::ModuleBinaryHeader header;
+	header.targetDesc = SC::GetCodeGenTargetDesc();
+	header.predefineName = pCtx->pPredefineModule->M->getModuleIdentifier();
+	header.moduleName = pModule->M->getModuleIdentifier();
+	if (!SC::SaveModuleBinary(fileName, header, objData, *pModule, entrySuffix)) {
+		pCtx->lastErrMsg = "Failed to write the module binary.";
+		return false;
+	}
+	return true;
+}
+
+ModuleHandle KSC_LoadModuleBinaryInContext(KSC_ContextHandle hContext, const char* fileName)
+{
+	KSC_Context* pCtx = (KSC_Context*)hContext;
+	if (!pCtx)
+		return NULL;
+	ContextScope scope(pCtx);
+	KSC_ModuleDesc* pModuleDesc = new KSC_ModuleDesc;
+	SC::ModuleBinaryHeader header;
+	std::string objData;
+	if (!SC::LoadModuleBinary(fileName, header, objData, *pModuleDesc)) {
+		pCtx->lastErrMsg = "Failed to load the module binary.";
+		delete pModuleDesc;
 		return NULL;
+	}
+	// The machine code must match the target as well as the shared code of this session
+	if (header.targetDesc != SC::GetCodeGenTargetDesc() || 
+		header.predefineName != pCtx->pPredefineModule->M->getModuleIdentifier()) {
+		pCtx->lastErrMsg = "The module binary is built for another target or with different shared code.";
+		delete pModuleDesc;
+		return NULL;
+	}
 
-	if (pModule->mFunctionDesc.find(funcName) != pModule->mFunctionDesc.end()) {
-		return pModule->mFunctionDesc[funcName];
+	// The symbols are decorated with the module name of the save run, which might be taken by a module compiled
+	// from the same source or loaded from the same binary. The duplicated symbols would silently override each 
+	// other, so the loaded module gets a new instance of the name and its symbols are renamed accordingly.
+	const std::string& savedName = header.moduleName;
+	SC::JITObjectCache::ModuleNameParts nameParts;
+	if (!SC::JITObjectCache::SplitModuleName(savedName, nameParts) || !nameParts.suffix.empty()) {
+		pCtx->lastErrMsg = "Invalid module name in the module binary.";
+		delete pModuleDesc;
+		return NULL;
 	}
-	else
+	std::string moduleName = MakeModuleInstanceName(pCtx, nameParts.prefix, nameParts.hash);
+	SC::JITObjectCache::RenameModuleInObject(objData, savedName, moduleName);
+	std::hash_map<std::string, KSC_FunctionDesc*>::iterator it = pModuleDesc->mFunctionDesc.begin();
+	for (; it != pModuleDesc->mFunctionDesc.end(); ++it)
+		SC::JITObjectCache::RenameModuleInObject(it->second->mEntryName, savedName, moduleName);
+
+	std::unique_ptr<llvm::MemoryBuffer> objBuffer(llvm::MemoryBuffer::getMemBufferCopy(objData, fileName));
+	llvm::ErrorOr<std::unique_ptr<llvm::object::ObjectFile> > objFile = 
+		llvm::object::ObjectFile::createObjectFile(objBuffer->getMemBufferRef());
+	if (!objFile) {
+		pCtx->lastErrMsg = "Invalid object code in the module binary.";
+		delete pModuleDesc;
+		return NULL;
+	}
+
+	// The engine is created with an empty module, which is removed so only the object is loaded.
+	llvm::Module* emptyM = SC::CreateCodeGenModule(moduleName);
+	pModuleDesc->mpEngine = SC::CreateModuleEngine(emptyM);
+	if (!pModuleDesc->mpEngine) {
+		pCtx->lastErrMsg = "Failed to create the JIT execution engine.";
+		delete pModuleDesc;
 		return NULL;
+	}
+	pModuleDesc->mpEngine->removeModule(emptyM);
+	delete emptyM;
+
+	// The object references the shared code, which must be loaded first.
+	EmitPredefineCode(pCtx);
+	pModuleDesc->mpEngine->addObjectFile(
+		llvm::object::OwningBinary<llvm::object::ObjectFile>(std::move(*objFile), std::move(objBuffer)));
+	pModuleDesc->mpEngine->finalizeObject();
+	pModuleDesc->mCodeEmitted = true;
+
+	for (it = pModuleDesc->mFunctionDesc.begin(); it != pModuleDesc->mFunctionDesc.end(); ++it) {
+		void* pFunc = (void*)pModuleDesc->mpEngine->getFunctionAddress(it->second->mEntryName);
+		it->second->pJIT_Func.store(pFunc, std::memory_order_release);
+	}
+	SetModuleContext(pModuleDesc, pCtx);
+	pCtx->modules.push_back(pModuleDesc);
+	return pModuleDesc;
+}
+
+ModuleHandle KSC_LoadModuleBinary(const char* fileName)
+{
+	return KSC_LoadModuleBinaryInContext(s_pDefaultContext, fileName);
+}
+
+FunctionHandle KSC_GetFunctionHandleByName(const char* funcName, ModuleHandle hModule)
+{
+	KSC_ModuleDesc* pModule = (KSC_ModuleDesc*)hModule;
+	if (!pModule)
+		return NULL;
+	return FindFunction(pModule, funcName);
 }
 
 int KSC_GetFunctionArgumentCount(FunctionHandle hFunc)
@@ -252,7 +1331,7 @@ KSC_TypeInfo KSC_GetFunctionArgumentType(FunctionHandle hFunc, int argIdx)
 KSC_TypeInfo KSC_GetStructTypeByName(const char* structName, ModuleHandle hModule)
 {
 	KSC_TypeInfo ret = {SC::VarType::kInvalid, 0, 0, 0, NULL, NULL, false, false};
-	KSC_ModuleDesc* pModule = hModule ? (KSC_ModuleDesc*)hModule : s_predefineModule;
+	KSC_ModuleDesc* pModule = hModule ? (KSC_ModuleDesc*)hModule : (s_pDefaultContext ? s_pDefaultContext->pPredefineModule : NULL);
 	if (!pModule)
 		return ret;
 
@@ -315,20 +1394,21 @@ void* KSC_GetStructMemberPtr(StructHandle hStruct, void* pStructVar, const char*
 	KSC_TypeInfo memberType;
 	size_t i = 0;
 	for (; i < member_list.size(); ++i) {
-		std::hash_map<std::string, KSC_StructDesc::MemberInfo>::iterator it_member = pStructDesc->mMemberIndices.find(member);
+		std::hash_map<std::string, KSC_StructDesc::MemberInfo>::iterator it_member = pStructDesc->mMemberIndices.find(member_list[i]);
 		if (it_member != pStructDesc->mMemberIndices.end()) {
 			offset += it_member->second.mem_offset;
 			memberType = (*pStructDesc)[it_member->second.idx];
-			if (memberType.hStruct == NULL) {
+			if (memberType.hStruct == NULL || i == member_list.size() - 1) {
 				if (i != member_list.size() - 1)
 					return NULL;
 				break;
 			}
+			pStructDesc = (KSC_StructDesc*)memberType.hStruct;
 		}
 		else
 			return NULL;
 	}
-	if (i == member_list.size()) return false;
+	if (i == member_list.size()) return NULL;
 
 	return ((unsigned char*)pStructVar + offset);
 }
@@ -347,23 +1427,31 @@ bool KSC_SetStructMemberData(StructHandle hStruct, void* pStructVar, const char*
 	KSC_TypeInfo memberType;
 	size_t i = 0;
 	for (; i < member_list.size(); ++i) {
-		std::hash_map<std::string, KSC_StructDesc::MemberInfo>::iterator it_member = pStructDesc->mMemberIndices.find(member);
+		std::hash_map<std::string, KSC_StructDesc::MemberInfo>::iterator it_member = pStructDesc->mMemberIndices.find(member_list[i]);
 		if (it_member != pStructDesc->mMemberIndices.end()) {
 			offset += it_member->second.mem_offset;
 			memberType = (*pStructDesc)[it_member->second.idx];
-			if (memberType.hStruct == NULL) {
+			if (memberType.hStruct == NULL || i == member_list.size() - 1) {
 				if (i != member_list.size() - 1)
 					return false;
 				memSize = it_member->second.mem_size;
 				break;
 			}
+			pStructDesc = (KSC_StructDesc*)memberType.hStruct;
 		}
 		else
 			return false;
 	}
 	if (i == member_list.size()) return false;
 
-	memcpy(((unsigned char*)pStructVar + offset), data, size < memSize ? size : memSize);
+	int copySize = size < memSize ? size : memSize;
+	memcpy(((unsigned char*)pStructVar + offset), data, copySize);
+	// The boolean vector lanes are the masks in the KSC layout
+	if (SC::IsBooleanType(memberType.type) && SC::TypeElementCnt(memberType.type) > 1) {
+		SC::Boolean* pLanes = (SC::Boolean*)((unsigned char*)pStructVar + offset);
+		for (int li = 0; li < copySize / (int)sizeof(SC::Boolean); ++li)
+			pLanes[li] = pLanes[li] ? ~0 : 0;
+	}
 	return true;
 }
 
@@ -400,9 +1488,131 @@ void _Aligned_Free(void* ptr)
 
 }
 
-void* KSC_AllocMemForType(const KSC_TypeInfo& typeInfo, int arraySize)
+// The alignment of the SoA streams, which is the cache line size
+static const size_t s_soaStreamAlignment = 64;
+
+static size_t AlignSize(size_t size, size_t alignment)
 {
-	return _Aligned_Malloc(typeInfo.sizeOfType * (arraySize == 0 ? 1 : arraySize), typeInfo.alignment);
+	return (size + alignment - 1) / alignment * alignment;
+}
+
+void* KSC_AllocMemForType(const KSC_TypeInfo& typeInfo, int arraySize, SC::MemLayout layout)
+{
+	int elemCnt = (arraySize == 0 ? 1 : arraySize);
+	if (layout == SC::kLayoutKSC || typeInfo.hStruct == NULL)
+		return _Aligned_Malloc(typeInfo.sizeOfType * elemCnt, typeInfo.alignment);
+
+	ContextScope scope(((KSC_StructDesc*)typeInfo.hStruct)->pContext);
+	llvm::Type* structType = SC::CG_Context::ConvertToLLVMType(typeInfo);
+	if (typeInfo.arraySize > 0)
+		structType = structType->getArrayElementType();
+	if (layout == SC::kLayoutPacked) {
+		llvm::Type* packedType = SC::CG_Context::ConvertToPackedType(structType);
+		return _Aligned_Malloc((size_t)SC::CG_Context::TheDataLayout()->getTypeAllocSize(packedType) * elemCnt, 
+			SC::CG_Context::TheDataLayout()->getABITypeAlignment(packedType));
+	}
+
+	// The SoA memory starts with the table of the stream pointers, followed by the streams.
+	std::vector<int> streamSizes;
+	SC::CG_Context::GetSoAStreamSizes(structType, streamSizes);
+	size_t tableSize = AlignSize(streamSizes.size() * sizeof(void*), s_soaStreamAlignment);
+	size_t totalSize = tableSize;
+	for (size_t i = 0; i < streamSizes.size(); ++i)
+		totalSize += AlignSize((size_t)streamSizes[i] * elemCnt, s_soaStreamAlignment);
+
+	unsigned char* pData = (unsigned char*)_Aligned_Malloc(totalSize, s_soaStreamAlignment);
+	if (!pData)
+		return NULL;
+	void** streamTable = (void**)pData;
+	size_t streamOffset = tableSize;
+	for (size_t i = 0; i < streamSizes.size(); ++i) {
+		streamTable[i] = pData + streamOffset;
+		streamOffset += AlignSize((size_t)streamSizes[i] * elemCnt, s_soaStreamAlignment);
+	}
+	return pData;
+}
+
+void* KSC_GetSoAStreamPtr(StructHandle hStruct, void* pSoAData, const char* member, int component)
+{
+	KSC_StructDesc* pStructDesc = (KSC_StructDesc*)hStruct;
+	if (!pStructDesc || !pSoAData || component < 0)
+		return NULL;
+
+	std::vector<std::string> member_list;
+	SplitStringByDot(member, member_list);
+
+	// The streams are in the declaration order of the scalar components, so the stream index of the member
+	// is the count of the components declared before it.
+	ContextScope scope(pStructDesc->pContext);
+	size_t streamIdx = 0;
+	for (size_t i = 0; i < member_list.size(); ++i) {
+		if (!pStructDesc)
+			return NULL;
+		std::hash_map<std::string, KSC_StructDesc::MemberInfo>::iterator it_member = pStructDesc->mMemberIndices.find(member_list[i]);
+		if (it_member == pStructDesc->mMemberIndices.end())
+			return NULL;
+		for (int mi = 0; mi < it_member->second.idx; ++mi) {
+			std::vector<int> streamSizes;
+			SC::CG_Context::GetSoAStreamSizes(SC::CG_Context::ConvertToLLVMType((*pStructDesc)[mi]), streamSizes);
+			streamIdx += streamSizes.size();
+		}
+
+		const KSC_TypeInfo& memberType = (*pStructDesc)[it_member->second.idx];
+		if (i == member_list.size() - 1) {
+			std::vector<int> streamSizes;
+			SC::CG_Context::GetSoAStreamSizes(SC::CG_Context::ConvertToLLVMType(memberType), streamSizes);
+			if (component >= (int)streamSizes.size())
+				return NULL;
+			streamIdx += component;
+		}
+		else if (memberType.arraySize > 0)
+			return NULL;
+		pStructDesc = (KSC_StructDesc*)memberType.hStruct;
+	}
+	return ((void**)pSoAData)[streamIdx];
+}
+
+void* KSC_GetLayoutConverter(StructHandle hStruct, SC::MemLayout srcLayout, SC::MemLayout destLayout)
+{
+	KSC_StructDesc* pStructDesc = (KSC_StructDesc*)hStruct;
+	if (!pStructDesc || srcLayout == destLayout)
+		return NULL;
+
+	KSC_Context* pCtx = pStructDesc->pContext;
+	ContextScope scope(pCtx);
+	KSC_TypeInfo typeInfo = {SC::kStructure, 0, pStructDesc->mStructSize, pStructDesc->mAlignment, hStruct, NULL, false, true};
+	// The layout type tells the boolean vectors from the int vectors, which are converted differently.
+	llvm::Type* layoutType = SC::CG_Context::ConvertToLayoutType(typeInfo);
+
+	// The converters only depend on the layout of the structure, so they are shared by the structures
+	// of the same layout and live as long as the context does.
+	std::string typeStr;
+	llvm::raw_string_ostream typeStream(typeStr);
+	layoutType->print(typeStream);
+	char layoutStr[32];
+	sprintf_s(layoutStr, ";%d->%d", (int)srcLayout, (int)destLayout);
+	std::string converterKey = typeStream.str() + layoutStr;
+	std::map<std::string, void*>::iterator it = pCtx->layoutConverters.find(converterKey);
+	if (it != pCtx->layoutConverters.end())
+		return it->second;
+
+	llvm::MD5 hash;
+	hash.update(s_codeGenVersion);
+	hash.update(SC::GetCodeGenTargetDesc());
+	hash.update(converterKey);
+	llvm::Module* M = SC::CreateCodeGenModule(MakeModuleName(pCtx, "ksc_layout_", hash));
+	std::string converterName = std::string("convert.") + M->getModuleIdentifier();
+	SC::CG_Context::CreateLayoutConverter(M, typeInfo, srcLayout, destLayout, converterName);
+
+	if (!SC::CG_Context::TheObjectCache->PinObject(M))
+		SC::CG_Context::OptimizeModule(M, SC::kOptDefault);
+	SC::CG_Context::TheExecutionEngine()->addModule(std::unique_ptr<llvm::Module>(M));
+	SC::CG_Context::TheExecutionEngine()->generateCodeForModule(M);
+	SC::CG_Context::TheExecutionEngine()->finalizeObject();
+
+	void* pConverter = (void*)SC::CG_Context::TheExecutionEngine()->getFunctionAddress(converterName);
+	pCtx->layoutConverters[converterKey] = pConverter;
+	return pConverter;
 }
 
 void KSC_FreeMem(void* pData)
@@ -435,18 +1645,35 @@ int KSC_GetTypePackedSize(const KSC_TypeInfo& typeInfo)
 
 bool KSC_GetBuiltInTypeInfo(SC::VarType type, int& alloc_size, int& alignment)
 {
+	// The layout of the built-in types only depends on the target, which is the same for all the contexts.
+	if (!s_pDefaultContext)
+		return false;
+	ContextScope scope(s_pDefaultContext);
 	llvm::Type* pType = SC::CG_Context::ConvertToLLVMType(type);
 	if (pType) {
-		alloc_size = (int)SC::CG_Context::TheDataLayout->getTypeAllocSize(pType);
-		alignment = (int)SC::CG_Context::TheDataLayout->getPrefTypeAlignment(pType);
+		alloc_size = (int)SC::CG_Context::TheDataLayout()->getTypeAllocSize(pType);
+		alignment = (int)SC::CG_Context::TheDataLayout()->getPrefTypeAlignment(pType);
 		return true;
 	}
 	else
 		return false;
 }
 
+SC::VarType KSC_GetBuiltInTypeByName(const char* typeName)
+{
+	SC::TypeDesc typeDesc;
+	if (SC::GetBuiltInTypeByName(typeName, &typeDesc))
+		return typeDesc.type;
+	else
+		return SC::kInvalid;
+}
+
 int KSC_GetSIMDWidth()
 {
+	int width = SC::GetCodeGenSIMDWidth();
+	if (width > 0)
+		return width;
+
 	int CPUInfo[4];
 	__cpuid(CPUInfo, 1);
 
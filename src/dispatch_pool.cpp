@@ -0,0 +1,178 @@
+#include "dispatch_pool.h"
+#include <algorithm>
+#include <memory>
+#include <assert.h>
+
+namespace SC {
+	// The count of the jobs the calling thread is running, it's always non-zero on the pool threads. A dispatch
+	// from inside a job(i.e. a nested one) must not wait for the pool, which is busy with the outer job.
+#ifdef _MSC_VER
+	static __declspec(thread) int s_jobDepth = 0;
+#else
+	static __thread int s_jobDepth = 0;
+#endif
+
+	DispatchPool::DispatchPool()
+	{
+		mpCurJob = NULL;
+		mJobSerial = 0;
+		mStop = false;
+	}
+
+	DispatchPool::~DispatchPool()
+	{
+		// The threads must be joined by Stop(), the ones detached here would still run on the freed pool.
+		assert(mThreads.empty());
+	}
+
+	void DispatchPool::Run(int workerIdx, unsigned seenSerial)
+	{
+		s_jobDepth = 1;
+		std::unique_lock<std::mutex> lock(mMutex);
+		while (true) {
+			while (!mStop && mJobSerial == seenSerial)
+				mJobCond.wait(lock);
+			if (mStop)
+				break;
+
+			seenSerial = mJobSerial;
+			Job* pJob = mpCurJob;
+			lock.unlock();
+			RunJob(*pJob, workerIdx);
+			lock.lock();
+			if (--pJob->activeWorkers == 0)
+				mDoneCond.notify_all();
+		}
+	}
+
+	void DispatchPool::RunJob(Job& job, int workerIdx)
+	{
+		WorkRange& ownRange = *job.ranges[workerIdx];
+		while (true) {
+			int begin, end;
+			{
+				std::lock_guard<std::mutex> lock(ownRange.mutex);
+				begin = ownRange.begin;
+				end = std::min(ownRange.end, begin + job.grainSize);
+				ownRange.begin = end;
+			}
+			if (begin < end) {
+				(*job.pFunc)(begin, end);
+				continue;
+			}
+
+			// Steal from the worker with the most elements left, which keeps the count of the steals low.
+			int victimIdx = -1;
+			int maxLeft = 0;
+			for (int i = 0; i < (int)job.ranges.size(); ++i) {
+				if (i == workerIdx)
+					continue;
+				std::lock_guard<std::mutex> lock(job.ranges[i]->mutex);
+				int left = job.ranges[i]->end - job.ranges[i]->begin;
+				if (left > maxLeft) {
+					maxLeft = left;
+					victimIdx = i;
+				}
+			}
+			// Nothing is moved into a range but by its owner, so the job is done once all the ranges are empty.
+			if (victimIdx < 0)
+				break;
+
+			int stolenBegin, stolenEnd;
+			{
+				WorkRange& victimRange = *job.ranges[victimIdx];
+				std::lock_guard<std::mutex> lock(victimRange.mutex);
+				int left = victimRange.end - victimRange.begin;
+				if (left <= 0)
+					continue;
+				int stealCnt = std::max(left / 2, std::min(left, job.grainSize));
+				stolenEnd = victimRange.end;
+				stolenBegin = stolenEnd - stealCnt;
+				victimRange.end = stolenBegin;
+			}
+			std::lock_guard<std::mutex> lock(ownRange.mutex);
+			ownRange.begin = stolenBegin;
+			ownRange.end = stolenEnd;
+		}
+	}
+
+	void DispatchPool::Dispatch(int count, int grainSize, const RangeFunc& func)
+	{
+		if (count <= 0)
+			return;
+		grainSize = std::max(grainSize, 1);
+		if (s_jobDepth > 0 || count <= grainSize) {
+			func(0, count);
+			return;
+		}
+
+		std::lock_guard<std::mutex> dispatchLock(mDispatchMutex);
+		int threadCnt = 0;
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			if (mThreads.empty()) {
+				mStop = false;
+				for (int i = 1; i < GetConcurrency(); ++i)
+					mThreads.push_back(std::thread(&DispatchPool::Run, this, i, mJobSerial));
+			}
+			threadCnt = (int)mThreads.size();
+		}
+		if (threadCnt == 0) {
+			func(0, count);
+			return;
+		}
+
+		// Each worker starts with a contiguous range of whole grains, so the elements it runs are close in memory.
+		int workerCnt = threadCnt + 1;
+		int grainCnt = (count + grainSize - 1) / grainSize;
+		std::unique_ptr<WorkRange[]> ranges(new WorkRange[workerCnt]);
+		Job job;
+		job.pFunc = &func;
+		job.grainSize = grainSize;
+		for (int i = 0; i < workerCnt; ++i) {
+			int beginGrain = (int)((long long)grainCnt * i / workerCnt);
+			int endGrain = (int)((long long)grainCnt * (i + 1) / workerCnt);
+			ranges[i].begin = std::min(beginGrain * grainSize, count);
+			ranges[i].end = std::min(endGrain * grainSize, count);
+			job.ranges.push_back(&ranges[i]);
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mpCurJob = &job;
+			job.activeWorkers = threadCnt;
+			++mJobSerial;
+			mJobCond.notify_all();
+		}
+		++s_jobDepth;
+		RunJob(job, 0);
+		--s_jobDepth;
+
+		std::unique_lock<std::mutex> lock(mMutex);
+		while (job.activeWorkers > 0)
+			mDoneCond.wait(lock);
+		mpCurJob = NULL;
+	}
+
+	int DispatchPool::GetConcurrency() const
+	{
+		return std::max((int)std::thread::hardware_concurrency(), 1);
+	}
+
+	void DispatchPool::Stop()
+	{
+		if (s_jobDepth > 0)
+			return;
+		std::lock_guard<std::mutex> dispatchLock(mDispatchMutex);
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			if (mThreads.empty())
+				return;
+			mStop = true;
+			mJobCond.notify_all();
+		}
+		for (size_t i = 0; i < mThreads.size(); ++i)
+			mThreads[i].join();
+		mThreads.clear();
+	}
+}
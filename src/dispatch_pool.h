@@ -0,0 +1,60 @@
+#pragma once
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+namespace SC {
+	// The pool runs the data-parallel dispatches on all the cores. The range of a dispatch is split evenly among
+	// the workers(including the dispatching thread), each worker runs the grains from the front of its own range,
+	// and once its range is done it steals the back half of the largest range left, so the workers finish at about
+	// the same time even if the cost of the elements is uneven. The threads are started on the first dispatch.
+	class DispatchPool
+	{
+	public:
+		// Run the elements in [begin, end) of the dispatch.
+		typedef std::function<void(int, int)> RangeFunc;
+
+	private:
+		struct WorkRange {
+			std::mutex mutex;
+			int begin;
+			int end;
+		};
+		struct Job {
+			const RangeFunc* pFunc;
+			int grainSize;
+			std::vector<WorkRange*> ranges;
+			// The count of the pool threads still working on the job, the job lives on the dispatching thread.
+			int activeWorkers;
+		};
+
+		std::vector<std::thread> mThreads;
+		std::mutex mMutex;
+		std::condition_variable mJobCond;
+		std::condition_variable mDoneCond;
+		Job* mpCurJob;
+		unsigned mJobSerial;
+		bool mStop;
+		// Only one dispatch runs on the pool at a time, the others wait for their turns.
+		std::mutex mDispatchMutex;
+
+		void Run(int workerIdx, unsigned seenSerial);
+		static void RunJob(Job& job, int workerIdx);
+
+	public:
+		DispatchPool();
+		// Stop() must be called before the pool is destroyed.
+		~DispatchPool();
+
+		// Run "func" over [0, count) in the ranges of "grainSize" elements, it returns when all the elements are done.
+		// The dispatch from inside a job(i.e. a nested one, on a pool thread or the dispatching thread) runs on the
+		// calling thread only. The dispatches from different threads are serialized on the pool.
+		void Dispatch(int count, int grainSize, const RangeFunc& func);
+		// The count of the threads running a dispatch, including the dispatching thread.
+		int GetConcurrency() const;
+		void Stop();
+	};
+}
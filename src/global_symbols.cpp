@@ -1,12 +1,21 @@
 #include "global_symbols.h"
 
 namespace SC {
+	GobalSymbolMemManager::GobalSymbolMemManager(GobalSymbolMemManager* pParent, llvm::ExecutionEngine* pParentEngine)
+	{
+		mpParent = pParent;
+		mpParentEngine = pParentEngine;
+	}
+
 	uint64_t GobalSymbolMemManager::getSymbolAddress(const std::string &Name)
 	{
-		auto it = mGlobalFuncSymbols.find(Name);
-		if (it != mGlobalFuncSymbols.end())
+		const std::hash_map<std::string, void*>& funcSymbols = mpParent ? mpParent->mGlobalFuncSymbols : mGlobalFuncSymbols;
+		auto it = funcSymbols.find(Name);
+		if (it != funcSymbols.end())
 			return (uint64_t)it->second;
-		else
-			return 0;
+		// The shared code is JIT-ed by the context engine before any module referencing it.
+		if (mpParentEngine)
+			return mpParentEngine->getGlobalValueAddress(Name);
+		return 0;
 	}
-}
\ No newline at end of file
+}
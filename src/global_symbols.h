@@ -3,18 +3,27 @@
 
 #pragma warning(disable: 4267)
 #include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm/ExecutionEngine/ExecutionEngine.h>
 #pragma warning(pop)
 #include <hash_map>
 
 
 namespace SC {
+	// The memory manager of the context engine holds the external functions. Each module engine has its own
+	// memory manager, which resolves the external functions and the shared code through the ones of the context,
+	// and frees the JIT-ed code and data of the module when the module engine is destroyed.
 	class GobalSymbolMemManager : public llvm::SectionMemoryManager
 	{
 	public:
 		std::hash_map<std::string, void*> mGlobalFuncSymbols;
 
+	private:
+		GobalSymbolMemManager* mpParent;
+		llvm::ExecutionEngine* mpParentEngine;
+
 	public:
-		 virtual uint64_t getSymbolAddress(const std::string &Name);
+		GobalSymbolMemManager(GobalSymbolMemManager* pParent = NULL, llvm::ExecutionEngine* pParentEngine = NULL);
+
+		virtual uint64_t getSymbolAddress(const std::string &Name);
 	};
 }
-
@@ -0,0 +1,77 @@
+#include "jit_worker.h"
+#include <assert.h>
+
+namespace SC {
+	JITWorker::JITWorker()
+	{
+		mIsBusy = false;
+		mStop = false;
+	}
+
+	JITWorker::~JITWorker()
+	{
+		// The owner must stop the worker first(see "DestroyContext"), the thread still waits on the members otherwise.
+		assert(!mThread.joinable());
+	}
+
+	void JITWorker::Run()
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		while (true) {
+			while (mTasks.empty() && !mStop)
+				mTaskCond.wait(lock);
+			if (mTasks.empty())
+				break;
+
+			Task curTask = mTasks.front();
+			mTasks.pop_front();
+			mIsBusy = true;
+			lock.unlock();
+			curTask();
+			lock.lock();
+			mIsBusy = false;
+			if (mTasks.empty())
+				mIdleCond.notify_all();
+		}
+	}
+
+	void JITWorker::Post(const Task& task)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (!mThread.joinable()) {
+			mStop = false;
+			mThread = std::thread(&JITWorker::Run, this);
+		}
+		mTasks.push_back(task);
+		mTaskCond.notify_one();
+	}
+
+	void JITWorker::Flush()
+	{
+		if (IsWorkerThread())
+			return;
+		std::unique_lock<std::mutex> lock(mMutex);
+		while (!mTasks.empty() || mIsBusy)
+			mIdleCond.wait(lock);
+	}
+
+	void JITWorker::Stop()
+	{
+		if (IsWorkerThread())
+			return;
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			if (!mThread.joinable())
+				return;
+			mStop = true;
+			mTaskCond.notify_one();
+		}
+		mThread.join();
+		mThread = std::thread();
+	}
+
+	bool JITWorker::IsWorkerThread() const
+	{
+		return std::this_thread::get_id() == mThread.get_id();
+	}
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+namespace SC {
+	// The worker runs the posted tasks in order on a background thread, it is used to JIT the modules
+	// without blocking the threads of the hosting application. The thread is started on the first posted task.
+	class JITWorker
+	{
+	public:
+		typedef std::function<void()> Task;
+
+	private:
+		std::thread mThread;
+		std::mutex mMutex;
+		std::condition_variable mTaskCond;
+		std::condition_variable mIdleCond;
+		std::deque<Task> mTasks;
+		bool mIsBusy;
+		bool mStop;
+
+		void Run();
+
+	public:
+		JITWorker();
+		~JITWorker();
+
+		void Post(const Task& task);
+		// Wait until all the posted tasks are done, it does nothing if it is invoked by the worker thread itself.
+		void Flush();
+		// Finish the posted tasks and stop the thread, it must be called before the worker is destroyed.
+		void Stop();
+		bool IsWorkerThread() const;
+	};
+}
@@ -0,0 +1,271 @@
+#include "module_binary.h"
+#include <stdio.h>
+#include <string.h>
+
+namespace SC {
+	static const char s_binaryMagic[4] = {'K', 'S', 'C', 'B'};
+	// Bump this whenever the layout of the module binary changes
+	static const int s_binaryVersion = 4;
+
+	class BinaryWriter
+	{
+	public:
+		std::vector<char> mData;
+
+		void WriteBytes(const void* pData, size_t size)
+		{
+			mData.insert(mData.end(), (const char*)pData, (const char*)pData + size);
+		}
+		void WriteInt(int value)
+		{
+			WriteBytes(&value, sizeof(int));
+		}
+		void WriteString(const std::string& str)
+		{
+			WriteInt((int)str.size());
+			WriteBytes(str.data(), str.size());
+		}
+	};
+
+	class BinaryReader
+	{
+	private:
+		const char* mpCur;
+		const char* mpEnd;
+		bool mIsGood;
+
+	public:
+		BinaryReader(const char* pData, size_t size) : mpCur(pData), mpEnd(pData + size), mIsGood(true) {}
+
+		bool IsGood() const { return mIsGood; }
+
+		bool ReadBytes(void* pData, size_t size)
+		{
+			if (!mIsGood || (size_t)(mpEnd - mpCur) < size) {
+				mIsGood = false;
+				return false;
+			}
+			memcpy(pData, mpCur, size);
+			mpCur += size;
+			return true;
+		}
+		int ReadInt()
+		{
+			int value = 0;
+			ReadBytes(&value, sizeof(int));
+			return value;
+		}
+		std::string ReadString()
+		{
+			int size = ReadInt();
+			if (size < 0 || (size_t)(mpEnd - mpCur) < (size_t)size) {
+				mIsGood = false;
+				return std::string();
+			}
+			std::string ret(mpCur, size);
+			mpCur += size;
+			return ret;
+		}
+	};
+
+	static void WriteStructDesc(BinaryWriter& writer, const KSC_StructDesc& structDesc);
+	static bool ReadStructDesc(BinaryReader& reader, KSC_StructDesc& structDesc);
+
+	static void WriteTypeInfo(BinaryWriter& writer, const KSC_TypeInfo& typeInfo)
+	{
+		writer.WriteInt(typeInfo.type);
+		writer.WriteInt(typeInfo.arraySize);
+		writer.WriteInt(typeInfo.sizeOfType);
+		writer.WriteInt(typeInfo.alignment);
+		writer.WriteInt(typeInfo.isRef ? 1 : 0);
+		writer.WriteInt(typeInfo.isKSCLayout ? 1 : 0);
+		writer.WriteInt(typeInfo.hStruct ? 1 : 0);
+		if (typeInfo.hStruct)
+			WriteStructDesc(writer, *(const KSC_StructDesc*)typeInfo.hStruct);
+	}
+
+	static bool ReadTypeInfo(BinaryReader& reader, KSC_TypeInfo& typeInfo)
+	{
+		typeInfo.type = (VarType)reader.ReadInt();
+		typeInfo.arraySize = reader.ReadInt();
+		typeInfo.sizeOfType = reader.ReadInt();
+		typeInfo.alignment = reader.ReadInt();
+		typeInfo.isRef = reader.ReadInt() != 0;
+		typeInfo.isKSCLayout = reader.ReadInt() != 0;
+		typeInfo.typeString = NULL;
+		typeInfo.hStruct = NULL;
+		if (reader.ReadInt() != 0) {
+			KSC_StructDesc* pStructDesc = new KSC_StructDesc;
+			typeInfo.hStruct = pStructDesc;
+			if (!ReadStructDesc(reader, *pStructDesc))
+				return false;
+		}
+		return reader.IsGood();
+	}
+
+	static void WriteStructDesc(BinaryWriter& writer, const KSC_StructDesc& structDesc)
+	{
+		writer.WriteInt(structDesc.mStructSize);
+		writer.WriteInt(structDesc.mAlignment);
+		writer.WriteInt((int)structDesc.size());
+		for (int i = 0; i < (int)structDesc.size(); ++i) {
+			// The members are written in the order of their indices along with their names
+			std::hash_map<std::string, KSC_StructDesc::MemberInfo>::const_iterator it = structDesc.mMemberIndices.begin();
+			for (; it != structDesc.mMemberIndices.end(); ++it) {
+				if (it->second.idx == i)
+					break;
+			}
+			writer.WriteString(it->first);
+			writer.WriteInt(it->second.mem_offset);
+			writer.WriteInt(it->second.mem_size);
+			writer.WriteString(it->second.type_string);
+			WriteTypeInfo(writer, structDesc[i]);
+		}
+	}
+
+	static bool ReadStructDesc(BinaryReader& reader, KSC_StructDesc& structDesc)
+	{
+		structDesc.mStructSize = reader.ReadInt();
+		structDesc.mAlignment = reader.ReadInt();
+		int memberCnt = reader.ReadInt();
+		for (int i = 0; i < memberCnt && reader.IsGood(); ++i) {
+			std::string memberName = reader.ReadString();
+			KSC_StructDesc::MemberInfo& memberInfo = structDesc.mMemberIndices[memberName];
+			memberInfo.idx = i;
+			memberInfo.mem_offset = reader.ReadInt();
+			memberInfo.mem_size = reader.ReadInt();
+			memberInfo.type_string = reader.ReadString();
+
+			KSC_TypeInfo typeInfo;
+			bool isGood = ReadTypeInfo(reader, typeInfo);
+			typeInfo.typeString = memberInfo.type_string.c_str();
+			// Push it anyway so that the nested structure is freed along with this one
+			structDesc.push_back(typeInfo);
+			if (!isGood)
+				return false;
+		}
+		return reader.IsGood();
+	}
+
+	static void WriteFunctionDesc(BinaryWriter& writer, const KSC_FunctionDesc& funcDesc, const char* entrySuffix)
+	{
+		writer.WriteString(funcDesc.mEntryName + entrySuffix);
+		writer.WriteInt((int)funcDesc.mArgumentTypes.size());
+		for (int i = 0; i < (int)funcDesc.mArgumentTypes.size(); ++i) {
+			writer.WriteString(funcDesc.mArgTypeStrings[i]);
+			writer.WriteInt(funcDesc.needJITPacked[i]);
+			WriteTypeInfo(writer, funcDesc.mArgumentTypes[i]);
+		}
+		WriteTypeInfo(writer, funcDesc.mReturnType);
+	}
+
+	static bool ReadFunctionDesc(BinaryReader& reader, KSC_FunctionDesc& funcDesc)
+	{
+		funcDesc.mEntryName = reader.ReadString();
+		int argCnt = reader.ReadInt();
+		if (argCnt < 0 || !reader.IsGood())
+			return false;
+		funcDesc.mArgTypeStrings.resize(argCnt);
+		funcDesc.needJITPacked.resize(argCnt);
+		funcDesc.mArgumentTypes.reserve(argCnt);
+		for (int i = 0; i < argCnt; ++i) {
+			funcDesc.mArgTypeStrings[i] = reader.ReadString();
+			funcDesc.needJITPacked[i] = reader.ReadInt();
+
+			KSC_TypeInfo typeInfo;
+			bool isGood = ReadTypeInfo(reader, typeInfo);
+			typeInfo.typeString = funcDesc.mArgTypeStrings[i].c_str();
+			funcDesc.mArgumentTypes.push_back(typeInfo);
+			if (!isGood)
+				return false;
+		}
+		return ReadTypeInfo(reader, funcDesc.mReturnType);
+	}
+
+	bool SaveModuleBinary(const char* fileName, const ModuleBinaryHeader& header, const std::string& objData, 
+		const KSC_ModuleDesc& moduleDesc, const char* entrySuffix)
+	{
+		BinaryWriter writer;
+		writer.WriteBytes(s_binaryMagic, sizeof(s_binaryMagic));
+		writer.WriteInt(s_binaryVersion);
+		writer.WriteString(header.targetDesc);
+		writer.WriteString(header.predefineName);
+		writer.WriteString(header.moduleName);
+
+		writer.WriteInt((int)moduleDesc.mGlobalStructures.size());
+		std::hash_map<std::string, KSC_StructDesc*>::const_iterator it_struct = moduleDesc.mGlobalStructures.begin();
+		for (; it_struct != moduleDesc.mGlobalStructures.end(); ++it_struct) {
+			writer.WriteString(it_struct->first);
+			WriteStructDesc(writer, *it_struct->second);
+		}
+
+		writer.WriteInt((int)moduleDesc.mFunctionDesc.size());
+		std::hash_map<std::string, KSC_FunctionDesc*>::const_iterator it_func = moduleDesc.mFunctionDesc.begin();
+		for (; it_func != moduleDesc.mFunctionDesc.end(); ++it_func) {
+			writer.WriteString(it_func->first);
+			WriteFunctionDesc(writer, *it_func->second, entrySuffix);
+		}
+
+		writer.WriteString(objData);
+
+		FILE* f = NULL;
+		fopen_s(&f, fileName, "wb");
+		if (f == NULL)
+			return false;
+		size_t writeSize = fwrite(&writer.mData.front(), 1, writer.mData.size(), f);
+		fclose(f);
+		return writeSize == writer.mData.size();
+	}
+
+	bool LoadModuleBinary(const char* fileName, ModuleBinaryHeader& header, std::string& objData, 
+		KSC_ModuleDesc& moduleDesc)
+	{
+		FILE* f = NULL;
+		fopen_s(&f, fileName, "rb");
+		if (f == NULL)
+			return false;
+		fseek(f, 0, SEEK_END);
+		long len = ftell(f);
+		fseek(f, 0, SEEK_SET);
+		std::vector<char> content(len > 0 ? len : 1);
+		size_t readSize = fread(&content.front(), 1, len, f);
+		fclose(f);
+		if (len <= 0 || readSize != (size_t)len)
+			return false;
+
+		BinaryReader reader(&content.front(), readSize);
+		char magic[4];
+		if (!reader.ReadBytes(magic, sizeof(magic)) || memcmp(magic, s_binaryMagic, sizeof(magic)) != 0)
+			return false;
+		if (reader.ReadInt() != s_binaryVersion)
+			return false;
+		header.targetDesc = reader.ReadString();
+		header.predefineName = reader.ReadString();
+		header.moduleName = reader.ReadString();
+
+		int structCnt = reader.ReadInt();
+		for (int i = 0; i < structCnt && reader.IsGood(); ++i) {
+			std::string structName = reader.ReadString();
+			KSC_StructDesc* pStructDesc = new KSC_StructDesc;
+			moduleDesc.mGlobalStructures[structName] = pStructDesc;
+			if (!ReadStructDesc(reader, *pStructDesc))
+				return false;
+		}
+
+		int funcCnt = reader.ReadInt();
+		for (int i = 0; i < funcCnt && reader.IsGood(); ++i) {
+			std::string funcName = reader.ReadString();
+			KSC_FunctionDesc* pFuncDesc = new KSC_FunctionDesc;
+			pFuncDesc->F = NULL;
+			pFuncDesc->pModule = &moduleDesc;
+			pFuncDesc->pTierSlot = NULL;
+			pFuncDesc->pJIT_Func = NULL;
+			moduleDesc.mFunctionDesc[funcName] = pFuncDesc;
+			if (!ReadFunctionDesc(reader, *pFuncDesc))
+				return false;
+		}
+
+		objData = reader.ReadString();
+		return reader.IsGood() && !objData.empty();
+	}
+}
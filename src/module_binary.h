@@ -0,0 +1,28 @@
+#pragma once
+#include "parser_defines.h"
+#include <string>
+
+
+namespace SC {
+	// The information to check whether a module binary is compatible with the running KSC.
+	struct ModuleBinaryHeader
+	{
+		// The target triple, CPU and features the machine code is generated for.
+		std::string targetDesc;
+		// The name of the module with the shared code, the machine code references its symbols.
+		std::string predefineName;
+		// The name of the module the machine code is generated from, its symbols are decorated with it.
+		std::string moduleName;
+	};
+
+	// The module binary contains the machine code of a JIT-ed module as well as its reflection tables(the 
+	// function and structure descriptions), so it can be loaded without the frontend and the code generator.
+	// The "entrySuffix" is appended to the entry names of the functions, since the entries might be renamed 
+	// in the module the machine code is generated from.
+	bool SaveModuleBinary(const char* fileName, const ModuleBinaryHeader& header, const std::string& objData, 
+		const KSC_ModuleDesc& moduleDesc, const char* entrySuffix);
+	// The loaded function descriptions have no LLVM function, their JIT-ed pointers are set once the 
+	// machine code is loaded.
+	bool LoadModuleBinary(const char* fileName, ModuleBinaryHeader& header, std::string& objData, 
+		KSC_ModuleDesc& moduleDesc);
+}
@@ -0,0 +1,235 @@
+#include "object_cache.h"
+#pragma warning(push)
+
+#pragma warning(disable: 4267 4800 4244 4291 4996)
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+#pragma warning(pop)
+#include <stdio.h>
+#include <ctype.h>
+
+namespace SC {
+	static const size_t s_hashLen = 32;
+	static const size_t s_tagLen = 9;
+	static const char* s_zeroTag = "_00000000";
+
+	static bool IsHexDigits(const std::string& str, size_t pos, size_t len)
+	{
+		if (pos + len > str.size())
+			return false;
+		for (size_t i = pos; i < pos + len; ++i) {
+			if (!isxdigit((unsigned char)str[i]))
+				return false;
+		}
+		return true;
+	}
+
+	// Find the instance tag, i.e. the "_XXXXXXXX" right after the 32-digit content hash of the module name.
+	static bool FindInstanceTag(const std::string& moduleName, size_t& outPos)
+	{
+		size_t hexCnt = 0;
+		for (size_t i = 0; i < moduleName.size(); ++i) {
+			if (isxdigit((unsigned char)moduleName[i])) {
+				++hexCnt;
+				continue;
+			}
+			if (moduleName[i] == '_' && hexCnt >= s_hashLen && IsHexDigits(moduleName, i + 1, s_tagLen - 1)) {
+				outPos = i;
+				return true;
+			}
+			hexCnt = 0;
+		}
+		return false;
+	}
+
+	// Replace every occurrence of "from" with "to".
+	static void ReplaceAll(std::string& str, const std::string& from, const std::string& to)
+	{
+		if (from == to)
+			return;
+		size_t pos = str.find(from);
+		while (pos != std::string::npos) {
+			str.replace(pos, from.size(), to);
+			pos = str.find(from, pos + to.size());
+		}
+	}
+
+	bool JITObjectCache::SplitModuleName(const std::string& moduleName, ModuleNameParts& outParts)
+	{
+		size_t tagPos;
+		if (!FindInstanceTag(moduleName, tagPos))
+			return false;
+		outParts.prefix = moduleName.substr(0, tagPos - s_hashLen);
+		outParts.hash = moduleName.substr(tagPos - s_hashLen, s_hashLen);
+		outParts.tag = moduleName.substr(tagPos, s_tagLen);
+		outParts.suffix = moduleName.substr(tagPos + s_tagLen);
+		return true;
+	}
+
+	bool JITObjectCache::RenameModuleInObject(std::string& obj, const std::string& fromName, const std::string& toName)
+	{
+		ModuleNameParts fromParts, toParts;
+		if (!SplitModuleName(fromName, fromParts) || !SplitModuleName(toName, toParts))
+			return false;
+		// The content hash along with the tag is unique enough not to appear in the object by chance, and the
+		// replacement of the same length keeps the offsets in the object valid.
+		ReplaceAll(obj, fromParts.hash + fromParts.tag, toParts.hash + toParts.tag);
+		return true;
+	}
+
+	// The name of the module with the zero instance tag, which the cached objects are stored with. The late
+	// modules embed the name of their module once more in the suffix, every occurrence is replaced.
+	static std::string GetCanonicalName(const std::string& moduleName)
+	{
+		JITObjectCache::ModuleNameParts parts;
+		if (!JITObjectCache::SplitModuleName(moduleName, parts))
+			return moduleName;
+		std::string canonicalName = moduleName;
+		ReplaceAll(canonicalName, parts.hash + parts.tag, parts.hash + s_zeroTag);
+		return canonicalName;
+	}
+
+	JITObjectCache::JITObjectCache()
+	{
+		mHits = 0;
+		mMisses = 0;
+		mTempFileCnt = 0;
+	}
+
+	JITObjectCache::~JITObjectCache()
+	{
+	}
+
+	bool JITObjectCache::GetObjectFilePath(const std::string& moduleName, std::string& outPath)
+	{
+		std::string cacheDir;
+		{
+			std::lock_guard<std::mutex> lock(mDirMutex);
+			cacheDir = mCacheDir;
+		}
+		if (cacheDir.empty())
+			return false;
+
+		// The file is named after the content hash only, every occurrence of the instance tag is dropped.
+		std::string fileName = moduleName;
+		ModuleNameParts parts;
+		if (SplitModuleName(fileName, parts))
+			ReplaceAll(fileName, parts.hash + parts.tag, parts.hash);
+		llvm::SmallString<256> filePath(cacheDir);
+		llvm::sys::path::append(filePath, fileName + ".o");
+		outPath = filePath.str();
+		return true;
+	}
+
+	bool JITObjectCache::ReadObjectFile(const std::string& moduleName, std::string& outObj)
+	{
+		std::string filePath;
+		if (!GetObjectFilePath(moduleName, filePath))
+			return false;
+
+		llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer> > objBuffer = llvm::MemoryBuffer::getFile(filePath, -1, false);
+		if (!objBuffer)
+			return false;
+		outObj = (*objBuffer)->getBuffer();
+		RenameModuleInObject(outObj, GetCanonicalName(moduleName), moduleName);
+		return true;
+	}
+
+	void JITObjectCache::notifyObjectCompiled(const llvm::Module* M, llvm::MemoryBufferRef Obj)
+	{
+		const std::string& moduleName = M->getModuleIdentifier();
+		std::string filePath;
+		if (!GetObjectFilePath(moduleName, filePath))
+			return;
+
+		std::string objData = Obj.getBuffer();
+		RenameModuleInObject(objData, moduleName, GetCanonicalName(moduleName));
+
+		// Write to a temporary file first, so that other processes sharing the directory never 
+		// see an object file that is partially written.
+		char tempSuffix[32];
+		sprintf_s(tempSuffix, ".%d.tmp", mTempFileCnt++);
+		std::string tempPath = filePath + tempSuffix;
+		{
+			std::error_code ec;
+			llvm::raw_fd_ostream outFile(tempPath, ec, llvm::sys::fs::F_None);
+			if (ec)
+				return;
+			outFile << objData;
+		}
+		if (llvm::sys::fs::rename(tempPath, filePath))
+			llvm::sys::fs::remove(tempPath);
+	}
+
+	std::unique_ptr<llvm::MemoryBuffer> JITObjectCache::getObject(const llvm::Module* M)
+	{
+		const std::string& moduleName = M->getModuleIdentifier();
+		std::string objData;
+		bool isPinned = false;
+		{
+			std::lock_guard<std::mutex> lock(mPinMutex);
+			std::map<std::string, std::string>::iterator it = mPinnedObjects.find(moduleName);
+			if (it != mPinnedObjects.end()) {
+				objData.swap(it->second);
+				mPinnedObjects.erase(it);
+				isPinned = true;
+			}
+		}
+		if (!isPinned) {
+			std::string filePath;
+			if (!GetObjectFilePath(moduleName, filePath))
+				return nullptr;
+			if (!ReadObjectFile(moduleName, objData)) {
+				++mMisses;
+				return nullptr;
+			}
+		}
+		++mHits;
+		return std::unique_ptr<llvm::MemoryBuffer>(llvm::MemoryBuffer::getMemBufferCopy(objData, moduleName));
+	}
+
+	bool JITObjectCache::SetCacheDir(const std::string& dirName)
+	{
+		if (!dirName.empty() && llvm::sys::fs::create_directories(dirName))
+			return false;
+		std::lock_guard<std::mutex> lock(mDirMutex);
+		mCacheDir = dirName;
+		return true;
+	}
+
+	bool JITObjectCache::PinObject(const llvm::Module* M)
+	{
+		std::string objData;
+		if (!ReadObjectFile(M->getModuleIdentifier(), objData))
+			return false;
+		std::lock_guard<std::mutex> lock(mPinMutex);
+		mPinnedObjects[M->getModuleIdentifier()].swap(objData);
+		return true;
+	}
+
+	bool JITObjectCache::ReadObject(const llvm::Module* M, std::string& outObj)
+	{
+		return ReadObjectFile(M->getModuleIdentifier(), outObj);
+	}
+
+	void JITObjectCache::CountLookup(bool isHit)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mDirMutex);
+			if (mCacheDir.empty())
+				return;
+		}
+		if (isHit)
+			++mHits;
+		else
+			++mMisses;
+	}
+
+	void JITObjectCache::GetStats(int& hits, int& misses)
+	{
+		hits = mHits;
+		misses = mMisses;
+	}
+}
@@ -0,0 +1,75 @@
+#pragma once
+#pragma warning(push)
+
+#pragma warning(disable: 4267 4800 4244 4291 4996)
+#include <llvm/ExecutionEngine/ObjectCache.h>
+#include <llvm/IR/Module.h>
+#pragma warning(pop)
+#include <string>
+#include <map>
+#include <mutex>
+#include <atomic>
+
+
+namespace SC {
+	// The object cache stores the emitted object code of each module in the cache directory, the file is named 
+	// after the content hash of everything the code depends on, which the module identifier starts with.
+	// So that the IR optimization and codegen can be skipped for the module compiled by previous runs.
+	// The identifier continues with the instance tag "_XXXXXXXX"(8 hex digits) after the hash, which keeps the 
+	// symbols of the modules with the same content apart in one context. The tag is not part of the file name, 
+	// the cached object is stored with the zero tag and the symbols are renamed to the tag of the module on 
+	// reading. This covers every occurrence of the module's hash and tag, including the one that the late 
+	// modules(the tier, kernels and drivers) embed in their suffix. The references to the shared code keep its 
+	// name, which is the same for the contexts with the same shared code.
+	// The cache is shared by the execution engines of all the KSC contexts, which may JIT on different threads.
+	class JITObjectCache : public llvm::ObjectCache
+	{
+	private:
+		std::mutex mDirMutex;
+		std::string mCacheDir;
+		std::atomic<int> mHits;
+		std::atomic<int> mMisses;
+		// Makes the temporary file names unique among the threads writing the same object.
+		std::atomic<int> mTempFileCnt;
+		// The objects read ahead by "PinObject", keyed by the module identifier.
+		std::mutex mPinMutex;
+		std::map<std::string, std::string> mPinnedObjects;
+
+		bool GetObjectFilePath(const std::string& moduleName, std::string& outPath);
+		bool ReadObjectFile(const std::string& moduleName, std::string& outObj);
+
+	public:
+		JITObjectCache();
+		virtual ~JITObjectCache();
+
+		virtual void notifyObjectCompiled(const llvm::Module* M, llvm::MemoryBufferRef Obj);
+		virtual std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module* M);
+
+		// Empty directory name disables the cache.
+		bool SetCacheDir(const std::string& dirName);
+		// Read the cached object of the module ahead and keep it for the following "getObject" of the module, so 
+		// the caller decides whether to optimize the module on the object that MCJIT will load for sure.
+		bool PinObject(const llvm::Module* M);
+		// Read the cached object of the module without counting it as a hit.
+		bool ReadObject(const llvm::Module* M, std::string& outObj);
+		// Count the lookup of the objects read by "ReadObject", nothing is counted while the cache is disabled.
+		void CountLookup(bool isHit);
+		void GetStats(int& hits, int& misses);
+
+		// Rename the symbols decorated with the module name "fromName" to "toName" in the object code(or in a single
+		// symbol name), only the content hashes and instance tags are replaced so the length never changes. 
+		// False is returned if either name has no instance tag.
+		static bool RenameModuleInObject(std::string& obj, const std::string& fromName, const std::string& toName);
+
+		// The module name is "<prefix><32-digit content hash>_XXXXXXXX<suffix>", the suffix is empty except for
+		// the late modules. False is returned if the name has no instance tag.
+		struct ModuleNameParts {
+			std::string prefix;
+			std::string hash;
+			// The instance tag along with the leading "_"
+			std::string tag;
+			std::string suffix;
+		};
+		static bool SplitModuleName(const std::string& moduleName, ModuleNameParts& outParts);
+	};
+}
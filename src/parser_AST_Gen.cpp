@@ -322,6 +322,15 @@ bool CompilingContext::IsFunctionDefinePartten()
 	return true;
 }
 
+bool CompilingContext::IsFPModeAttributePartten()
+{
+	Token t0 = PeekNextToken(0);
+	Token t1 = PeekNextToken(1);
+	Token t2 = PeekNextToken(2);
+
+	return t0.IsEqual("[") && (t1.IsEqual("fastmath") || t1.IsEqual("precise")) && t2.IsEqual("]");
+}
+
 bool CompilingContext::IsExternalTypeDefParttern()
 {
 	Token t0 = PeekNextToken(0);
@@ -589,6 +598,33 @@ bool CompilingContext::ParseSingleExpression(CodeDomain* curDomain)
 		}
 		curDomain->AddIfExpression(pIf);
 	}
+	else if (IsFPModeAttributePartten()) {
+		// The "[fastmath]" or "[precise]" attribute applies to the following function or code block.
+		GetNextToken(); // Eat the "["
+		FPMode mode = GetNextToken().IsEqual("fastmath") ? kFPModeFast : kFPModePrecise;
+		GetNextToken(); // Eat the "]"
+
+		if ((curDomain->mExpAllowedFlag & CodeDomain::kAlllowFuncDef) && IsFunctionDefinePartten()) {
+			Exp_FunctionDecl* pFuncDecl = Exp_FunctionDecl::Parse(*this, curDomain);
+			if (!pFuncDecl)
+				return false;
+			pFuncDecl->SetFPMode(mode);
+		}
+		else if (PeekNextToken(0).IsEqual("{")) {
+			GetNextToken(); // Eat the "{"
+			CodeDomain* childDomain = new CodeDomain(curDomain);
+			childDomain->SetFPMode(mode);
+			curDomain->AddDomainExpression(childDomain);
+			if (!ParseCodeDomain(childDomain))
+				return false;
+			if (!ExpectAndEat("}"))
+				return false;
+		}
+		else {
+			AddErrorMessage(firstT, "Function definition or code block is expected after the attribute.");
+			return false;
+		}
+	}
 	else if ((curDomain->mExpAllowedFlag & CodeDomain::kAlllowFuncDef) && IsFunctionDefinePartten()) {
 		// Parse the function declaration.
 		if (!Exp_FunctionDecl::Parse(*this, curDomain))
@@ -740,6 +776,7 @@ CodeDomain::CodeDomain(CodeDomain* parent)
 {
 	mpParentDomain = parent;
 	mExpAllowedFlag = parent ? parent->mExpAllowedFlag : 0;
+	mFPMode = kFPModeInherit;
 }
 
 CodeDomain::~CodeDomain()
@@ -775,6 +812,11 @@ CodeDomain* CodeDomain::GetParent()
 	return mpParentDomain;
 }
 
+void CodeDomain::SetFPMode(FPMode mode)
+{
+	mFPMode = mode;
+}
+
 void CodeDomain::AddValueExpression(Exp_ValueEval* exp)
 {
 	if (exp) {
@@ -1046,7 +1088,7 @@ Exp_ValueEval* CompilingContext::ParseSimpleExpression(CodeDomain* curDomain)
 			// Parse and return the built-in type initializer
 			if (!ExpectAndEat("(")) return NULL;
 
-			std::auto_ptr<Exp_ValueEval> exp[4];
+			std::auto_ptr<Exp_ValueEval> exp[MAX_INITIALIZER_EXPRS];
 			
 			bool succeed = false;
 			Token lastT;
@@ -1063,9 +1105,9 @@ Exp_ValueEval* CompilingContext::ParseSimpleExpression(CodeDomain* curDomain)
 				}
 			}
 
-			Exp_ValueEval* expArray[4] = {exp[0].get(), exp[1].get(), exp[2].get(), exp[3].get()};
-			for (int i = 0; i < tpDesc.elemCnt; ++i)
-				exp[i].release();
+			Exp_ValueEval* expArray[MAX_INITIALIZER_EXPRS];
+			for (int i = 0; i < MAX_INITIALIZER_EXPRS; ++i)
+				expArray[i] = exp[i].release();
 			result.reset(new Exp_BuiltInInitializer(expArray, tpDesc.elemCnt, tpDesc.type));
 		}
 		else if (curDomain->IsVariableDefined(curT.ToStdString(), true)) {
@@ -1334,12 +1376,10 @@ const Exp_VarDef* Exp_VariableRef::GetVarDef() const
 Exp_BuiltInInitializer::Exp_BuiltInInitializer(Exp_ValueEval** pExp, int cnt, VarType tp)
 {
 	mType = tp;
-	mpSubExprs[0] = NULL;
-	mpSubExprs[1] = NULL;
-	mpSubExprs[2] = NULL;
-	mpSubExprs[3] = NULL;
+	for (int i = 0; i < MAX_INITIALIZER_EXPRS; ++i)
+		mpSubExprs[i] = NULL;
 
-	int aCnt = cnt > 4 ? 4 : cnt;
+	int aCnt = cnt > MAX_INITIALIZER_EXPRS ? MAX_INITIALIZER_EXPRS : cnt;
 	for (int i = 0; i < aCnt; ++i) {
 		mpSubExprs[i] = pExp[i];
 	}
@@ -1347,7 +1387,7 @@ Exp_BuiltInInitializer::Exp_BuiltInInitializer(Exp_ValueEval** pExp, int cnt, Va
 
 Exp_BuiltInInitializer::~Exp_BuiltInInitializer()
 {
-	for (int i = 0; i < 4; ++i) {
+	for (int i = 0; i < MAX_INITIALIZER_EXPRS; ++i) {
 		if (mpSubExprs[i])
 			delete mpSubExprs[i];
 	}
@@ -1359,7 +1399,7 @@ bool Exp_BuiltInInitializer::CheckSemantic(TypeInfo& outType, std::string& errMs
 	int ElemCntGiven = 0;
 	bool hasFloat = false;
 	bool SubExpCnt = 0;
-	for (int i = 0; i < 4; ++i) {
+	for (int i = 0; i < MAX_INITIALIZER_EXPRS; ++i) {
 		Exp_ValueEval* curExp = mpSubExprs[i];
 		if (curExp) {
 			TypeInfo typeInfo;
@@ -1657,6 +1697,7 @@ Exp_FunctionDecl::Exp_FunctionDecl(CodeDomain* parent) :
 	mReturnType = VarType::kInvalid;
 	mpRetStruct = NULL;
 	mHasBody = false;
+	mIntrinsic = kIntrinsicNone;
 	mExpAllowedFlag = kAlllowStructDef | kAllowReturnExp | 
 		kAllowValueExp | kAllowVarDef |
 		kAllowVarInit | kAllowIfExp |
@@ -1712,6 +1753,11 @@ bool Exp_FunctionDecl::HasBody() const
 	return mHasBody;
 }
 
+IntrinsicFunc Exp_FunctionDecl::GetIntrinsic() const
+{
+	return mHasBody ? kIntrinsicNone : mIntrinsic;
+}
+
 
 Exp_FunctionDecl* CodeDomain::GetFunctionDeclByName(const std::string& funcName)
 {
@@ -1792,6 +1838,11 @@ Exp_FunctionDecl* Exp_FunctionDecl::Parse(CompilingContext& context, CodeDomain*
 			}
 			argDesc.isArrayPtr = true;
 		}
+		if (argT.IsEqual(KSC_DISPATCH_THREAD_ID) && 
+			(argDesc.typeInfo.type != VarType::kInt || argDesc.isByRef || argDesc.isArrayPtr)) {
+			context.AddErrorMessage(argT, "The argument \"" KSC_DISPATCH_THREAD_ID "\" must be an int passed by value.");
+			return NULL;
+		}
 		argDesc.token = argT;
 		argDesc.typeString = argTypeString;
 		result->mArgments.push_back(argDesc);
@@ -1804,9 +1855,19 @@ Exp_FunctionDecl* Exp_FunctionDecl::Parse(CompilingContext& context, CodeDomain*
 	context.GetNextToken(); // Eat the ")"
 
 	Exp_FunctionDecl* pFuncDef = NULL;
+	bool shadowsBuiltIn = false;
 	if (alreadyDefined) {
 		pFuncDef = curDomain->GetFunctionDeclByName(result->mFuncName);
 		assert(pFuncDef);
+		if (pFuncDef->mIntrinsic != kIntrinsicNone && context.PeekNextToken(0).IsEqual("{")) {
+			// A function body given for a built-in function (e.g. the dot or normalize helpers in the existing
+			// shared code) shadows the built-in one in this domain, the calls after it get the user function.
+			context.AddWarningMessage(curT, "Function shadows the built-in function of the same name, remove it to use the built-in one.");
+			shadowsBuiltIn = true;
+			alreadyDefined = false;
+		}
+	}
+	if (alreadyDefined) {
 		if (!result->HasSamePrototype(*pFuncDef)) {
 			context.AddErrorMessage(curT, "Function declared with different prototype.");
 			return NULL;
@@ -1815,6 +1876,10 @@ Exp_FunctionDecl* Exp_FunctionDecl::Parse(CompilingContext& context, CodeDomain*
 	}
 	else {
 		pFuncDef = result.get();
+		// Only the declarations in the predefined root domain are mapped to the intrinsics, so user code
+		// declaring the external functions of the same names still gets the external ones.
+		if (curDomain->GetParent() == NULL && !shadowsBuiltIn)
+			pFuncDef->mIntrinsic = GetIntrinsicFunc(pFuncDef->mFuncName);
 		curDomain->AddFunctionDefExpression(result.release());
 	}
 
@@ -1972,6 +2037,7 @@ Exp_ValueEval::ValuePtrInfo Exp_ValueEval::GetValuePtr(CG_Context* context) cons
 Exp_FunctionCall::Exp_FunctionCall(Exp_FunctionDecl* pFuncDef, Exp_ValueEval** ppArgs, int cnt)
 {
 	mpFuncDef = pFuncDef;
+	mIntrinsicArgType = VarType::kInvalid;
 	for (int i = 0; i < cnt; ++i) 
 		mInputArgs.push_back(ppArgs[i]);
 }
@@ -1994,6 +2060,70 @@ bool Exp_FunctionCall::CheckSemantic(TypeInfo& outType, std::string& errMsg, std
 		return false;
 	}
 
+	IntrinsicFunc intrinsic = mpFuncDef->GetIntrinsic();
+	if (intrinsic != kIntrinsicNone) {
+		// The intrinsic functions work on the arguments of any width, the arguments can be scalars or vectors
+		// of the same element count, the scalars are splatted to the vectors.
+		if (intrinsic == kIntrinsicAny || intrinsic == kIntrinsicAll) {
+			// any and all reduce the boolean of any width to a single boolean
+			TypeInfo argTypeInfo;
+			if (!mInputArgs[0]->CheckSemantic(argTypeInfo, errMsg, warnMsg))
+				return false;
+			if (!IsBooleanType(argTypeInfo.type)) {
+				errMsg = "Boolean argument is expected.";
+				return false;
+			}
+			mIntrinsicArgType = argTypeInfo.type;
+			outType.type = VarType::kBoolean;
+			mCachedTypeInfo = outType;
+			return true;
+		}
+
+		int elemCnt = 1;
+		bool allInt = true;
+		for (int i = 0; i < reqArgCnt; ++i) {
+			TypeInfo argTypeInfo;
+			if (!mInputArgs[i]->CheckSemantic(argTypeInfo, errMsg, warnMsg))
+				return false;
+			if (!IsFloatType(argTypeInfo.type) && !IsIntegerType(argTypeInfo.type)) {
+				errMsg = "Float or int argument is expected.";
+				return false;
+			}
+			if (!IsIntegerType(argTypeInfo.type))
+				allInt = false;
+			int argElemCnt = TypeElementCnt(argTypeInfo.type);
+			if (argElemCnt > 1) {
+				if (elemCnt > 1 && elemCnt != argElemCnt) {
+					errMsg = "Vector arguments must have the same element count.";
+					return false;
+				}
+				elemCnt = argElemCnt;
+			}
+		}
+
+		// min, max and clamp keep the integer arguments as integers, the others always compute in float.
+		bool isIntOp = allInt && (intrinsic == kIntrinsicMin || intrinsic == kIntrinsicMax || intrinsic == kIntrinsicClamp);
+		mIntrinsicArgType = MakeType(isIntOp ? VarType::kInt : VarType::kFloat, elemCnt);
+		switch (intrinsic) {
+		case kIntrinsicDot:
+		case kIntrinsicLength:
+			outType.type = VarType::kFloat;
+			break;
+		case kIntrinsicCross:
+			if (elemCnt != 3) {
+				errMsg = "cross only accepts float3 arguments.";
+				return false;
+			}
+			outType.type = VarType::kFloat3;
+			break;
+		default:
+			outType.type = mIntrinsicArgType;
+			break;
+		}
+		mCachedTypeInfo = outType;
+		return true;
+	}
+
 	for (int i = 0; i < reqArgCnt; ++i) {
 		Exp_FunctionDecl::ArgDesc* pArgDesc = mpFuncDef->GetArgumentDesc(i);
 		TypeInfo argTypeInfo;
@@ -2059,6 +2189,7 @@ Exp_Indexer::Exp_Indexer(Exp_ValueEval* pExp, Exp_ValueEval* pIndex)
 {
 	mpExp = pExp;
 	mpIndex = pIndex;
+	mIsVectorIndex = false;
 }
 
 Exp_Indexer::~Exp_Indexer()
@@ -2073,7 +2204,7 @@ bool Exp_Indexer::CheckSemantic(TypeInfo& outType, std::string& errMsg, std::vec
 	if (!mpIndex->CheckSemantic(idxType, errMsg, warnMsg))
 		return false;
 
-	if (idxType.type != VarType::kInt) {
+	if (!IsIntegerType(idxType.type)) {
 		errMsg = "Indexer must be integer type.";
 		return false;
 	}
@@ -2085,7 +2216,23 @@ bool Exp_Indexer::CheckSemantic(TypeInfo& outType, std::string& errMsg, std::vec
 		errMsg = "Indexer must be applied to variable of array type.";
 		return false;
 	}
-		
+
+	mIsVectorIndex = (idxType.type != VarType::kInt);
+	if (mIsVectorIndex) {
+		// e.g. "arr[int4]" gathers four elements of the scalar array into a vector
+		if (expType.type == VarType::kStructure || TypeElementCnt(expType.type) != 1) {
+			errMsg = "Vector indexer must be applied to array of scalar type.";
+			return false;
+		}
+		outType.type = MakeType(expType.type, TypeElementCnt(idxType.type));
+		outType.pStructDef = NULL;
+		outType.arraySize = 0;
+		// The gathered vector has no address, so its elements cannot be assigned individually.
+		outType.assignable = false;
+		mCachedTypeInfo = outType;
+		return true;
+	}
+
 	outType.type = expType.type;
 	outType.pStructDef = expType.pStructDef;
 	outType.arraySize = 0;
@@ -2096,6 +2243,9 @@ bool Exp_Indexer::CheckSemantic(TypeInfo& outType, std::string& errMsg, std::vec
 
 bool Exp_Indexer::IsAssignable(bool allowSwizzle) const
 {
+	// The vector index is only assignable as the left value of "=", it cannot be passed by reference.
+	if (mIsVectorIndex)
+		return allowSwizzle;
 	return GetCachedTypeInfo().assignable;
 }
 
@@ -70,6 +70,7 @@ namespace SC {
 		std::hash_map<std::string, Exp_VarDef*> mDefinedVariables;
 		std::hash_map<std::string, Exp_FunctionDecl*> mDefinedFunctions;
 		std::hash_set<std::string> mExternalTypes;
+		FPMode mFPMode;
 	public:
 		std::vector<Expression*> mExpressions;
 		enum ParsingStatus {
@@ -96,6 +97,7 @@ namespace SC {
 		virtual bool HasReturnExpForAllPaths();
 
 		CodeDomain* GetParent();
+		void SetFPMode(FPMode mode);
 
 		void AddValueExpression(Exp_ValueEval* exp);
 		void AddStructDefExpression(Exp_StructDef* exp);
@@ -250,7 +252,7 @@ namespace SC {
 	class Exp_BuiltInInitializer : public Exp_ValueEval
 	{
 	private:
-		Exp_ValueEval* mpSubExprs[4];
+		Exp_ValueEval* mpSubExprs[MAX_INITIALIZER_EXPRS];
 		VarType mType;
 
 	public:
@@ -313,6 +315,8 @@ namespace SC {
 	private:
 		Exp_ValueEval* mpExp;
 		Exp_ValueEval* mpIndex;
+		// The index is an integer vector, the elements are gathered into(or scattered from) a vector.
+		bool mIsVectorIndex;
 
 	public:
 		Exp_Indexer(Exp_ValueEval* pExp, Exp_ValueEval* pIndex);
@@ -345,6 +349,7 @@ namespace SC {
 		std::string mFuncName;
 		std::vector<ArgDesc> mArgments;
 		bool mHasBody;
+		IntrinsicFunc mIntrinsic;
 
 	public:
 		Exp_FunctionDecl(CodeDomain* parent);
@@ -357,6 +362,7 @@ namespace SC {
 		ArgDesc* GetArgumentDesc(int idx);
 		bool HasSamePrototype(const Exp_FunctionDecl& ref) const;
 		bool HasBody() const;
+		IntrinsicFunc GetIntrinsic() const;
 		void ConvertToDescription(KSC_FunctionDesc& desc, CG_Context& ctx);
 
 		static Exp_FunctionDecl* Parse(CompilingContext& context, CodeDomain* curDomain);
@@ -380,6 +386,8 @@ namespace SC {
 	private:
 		std::vector<Exp_ValueEval*> mInputArgs;
 		Exp_FunctionDecl* mpFuncDef;
+		// The type all the arguments are converted to when calling an intrinsic function
+		VarType mIntrinsicArgType;
 	public:
 		Exp_FunctionCall(Exp_FunctionDecl* pFuncDef, Exp_ValueEval** ppArgs, int cnt);
 		virtual ~Exp_FunctionCall();
@@ -481,6 +489,7 @@ namespace SC {
 		bool IsVarDefinePartten(bool allowInit);
 		bool IsStructDefinePartten();
 		bool IsFunctionDefinePartten();
+		bool IsFPModeAttributePartten();
 		bool IsExternalTypeDefParttern();
 		bool IsIfExpPartten();
 
@@ -190,6 +190,48 @@ VarType MakeType(VarType baseType, int elemCnt)
 	return VarType::kInvalid;
 }
 
+IntrinsicFunc GetIntrinsicFunc(const std::string& funcName)
+{
+	if (funcName == "sin")
+		return kIntrinsicSin;
+	else if (funcName == "cos")
+		return kIntrinsicCos;
+	else if (funcName == "pow")
+		return kIntrinsicPow;
+	else if (funcName == "sqrt")
+		return kIntrinsicSqrt;
+	else if (funcName == "fabs")
+		return kIntrinsicFabs;
+	else if (funcName == "dot")
+		return kIntrinsicDot;
+	else if (funcName == "cross")
+		return kIntrinsicCross;
+	else if (funcName == "length")
+		return kIntrinsicLength;
+	else if (funcName == "normalize")
+		return kIntrinsicNormalize;
+	else if (funcName == "lerp")
+		return kIntrinsicLerp;
+	else if (funcName == "saturate")
+		return kIntrinsicSaturate;
+	else if (funcName == "mad")
+		return kIntrinsicMad;
+	else if (funcName == "rsqrt")
+		return kIntrinsicRsqrt;
+	else if (funcName == "min")
+		return kIntrinsicMin;
+	else if (funcName == "max")
+		return kIntrinsicMax;
+	else if (funcName == "clamp")
+		return kIntrinsicClamp;
+	else if (funcName == "any")
+		return kIntrinsicAny;
+	else if (funcName == "all")
+		return kIntrinsicAll;
+	else
+		return kIntrinsicNone;
+}
+
 int ConvertSwizzle(const char* swizzleStr, int swizzleIdx[4])
 {
 	int cnt = 0;
@@ -262,6 +304,11 @@ bool IsTypeCompatible(VarType dest, VarType from, bool& FtoIwarning)
 } // namespace SC
 
 
+KSC_StructDesc::KSC_StructDesc()
+{
+	pContext = NULL;
+}
+
 KSC_StructDesc::~KSC_StructDesc()
 {
 	for (int i = 0; i < (int)this->size(); ++i) {
@@ -270,6 +317,17 @@ KSC_StructDesc::~KSC_StructDesc()
 	}
 }
 
+KSC_ModuleDesc::KSC_ModuleDesc()
+{
+	M = NULL;
+	mpEngine = NULL;
+	mCodeEmitted = false;
+	mSourceIR = NULL;
+	mTierUpM = NULL;
+	mPartitionCnt = 0;
+	pContext = NULL;
+}
+
 KSC_ModuleDesc::~KSC_ModuleDesc()
 {
 	{
@@ -287,10 +345,18 @@ KSC_ModuleDesc::~KSC_ModuleDesc()
 	}
 }
 
+KSC_FunctionDesc::KSC_FunctionDesc()
+{
+	KSC_TypeInfo voidType = {SC::VarType::kVoid, 0, 0, 0, NULL, NULL, false, false};
+	mReturnType = voidType;
+}
+
 KSC_FunctionDesc::~KSC_FunctionDesc()
 {
 	for (int i = 0; i < (int)mArgumentTypes.size(); ++i) {
 		if (mArgumentTypes[i].type == SC::VarType::kStructure)
 			delete (KSC_StructDesc*)mArgumentTypes[i].hStruct;
 	}
+	if (mReturnType.type == SC::VarType::kStructure)
+		delete (KSC_StructDesc*)mReturnType.hStruct;
 }
\ No newline at end of file
@@ -1,12 +1,18 @@
 #pragma once
 #define MAX_TOKEN_LENGTH 100
+// The max count of the sub-expressions in a built-in type initializer, e.g. float8(...)
+#define MAX_INITIALIZER_EXPRS 8
 #include "../inc/SC_API.h"
 #include <vector>
+#include <map>
 #include <hash_map>
 #include <string>
+#include <atomic>
 
 namespace llvm {
 	class Function;
+	class Module;
+	class ExecutionEngine;
 }
 
 namespace SC {
@@ -32,6 +38,37 @@ namespace SC {
 		kFalse
 	};
 
+	// The predefined functions that are lowered to LLVM intrinsics instead of calls to the external symbols.
+	enum IntrinsicFunc {
+		kIntrinsicNone,
+		kIntrinsicSin,
+		kIntrinsicCos,
+		kIntrinsicPow,
+		kIntrinsicSqrt,
+		kIntrinsicFabs,
+		kIntrinsicDot,
+		kIntrinsicCross,
+		kIntrinsicLength,
+		kIntrinsicNormalize,
+		kIntrinsicLerp,
+		kIntrinsicSaturate,
+		kIntrinsicMad,
+		kIntrinsicRsqrt,
+		kIntrinsicMin,
+		kIntrinsicMax,
+		kIntrinsicClamp,
+		kIntrinsicAny,
+		kIntrinsicAll
+	};
+	IntrinsicFunc GetIntrinsicFunc(const std::string& funcName);
+
+	// The floating point mode of a code domain, which decides whether the float operations get the fast-math flags.
+	enum FPMode {
+		kFPModeInherit,
+		kFPModeFast,
+		kFPModePrecise
+	};
+
 	struct TypeDesc {
 		VarType type;
 		int elemCnt;
@@ -43,10 +80,12 @@ namespace SC {
 } // namespace SC
 
 
+struct KSC_Context;
 
 class KSC_StructDesc : public std::vector<KSC_TypeInfo>
 {
 public:
+	KSC_StructDesc();
 	~KSC_StructDesc();
 	struct MemberInfo
 	{
@@ -58,27 +97,72 @@ public:
 	int mStructSize;
 	int mAlignment;
 	std::hash_map<std::string, MemberInfo> mMemberIndices;
+	// The context that the structure is compiled in, whose code generator computes its layouts.
+	KSC_Context* pContext;
 };
 
+class KSC_ModuleDesc;
+
 class KSC_FunctionDesc
 {
 public:
+	KSC_FunctionDesc();
 	~KSC_FunctionDesc();
 
 	std::vector<KSC_TypeInfo> mArgumentTypes;
 	std::vector<std::string> mArgTypeStrings;
+	// The type of the return value, the packed wrapper converts the boolean vectors by it.
+	KSC_TypeInfo mReturnType;
 	llvm::Function* F;
 	std::vector<int> needJITPacked;
+	KSC_ModuleDesc* pModule;
+	// The symbol name of the function that the JIT-ed pointer is retrieved from, which is the wrapper 
+	// with packed arguments if the function needs one.
+	std::string mEntryName;
+	// The slot holding the current target of the tier-up stub, NULL if the module is not tiered.
+	void** pTierSlot;
+	// The JIT-ed kernels of this function, keyed by the SIMD width.
+	std::map<int, void*> mKernelPtrs;
+	// The JIT-ed array drivers of this function, keyed by the strides of the arguments and the return value.
+	std::map<std::vector<int>, void*> mArrayDriverPtrs;
+	// The JIT-ed range drivers for the dispatch, keyed the same as the array drivers.
+	std::map<std::vector<int>, void*> mDispatchDriverPtrs;
 
-	void* pJIT_Func;
+	// The JIT-ed pointer, it is published once the code is finalized and never changes afterwards, so the
+	// readers load it without taking the lock of the context.
+	std::atomic<void*> pJIT_Func;
 };
 
 class KSC_ModuleDesc
 {
 public:
+	KSC_ModuleDesc();
 	~KSC_ModuleDesc();
 
 	std::hash_map<std::string, KSC_StructDesc*> mGlobalStructures;
 	std::hash_map<std::string, KSC_FunctionDesc*> mFunctionDesc;
-
+	// The functions sorted by name, which is built once the module is compiled(or loaded) and never changes
+	// afterwards, so the lookups by name read it without any lock.
+	std::vector<std::pair<std::string, KSC_FunctionDesc*> > mFunctionTable;
+	// The LLVM module owned by the execution engine once the module is compiled successfully.
+	llvm::Module* M;
+	// The execution engine of this module and its late modules, which owns their JIT-ed code and data.
+	// The predefined module has none, it is JIT-ed by the engine of the context.
+	llvm::ExecutionEngine* mpEngine;
+	// Whether the machine code of the module has been generated.
+	bool mCodeEmitted;
+	// The options this module is compiled with.
+	KSC_CompileOptions mOptions;
+	// The IR before optimization, which the modules JIT-ed later(e.g. the optimized tier and the kernels)
+	// are built from. It is not added to the execution engine.
+	llvm::Module* mSourceIR;
+	// The modules JIT-ed after this module, they are owned by the execution engine of this module.
+	std::vector<llvm::Module*> mLateModules;
+	// The optimized tier of the tiered module, it is one of the late modules.
+	llvm::Module* mTierUpM;
+	// The count of the parts the module is JIT-ed in, or zero if it is JIT-ed as a whole. The partitioned module
+	// is not kept by the execution engine, which gets the object code of the parts instead.
+	int mPartitionCnt;
+	// The context that owns the module, all the APIs on the module work in this context.
+	KSC_Context* pContext;
 };
@@ -1,5 +1,6 @@
 #include "parser_tokenizer.h"
 #include "parser_defines.h"
+#include <mutex>
 namespace SC {
 
 	Token Token::sInvalid = Token(NULL, 0, 0, Token::kUnknown);
@@ -7,9 +8,17 @@ namespace SC {
 
 	static std::hash_map<std::string, TypeDesc> s_BuiltInTypes;
 	static std::hash_map<std::string, KeyWord> s_KeyWords;
+	// The tables are shared by all the KSC contexts and only read while parsing, they are filled by
+	// the first context and cleared when the last one is destroyed.
+	static std::mutex s_tokenizerMutex;
+	static int s_tokenizerRefCnt = 0;
 
 	void Initialize_Tokenizer()
 	{
+		std::lock_guard<std::mutex> lock(s_tokenizerMutex);
+		if (s_tokenizerRefCnt++ > 0)
+			return;
+
 		s_BuiltInTypes["float"] = TypeDesc(kFloat, 1, false);
 		s_BuiltInTypes["float2"] = TypeDesc(kFloat2, 2, false);
 		s_BuiltInTypes["float3"] = TypeDesc(kFloat3, 3, false);
@@ -29,10 +38,12 @@ namespace SC {
 		s_BuiltInTypes["bool8"] = TypeDesc(kBoolean8, 8, true);
 		s_BuiltInTypes["void"] = TypeDesc(kVoid, 0, true);
 
+		// The native width types are aliases of the built-in types with the SIMD width of the target machine,
+		// the width is 1, 4 or 8 so the type is always one of the existing vector types.
 		int machine_opt_width = KSC_GetSIMDWidth();
-		//s_BuiltInTypes["float_n"] = TypeDesc(VarType(kFloat + machine_opt_width - 1), machine_opt_width, false);
-		//s_BuiltInTypes["int_n"] = TypeDesc(VarType(kInt + machine_opt_width - 1), machine_opt_width, false);
-		//s_BuiltInTypes["bool_n"] = TypeDesc(VarType(kBoolean + machine_opt_width - 1), machine_opt_width, false);
+		s_BuiltInTypes["float_n"] = TypeDesc(VarType(kFloat + machine_opt_width - 1), machine_opt_width, false);
+		s_BuiltInTypes["int_n"] = TypeDesc(VarType(kInt + machine_opt_width - 1), machine_opt_width, true);
+		s_BuiltInTypes["bool_n"] = TypeDesc(VarType(kBoolean + machine_opt_width - 1), machine_opt_width, true);
 
 		s_KeyWords["struct"] = kStructDef;
 		s_KeyWords["if"] = kIf;
@@ -46,11 +57,25 @@ namespace SC {
 
 	void Finish_Tokenizer()
 	{
+		std::lock_guard<std::mutex> lock(s_tokenizerMutex);
+		if (s_tokenizerRefCnt == 0 || --s_tokenizerRefCnt > 0)
+			return;
 		s_BuiltInTypes.clear();
 		s_KeyWords.clear();
 	}
 
 
+	bool GetBuiltInTypeByName(const char* typeName, TypeDesc* out_type)
+	{
+		std::hash_map<std::string, TypeDesc>::iterator it = s_BuiltInTypes.find(typeName);
+		if (it != s_BuiltInTypes.end()) {
+			if (out_type) *out_type = it->second;
+			return true;
+		}
+		else
+			return false;
+	}
+
 	bool IsBuiltInType(const Token& token, TypeDesc* out_type)
 	{
 		char tempString[MAX_TOKEN_LENGTH];
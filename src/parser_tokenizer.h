@@ -10,6 +10,7 @@ namespace SC {
 	void Finish_Tokenizer();
 
 	bool IsBuiltInType(const Token& token, TypeDesc* out_type = NULL);
+	bool GetBuiltInTypeByName(const char* typeName, TypeDesc* out_type = NULL);
 	bool IsKeyWord(const Token& token, KeyWord* out_key = NULL);
 	bool IsFirstN_Equal(const char* test_str, const char* dest);
 